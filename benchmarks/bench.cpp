@@ -0,0 +1,542 @@
+#include "svg.hpp"
+#include <chrono>
+#include <iostream>
+
+/** Benchmarks for the SVG library
+ *
+ *  Usage: SVG_Bench [image size] [number of elements] [max frames]
+ *
+ *  Results are written to stdout as JSON, e.g.
+ *  {"results": [{"name": "serialize", "elements": 200000, "seconds": 0.25, ...}, ...]}
+ *  while progress is echoed to stderr.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(const Clock::time_point& start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+class Report {
+public:
+    using Values = std::vector<std::pair<std::string, double>>;
+
+    void add(const std::string& name, const Values& values) {
+        /** Record one measurement, given as a flat list of named numbers */
+        std::cerr << name << ":";
+        for (auto& value : values)
+            std::cerr << " " << value.first << "=" << value.second;
+        std::cerr << std::endl;
+        this->results.push_back(std::make_pair(name, values));
+    }
+
+    void write(std::ostream& out) {
+        out.precision(12);
+        out << "{\"results\": [";
+        for (size_t i = 0; i < this->results.size(); i++) {
+            out << (i ? ",\n    " : "\n    ") << "{\"name\": "
+                << SVG::util::json_escape(this->results[i].first);
+            for (auto& value : this->results[i].second) {
+                out << ", \"" << value.first << "\": ";
+                if (std::isfinite(value.second)) out << value.second;
+                else out << "null";
+            }
+            out << "}";
+        }
+        out << "\n]}" << std::endl;
+    }
+
+private:
+    std::vector<std::pair<std::string, Values>> results;
+};
+
+Report report;
+
+SVG::SVG synthetic_document(const size_t n_elements) {
+    /** A document of overlapping, partially transparent circles and rectangles */
+    SVG::SVG root;
+    root.set_attr("viewBox", "0 0 1000 1000");
+    root.style("circle").set_attr("fill", "orange").set_attr("fill-opacity", 0.7);
+    root.style("rect").set_attr("fill", "teal").set_attr("stroke", "black");
+
+    auto shapes = root.add_child<SVG::Group>();
+    for (size_t i = 0; i < n_elements; i++) {
+        double x = (i * 7919) % 1000, y = (i * 104729) % 1000;
+        if (i % 2) shapes->add_child<SVG::Circle>(x, y, 2 + i % 15);
+        else shapes->add_child<SVG::Rect>(x, y, 5 + i % 20, 5 + i % 10);
+    }
+
+    return root;
+}
+
+std::vector<size_t> powers_of_ten(const size_t from, const size_t to) {
+    std::vector<size_t> ret;
+    for (size_t n = from; n <= to; n *= 10) ret.push_back(n);
+    return ret;
+}
+
+void bench_rasterize(const unsigned int size, const size_t n_elements) {
+    auto root = synthetic_document(n_elements);
+
+    auto start = Clock::now();
+    SVG::Rasterizer rasterizer(root, size, size);
+    report.add("rasterize_flatten", { { "elements", n_elements }, { "seconds", seconds_since(start) } });
+
+    double baseline = 0;
+    const unsigned int max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned int n_threads = 1; ; n_threads = std::min(n_threads * 2, max_threads)) {
+        start = Clock::now();
+        auto canvas = rasterizer.render(SVG::WHITE, n_threads);
+        double elapsed = seconds_since(start);
+        if (n_threads == 1) baseline = elapsed;
+
+        report.add("rasterize", { { "pixels", (double)size * size }, { "threads", n_threads },
+            { "seconds", elapsed }, { "speedup", baseline / elapsed } });
+        if (n_threads == max_threads) break;
+    }
+}
+
+void bench_add_child(const size_t n_elements) {
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < n_elements; i++)
+        group->add_child<SVG::Circle>(i % 1000, i / 1000, 5);
+    double elapsed = seconds_since(start);
+
+    report.add("add_child", { { "elements", n_elements }, { "seconds", elapsed },
+        { "elements_per_s", n_elements / elapsed } });
+}
+
+void bench_build(const size_t n_elements) {
+    const size_t n_parts = 64, per_part = n_elements / n_parts;
+    auto build = [per_part](const size_t part) -> std::unique_ptr<SVG::Element> {
+        auto group = std::make_unique<SVG::Group>();
+        for (size_t i = 0; i < per_part; i++)
+            group->add_child<SVG::Circle>(i % 1000, part, 5);
+        return group;
+    };
+
+    const unsigned int max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned int n_threads = 1; ; n_threads = std::min(n_threads * 2, max_threads)) {
+        SVG::SVG root;
+        auto start = Clock::now();
+        SVG::build_parallel(root, n_parts, build, n_threads);
+        double elapsed = seconds_since(start);
+        report.add("build_parallel", { { "elements", n_parts * per_part }, { "threads", n_threads },
+            { "seconds", elapsed }, { "elements_per_s", n_parts * per_part / elapsed } });
+        if (n_threads == max_threads) break;
+    }
+}
+
+void bench_serialize(const size_t n_elements) {
+    auto root = synthetic_document(n_elements);
+    auto circle = root.get_children<SVG::Circle>()[0];
+
+    auto start = Clock::now();
+    std::string output = root;
+    double cold = seconds_since(start);
+
+    // With caching, only the changed element and its ancestors are formatted again
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialize(cached);
+    start = Clock::now();
+    circle->set_attr("r", 100);
+    output = root.serialize(cached);
+    double warm = seconds_since(start);
+
+    report.add("serialize", { { "elements", n_elements }, { "bytes", output.size() },
+        { "seconds", cold }, { "elements_per_s", n_elements / cold }, { "mb_per_s", output.size() / 1e6 / cold } });
+    report.add("serialize_after_change", { { "elements", n_elements }, { "seconds", warm } });
+}
+
+void bench_serialized_size(const size_t n_elements) {
+    auto root = synthetic_document(n_elements);
+    auto circle = root.get_children<SVG::Circle>()[0];
+
+    auto start = Clock::now();
+    size_t size = root.serialized_size();
+    double cold = seconds_since(start);
+
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialized_size(cached);
+    start = Clock::now();
+    circle->set_attr("r", 100);
+    size = root.serialized_size(cached);
+    double warm = seconds_since(start);
+
+    report.add("serialized_size", { { "elements", n_elements }, { "bytes", size },
+        { "seconds", cold }, { "elements_per_s", n_elements / cold } });
+    report.add("serialized_size_after_change", { { "elements", n_elements }, { "seconds", warm } });
+}
+
+void bench_chunked(const size_t n_elements) {
+    auto root = synthetic_document(n_elements);
+    SVG::ChunkedSerializer serializer(root);
+    std::string chunk;
+    size_t size = 0, n_chunks = 0;
+
+    auto start = Clock::now();
+    while (serializer.next(chunk)) {
+        size += chunk.size();
+        n_chunks++;
+    }
+    double elapsed = seconds_since(start);
+    report.add("serialize_chunked", { { "elements", n_elements }, { "bytes", size }, { "chunks", n_chunks },
+        { "seconds", elapsed }, { "mb_per_s", size / 1e6 / elapsed } });
+}
+
+void bench_parse(const size_t n_elements) {
+    const std::string text = synthetic_document(n_elements);
+
+    auto start = Clock::now();
+    auto parsed = SVG::parse(text);
+    double elapsed = seconds_since(start);
+    report.add("parse", { { "elements", n_elements }, { "bytes", text.size() },
+        { "seconds", elapsed }, { "mb_per_s", text.size() / 1e6 / elapsed } });
+}
+
+void bench_binary(const size_t n_elements) {
+    auto root = synthetic_document(n_elements);
+
+    auto start = Clock::now();
+    auto binary = SVG::to_binary(root);
+    double write = seconds_since(start);
+
+    start = Clock::now();
+    auto decoded = SVG::from_binary(binary);
+    double read = seconds_since(start);
+
+    report.add("binary_write", { { "bytes", binary.size() }, { "seconds", write },
+        { "mb_per_s", binary.size() / 1e6 / write } });
+    report.add("binary_read", { { "bytes", binary.size() }, { "seconds", read },
+        { "mb_per_s", binary.size() / 1e6 / read } });
+}
+
+void bench_mapped(const size_t n_elements) {
+    const std::string filename = "bench_mapped.svg";
+    auto root = synthetic_document(n_elements);
+    {
+        std::ofstream outfile(filename, std::ios::binary);
+        outfile << root;
+    }
+
+    {
+        auto start = Clock::now();
+        SVG::MappedDocument doc(filename);
+        report.add("mapped_index", { { "elements", doc.size() }, { "seconds", seconds_since(start) } });
+
+        start = Clock::now();
+        std::ofstream outfile("bench_mapped_out.svg", std::ios::binary);
+        doc.get_element_by_id("nonexistent");
+        doc.write(outfile);
+        report.add("mapped_scan_and_write", { { "elements", doc.size() }, { "seconds", seconds_since(start) } });
+    }
+
+    std::remove(filename.c_str());
+    std::remove("bench_mapped_out.svg");
+}
+
+void bench_file_output(const size_t n_elements) {
+    const std::string filename = "bench_output.svg";
+    double blocking, async, mapped;
+    size_t size;
+    {
+        auto root = synthetic_document(n_elements);
+        auto start = Clock::now();
+        std::ofstream outfile(filename, std::ios::binary);
+        outfile << root;
+        outfile.close();
+        blocking = seconds_since(start);
+        size = std::ifstream(filename, std::ios::binary | std::ios::ate).tellg();
+    }
+    {
+        auto root = synthetic_document(n_elements);
+        auto start = Clock::now();
+        SVG::AsyncFileWriter outfile(filename);
+        outfile << root;
+        outfile.close();
+        async = seconds_since(start);
+    }
+    {
+        auto root = synthetic_document(n_elements);
+        auto start = Clock::now();
+        SVG::MappedWriter outfile(filename);
+        outfile.write(root);
+        outfile.close();
+        mapped = seconds_since(start);
+    }
+
+    report.add("file_output_blocking", { { "elements", n_elements }, { "seconds", blocking } });
+    report.add("file_output_async", { { "elements", n_elements }, { "seconds", async },
+        { "mb_per_s", size / 1e6 / async } });
+    report.add("file_output_mapped", { { "elements", n_elements }, { "seconds", mapped },
+        { "mb_per_s", size / 1e6 / mapped }, { "threads", std::thread::hardware_concurrency() } });
+    std::remove(filename.c_str());
+}
+
+void bench_streaming(const size_t n_elements) {
+    /** Build, autoscale and write a document as a tree, or with StreamingBuilder */
+    const std::string filename = "bench_output.svg";
+    double tree, streaming;
+    {
+        auto start = Clock::now();
+        auto root = synthetic_document(n_elements);
+        root.autoscale();
+        std::ofstream outfile(filename, std::ios::binary);
+        outfile << root;
+        outfile.close();
+        tree = seconds_since(start);
+    }
+    {
+        auto start = Clock::now();
+        SVG::SVG root;
+        root.set_attr("viewBox", "0 0 1000 1000");
+        root.style("circle").set_attr("fill", "orange").set_attr("fill-opacity", 0.7);
+        root.style("rect").set_attr("fill", "teal").set_attr("stroke", "black");
+
+        std::ofstream outfile(filename, std::ios::binary);
+        SVG::StreamingBuilder builder(outfile, std::move(root));
+        builder.open(SVG::Group());
+        for (size_t i = 0; i < n_elements; i++) {
+            double x = (i * 7919) % 1000, y = (i * 104729) % 1000;
+            if (i % 2) builder << SVG::Circle(x, y, 2 + i % 15);
+            else builder << SVG::Rect(x, y, 5 + i % 20, 5 + i % 10);
+        }
+        builder.finish();
+        outfile.close();
+        streaming = seconds_since(start);
+    }
+
+    report.add("build_write_tree", { { "elements", n_elements }, { "seconds", tree } });
+    report.add("build_write_streaming", { { "elements", n_elements }, { "seconds", streaming } });
+    std::remove(filename.c_str());
+}
+
+void bench_incremental(const size_t n_files, const size_t n_elements) {
+    /** Write many documents, then write them all again with only one changed */
+    std::vector<SVG::SVG> docs;
+    for (size_t i = 0; i < n_files; i++) docs.push_back(synthetic_document(n_elements));
+    auto filename = [](const size_t i) { return "bench_output_" + std::to_string(i) + ".svg"; };
+
+    SVG::IncrementalWriter writer;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n_files; i++) writer.write(docs[i], filename(i));
+    double first = seconds_since(start);
+
+    docs[0].get_children<SVG::Circle>()[0]->set_attr("r", 100);
+    start = Clock::now();
+    for (size_t i = 0; i < n_files; i++) writer.write(docs[i], filename(i));
+    double second = seconds_since(start);
+
+    report.add("incremental_first_run", { { "files", n_files }, { "seconds", first } });
+    report.add("incremental_second_run", { { "files", n_files }, { "written", writer.files_written() - n_files },
+        { "seconds", second } });
+    for (size_t i = 0; i < n_files; i++) std::remove(filename(i).c_str());
+}
+
+void bench_gather(const size_t n_elements) {
+    /** Rewrite a document after changing one element, copying it into one string or
+     *  writing straight from the cached fragments
+     */
+    const std::string filename = "bench_output.svg";
+    auto root = synthetic_document(n_elements);
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialize(cached); // Fill the caches
+    auto circles = root.get_children<SVG::Circle>();
+
+    const size_t n_rounds = 5;
+    double contiguous = 0, gathered = 0;
+    size_t size = 0;
+    for (size_t i = 0; i < n_rounds; i++) {
+        circles[i]->set_attr("r", 1);
+        auto start = Clock::now();
+        std::ofstream outfile(filename, std::ios::binary);
+        root.serialize(outfile, cached);
+        outfile.close();
+        contiguous += seconds_since(start);
+
+        circles[i + n_rounds]->set_attr("r", 1);
+        start = Clock::now();
+        SVG::GatherWriter gather(filename);
+        gather.write(root);
+        gather.close();
+        gathered += seconds_since(start);
+        size = gather.bytes_written();
+    }
+
+    report.add("rewrite_contiguous", { { "bytes", size }, { "seconds", contiguous / n_rounds },
+        { "mb_per_s", size / 1e6 / (contiguous / n_rounds) } });
+    report.add("rewrite_gathered", { { "bytes", size }, { "seconds", gathered / n_rounds },
+        { "mb_per_s", size / 1e6 / (gathered / n_rounds) } });
+    std::remove(filename.c_str());
+}
+
+void bench_lookup(const size_t n_elements) {
+    auto root = synthetic_document(n_elements);
+    std::vector<SVG::Element*> shapes;
+    for (auto& tag : root.get_children())
+        shapes.insert(shapes.end(), tag.second.begin(), tag.second.end());
+    for (size_t i = 0; i < shapes.size(); i++)
+        shapes[i]->set_attr("id", "e" + std::to_string(i));
+
+    // Look up ids spread evenly through the document
+    const size_t n_lookups = 20;
+    size_t found = 0;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n_lookups; i++)
+        found += root.get_element_by_id("e" + std::to_string(i * shapes.size() / n_lookups)) != nullptr;
+    double by_id = seconds_since(start) / n_lookups;
+    report.add("get_element_by_id", { { "elements", n_elements }, { "seconds_per_call", by_id },
+        { "found", found } });
+
+    // Checking the type of every element, once each
+    start = Clock::now();
+    found = 0;
+    for (auto& child : shapes)
+        if (typeid(*child) == typeid(SVG::Circle)) found++;
+    double rtti = seconds_since(start) / shapes.size();
+
+    report.add("filter_typeid", { { "elements", n_elements }, { "seconds_per_call", rtti }, { "found", found } });
+
+    found = 0;
+    start = Clock::now();
+    for (auto& child : shapes)
+        if (child->kind() == SVG::ElementKind::Circle) found++;
+    double kind = seconds_since(start) / shapes.size();
+    report.add("filter_kind", { { "elements", n_elements }, { "seconds_per_call", kind }, { "found", found } });
+
+    // One call, which scans the whole document
+    start = Clock::now();
+    found = root.get_children<SVG::Circle>().size();
+    report.add("get_children", { { "elements", n_elements }, { "seconds", seconds_since(start) },
+        { "found", found } });
+}
+
+void bench_autoscale(const size_t n_elements) {
+    // Wide: every element is a child of the same group
+    {
+        auto root = synthetic_document(n_elements);
+        auto circle = root.get_children<SVG::Circle>()[0];
+
+        auto start = Clock::now();
+        root.autoscale();
+        double cold = seconds_since(start);
+
+        start = Clock::now();
+        circle->set_attr("r", 50);
+        root.autoscale();
+        report.add("autoscale_wide", { { "elements", n_elements }, { "seconds", cold },
+            { "seconds_after_change", seconds_since(start) } });
+    }
+
+    // Deep: each group holds a circle and the next group
+    {
+        const size_t depth = std::min(n_elements, (size_t)5000);
+        SVG::SVG root;
+        SVG::Element* current = &root;
+        SVG::Circle* deepest = nullptr;
+        for (size_t i = 0; i < depth; i++) {
+            deepest = current->add_child<SVG::Circle>(i, i, 1);
+            current = current->add_child<SVG::Group>();
+        }
+
+        auto start = Clock::now();
+        root.autoscale();
+        double cold = seconds_since(start);
+
+        start = Clock::now();
+        deepest->set_attr("r", 50);
+        root.autoscale();
+        report.add("autoscale_deep", { { "depth", depth }, { "seconds", cold },
+            { "seconds_after_change", seconds_since(start) } });
+    }
+}
+
+void bench_convex_hull(const size_t max_points) {
+    for (auto n_points : powers_of_ten(1000, max_points)) {
+        // Points scattered in a disc, so the hull has few vertices
+        std::vector<SVG::Point> points;
+        for (size_t i = 0; i < n_points; i++) {
+            const double angle = i * 2.399963, radius = 1000 * std::sqrt((double)((i * 7919) % n_points) / n_points);
+            points.push_back(SVG::Point(radius * std::cos(angle), radius * std::sin(angle)));
+        }
+
+        auto start = Clock::now();
+        auto hull = SVG::util::convex_hull(points);
+        report.add("convex_hull", { { "points", n_points }, { "hull_points", hull.size() },
+            { "seconds", seconds_since(start) } });
+    }
+
+    for (auto n_shapes : powers_of_ten(100, max_points / 10)) {
+        auto root = synthetic_document(n_shapes);
+        std::vector<SVG::Shape*> shapes;
+        for (auto& circle : root.get_children<SVG::Circle>()) shapes.push_back(circle);
+        for (auto& rect : root.get_children<SVG::Rect>()) shapes.push_back(rect);
+
+        auto start = Clock::now();
+        auto polygon = SVG::bounding_polygon(shapes);
+        report.add("bounding_polygon", { { "shapes", n_shapes }, { "hull_points", polygon.size() },
+            { "seconds", seconds_since(start) } });
+    }
+}
+
+std::vector<SVG::SVG> make_frames(const size_t n_frames) {
+    std::vector<SVG::SVG> frames(n_frames);
+    for (size_t i = 0; i < n_frames; i++)
+        frames[i].add_child<SVG::Circle>(i % 100, (i * 7) % 100, 5 + i % 10);
+    return frames;
+}
+
+void bench_frames(const size_t max_frames) {
+    for (auto n_frames : powers_of_ten(1000, max_frames)) {
+        auto frames = make_frames(n_frames);
+        auto start = Clock::now();
+        auto merged = SVG::merge(frames, 10000, 100);
+        report.add("merge", { { "frames", n_frames }, { "seconds", seconds_since(start) } });
+
+        frames = make_frames(n_frames);
+        start = Clock::now();
+        auto animation = SVG::frame_animate(frames, 24);
+        report.add("frame_animate", { { "frames", n_frames }, { "seconds", seconds_since(start) } });
+
+        std::stringstream out;
+        start = Clock::now();
+        SVG::frame_animate(out, n_frames, 24, 100, 100, [](const size_t i) {
+            SVG::SVG frame;
+            frame.add_child<SVG::Circle>(i % 100, (i * 7) % 100, 5 + i % 10);
+            return frame;
+        });
+        report.add("frame_animate_streaming", { { "frames", n_frames }, { "bytes", out.str().size() },
+            { "seconds", seconds_since(start) } });
+    }
+}
+
+int main(int argc, char** argv) {
+    const unsigned int size = argc > 1 ? std::stoi(argv[1]) : 4096;
+    const size_t n_elements = argc > 2 ? std::stoul(argv[2]) : 20000;
+    const size_t max_frames = argc > 3 ? std::stoul(argv[3]) : 100000;
+
+    bench_rasterize(size, n_elements);
+    bench_add_child(n_elements * 10);
+    bench_build(n_elements * 10);
+    bench_serialize(n_elements * 10);
+    bench_serialized_size(n_elements * 10);
+    bench_chunked(n_elements * 10);
+    bench_parse(n_elements * 10);
+    bench_binary(n_elements * 10);
+    bench_mapped(n_elements * 10);
+    bench_file_output(n_elements * 10);
+    bench_streaming(n_elements * 10);
+    bench_gather(n_elements * 10);
+    bench_incremental(1000, n_elements / 100);
+    bench_lookup(n_elements * 10);
+    bench_autoscale(n_elements * 10);
+    bench_convex_hull(n_elements * 5);
+    bench_frames(max_frames);
+    report.write(std::cout);
+}
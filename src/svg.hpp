@@ -4,25 +4,76 @@
 #define RAD_TO_DEG (180/PI)
 #define SVG_TYPE_CHECK static_assert(std::is_base_of<Element, T>::value, "Child must be an SVG element.")
 #define APPROX_EQUALS(x, y, tol) bool(abs(x - y) < tol)
+
+/** Record how long the rest of the enclosing scope takes (see SVG::trace).
+ *  Compiles to nothing unless SVG_ENABLE_TRACING is defined.
+ */
+#ifdef SVG_ENABLE_TRACING
+#define SVG_TRACE_CONCAT_(a, b) a##b
+#define SVG_TRACE_CONCAT(a, b) SVG_TRACE_CONCAT_(a, b)
+#define SVG_TRACE_SCOPE(name) ::SVG::trace::Scope SVG_TRACE_CONCAT(svg_trace_scope_, __LINE__)(name)
+#else
+#define SVG_TRACE_SCOPE(name) ((void)0)
+#endif
 #include <iostream>
 #include <algorithm> // min, max
+#include <chrono>    // steady_clock
 #include <fstream>   // ofstream
 #include <math.h>    // NAN
 #include <map>
+#include <set>
 #include <deque>
+#include <queue>     // priority_queue
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <tuple>
 #include <sstream> // stringstream
 #include <iomanip> // setprecision
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>  // exception_ptr
+#include <cerrno>
+#include <functional> // function
+#include <stdexcept>  // runtime_error
 #include <type_traits> // is_base_of
 #include <typeinfo>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>    // memcpy
+#include <cstdlib>    // malloc
+#include <new>        // bad_alloc
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <direct.h>   // _mkdir
+#else
+#include <sys/stat.h> // mkdir
+#include <sys/mman.h> // mmap
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+#include <sys/uio.h>  // writev
+#include <climits>    // IOV_MAX
+#endif
 
 namespace SVG {
     /** @namespace SVG
      *  @brief Main namespace for SVG for C++
      */
     class AttributeMap;
+    class AnimationWriter;
+    class StreamingBuilder;
+    struct SerializeOptions;
+    class SpatialIndex;
+    class TilePyramid;
+    class Rasterizer;
+    class Parser;
     class SVG;
     class Shape;
 
@@ -43,12 +94,194 @@ namespace SVG {
     inline std::string to_string(const double& value);
     inline std::string to_string(const Point& point);
     inline std::string to_string(const std::map<std::string, AttributeMap>& css, const size_t indent_level=0);
+    inline void css_to_stream(std::ostream& out, const std::map<std::string, AttributeMap>& css, const size_t indent_level=0);
 
     std::vector<Point> bounding_polygon(const std::vector<Shape*>& shapes);
     SVG frame_animate(std::vector<SVG>& frames, const double fps);
+    void frame_animate(std::ostream& out, const size_t n_frames, const double fps,
+        const double width, const double height, const std::function<SVG(const size_t)>& generator);
     SVG merge(SVG& left, SVG& right, const Margins& margins = DEFAULT_MARGINS);
     SVG merge(std::vector<SVG>& frames, const double width, const int max_frame_width);
 
+    /** @namespace trace
+     *  @brief Timing of library operations, viewable in chrome://tracing or Perfetto
+     *
+     *  When SVG_ENABLE_TRACING is defined, the library's slow operations
+     *  (autoscale, convex_hull, serialization, parsing, I/O, ...) record
+     *  their start and end times. Each thread appends to its own fixed-size
+     *  ring buffer without locking, keeping only the most recent events.
+     *  Buffers of exited threads are handed on to new ones, so memory use is
+     *  bounded by the number of threads running at once. Call write_chrome_trace() to dump everything recorded so far, even
+     *  while other threads are still recording.
+     */
+    namespace trace {
+        struct Event {
+            const char* name; /**< Must outlive the trace, e.g. a string literal */
+            uint64_t begin;   /**< Nanoseconds since the first event */
+            uint64_t end;
+        };
+
+        class Ring {
+        public:
+            enum : size_t { CAPACITY = 1 << 14 }; /**< Events kept per thread */
+
+            /** An event which may be read while its thread overwrites it */
+            struct Slot {
+                std::atomic<const char*> name{ nullptr };
+                std::atomic<uint64_t> begin{ 0 };
+                std::atomic<uint64_t> end{ 0 };
+            };
+
+            Ring(const size_t _thread_id) : thread_id(_thread_id), slots(new Slot[CAPACITY]) {};
+
+            void push(const char* name, const uint64_t begin, const uint64_t end) {
+                /** Only called by the owning thread. The fence orders the update
+                 *  of started before the slot is overwritten, so a reader which
+                 *  sees the new contents also sees that the old event is gone.
+                 */
+                const size_t n = this->count.load(std::memory_order_relaxed);
+                Slot& slot = this->slots[n % CAPACITY];
+                this->started.store(n + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                slot.name.store(name, std::memory_order_relaxed);
+                slot.begin.store(begin, std::memory_order_relaxed);
+                slot.end.store(end, std::memory_order_relaxed);
+                this->count.store(n + 1, std::memory_order_release);
+            }
+
+            std::vector<Event> snapshot() const {
+                /** Copy the events still in the ring, oldest first, leaving out
+                 *  any which were overwritten while being copied
+                 */
+                const size_t count = this->count.load(std::memory_order_acquire);
+                const size_t first = count > CAPACITY ? count - CAPACITY : 0;
+                std::vector<Event> ret;
+                ret.reserve(count - first);
+                for (size_t i = first; i < count; i++) {
+                    const Slot& slot = this->slots[i % CAPACITY];
+                    ret.push_back({ slot.name.load(std::memory_order_relaxed),
+                        slot.begin.load(std::memory_order_relaxed), slot.end.load(std::memory_order_relaxed) });
+                }
+
+                // Event i is overwritten by push number i + CAPACITY
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const size_t after = this->started.load(std::memory_order_relaxed);
+                const size_t n_stale = std::min(ret.size(),
+                    after > first + CAPACITY ? after - (first + CAPACITY) : (size_t)0);
+                ret.erase(ret.begin(), ret.begin() + n_stale);
+                return ret;
+            }
+
+            const size_t thread_id;
+            std::unique_ptr<Slot[]> slots;
+            std::atomic<size_t> count{ 0 };   /**< Events ever pushed */
+            std::atomic<size_t> started{ 0 }; /**< Pushes ever begun, including one under way */
+        };
+
+        struct Registry {
+            std::mutex lock;
+            std::vector<std::shared_ptr<Ring>> rings; /**< Kept after their threads exit */
+            std::vector<Ring*> idle;                  /**< Rings of exited threads, for new ones to reuse */
+        };
+
+        inline Registry& registry() {
+            static Registry ret;
+            return ret;
+        }
+
+        /** A thread's claim on a ring, which is given back when the thread exits */
+        class Lease {
+        public:
+            Lease() {
+                auto& reg = registry();
+                std::lock_guard<std::mutex> guard(reg.lock);
+                if (reg.idle.empty()) {
+                    reg.rings.push_back(std::make_shared<Ring>(reg.rings.size() + 1));
+                    this->ring = reg.rings.back().get();
+                }
+                else {
+                    // Its events are kept, and will be overwritten by this thread's in time
+                    this->ring = reg.idle.back();
+                    reg.idle.pop_back();
+                }
+            }
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+            ~Lease() {
+                auto& reg = registry();
+                std::lock_guard<std::mutex> guard(reg.lock);
+                reg.idle.push_back(this->ring);
+            }
+
+            Ring* ring;
+        };
+
+        inline Ring& local_ring() {
+            /** This thread's ring buffer, registered or reused on first use */
+            thread_local Lease lease;
+            return *lease.ring;
+        }
+
+        inline uint64_t now() {
+            static const auto epoch = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        class Scope {
+        public:
+            Scope(const char* _name) : name(_name), begin(now()) {};
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+            ~Scope() { local_ring().push(this->name, this->begin, now()); }
+
+        private:
+            const char* name;
+            uint64_t begin;
+        };
+
+        inline void clear() {
+            /** Forget all recorded events (call while no traced work is running) */
+            auto& reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            for (auto& ring : reg.rings) {
+                ring->started.store(0, std::memory_order_relaxed);
+                ring->count.store(0, std::memory_order_release);
+            }
+        }
+
+        inline void write_chrome_trace(std::ostream& out) {
+            /** Write every recorded event in the Chrome trace event format
+             *
+             *  Threads may keep recording meanwhile. Their newest events may be
+             *  missed, and events overwritten while being copied are left out.
+             */
+            auto& reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            const auto precision = out.precision();
+            const auto flags = out.flags();
+            out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+
+            bool first = true;
+            for (auto& ring : reg.rings) {
+                for (auto& event : ring->snapshot()) {
+                    out << (first ? "\n" : ",\n") << "{\"name\": \"";
+                    for (const char* ch = event.name; *ch; ch++) {
+                        if (*ch == '"' || *ch == '\\') out << '\\';
+                        out << *ch;
+                    }
+                    out << "\", \"cat\": \"svg\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << ring->thread_id
+                        << ", \"ts\": " << event.begin / 1000.0 << ", \"dur\": " << (event.end - event.begin) / 1000.0 << "}";
+                    first = false;
+                }
+            }
+
+            out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+            out.precision(precision);
+            out.flags(flags);
+        }
+    }
+
     /** @namespace util
      *  @brief Various utility and mathematical functions
      */
@@ -100,6 +333,7 @@ namespace SVG {
              *
              *  Ref: https://www.geeksforgeeks.org/convex-hull-set-1-jarviss-algorithm-or-wrapping/
              */
+            SVG_TRACE_SCOPE("convex_hull");
 
             if (points.size() < 3) return {}; // Need at least three points
             std::vector<Point> hull;
@@ -146,10 +380,656 @@ namespace SVG {
 
             return ret;
         }
+
+        inline bool make_directory(const std::string& path) {
+            /** Create a directory, returning true if it was created or already exists */
+#ifdef _WIN32
+            return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+            return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+        }
+
+        /** @class StringView
+         *  @brief A non-owning reference to a run of characters, like C++17's std::string_view
+         */
+        class StringView {
+        public:
+            constexpr StringView() = default;
+            constexpr StringView(const char* _data, const size_t _size) : ptr(_data), len(_size) {};
+            StringView(const std::string& str) : ptr(str.data()), len(str.size()) {};
+
+            template<size_t N>
+            constexpr StringView(const char(&literal)[N]) : ptr(literal), len(N - 1) {};
+
+            constexpr const char* data() const { return this->ptr; }
+            constexpr size_t size() const { return this->len; }
+            constexpr bool empty() const { return this->len == 0; }
+            constexpr const char* begin() const { return this->ptr; }
+            constexpr const char* end() const { return this->ptr + this->len; }
+            operator std::string() const { return std::string(this->ptr, this->len); }
+
+            bool operator==(const StringView& other) const {
+                return this->len == other.len && (this->len == 0 || memcmp(this->ptr, other.ptr, this->len) == 0);
+            }
+            bool operator!=(const StringView& other) const { return !(*this == other); }
+
+        private:
+            const char* ptr = nullptr;
+            size_t len = 0;
+        };
+
+        inline std::ostream& operator<<(std::ostream& out, const StringView& view) {
+            return out.write(view.data(), view.size());
+        }
+
+        struct StringLess {
+            /** Ordering for maps keyed by std::string which can be searched with a StringView */
+            using is_transparent = void;
+            bool operator()(const StringView& left, const StringView& right) const {
+                const int cmp = memcmp(left.data(), right.data(), std::min(left.size(), right.size()));
+                return cmp < 0 || (cmp == 0 && left.size() < right.size());
+            }
+        };
+
+        inline void write_indent(std::ostream& out, const size_t indent_level) {
+            /** Write indent_level tabs without building a temporary string */
+            static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+            for (size_t left = indent_level; left; ) {
+                const size_t n = std::min(left, sizeof(tabs) - 1);
+                out.write(tabs, n);
+                left -= n;
+            }
+        }
+
+        /** A std::streambuf which writes into a fixed region of memory, failing once it's full */
+        class SpanBuf : public std::streambuf {
+        public:
+            SpanBuf(char* begin, char* end) { this->setp(begin, end); }
+            size_t size() const { return this->pptr() - this->pbase(); }
+            char* position() const { return this->pptr(); } /**< Where the next byte goes */
+
+            void skip(size_t n) {
+                /** Leave the next n bytes as they are */
+                for (; n > INT_MAX; n -= INT_MAX) this->pbump(INT_MAX);
+                this->pbump((int)n);
+            }
+        };
+
+        /** A std::streambuf which discards what's written to it, only keeping count */
+        class CountingBuf : public std::streambuf {
+        public:
+            size_t count = 0;
+        protected:
+            int_type overflow(int_type ch) override {
+                if (!traits_type::eq_int_type(ch, traits_type::eof())) this->count++;
+                return traits_type::not_eof(ch);
+            }
+            std::streamsize xsputn(const char*, std::streamsize n) override {
+                this->count += (size_t)n;
+                return n;
+            }
+        };
+
+        /** A std::streambuf which passes what's written on to another, keeping
+         *  count so that streamed output can be metered
+         */
+        class MeteredBuf : public std::streambuf {
+        public:
+            MeteredBuf(std::streambuf* _dest) : dest(_dest) {};
+            size_t count = 0;      /**< Bytes passed on */
+            size_t attributed = 0; /**< Bytes already credited to an element */
+        protected:
+            int_type overflow(int_type ch) override {
+                if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+                if (traits_type::eq_int_type(this->dest->sputc(traits_type::to_char_type(ch)), traits_type::eof()))
+                    return traits_type::eof();
+                this->count++;
+                return ch;
+            }
+            std::streamsize xsputn(const char* s, std::streamsize n) override {
+                const std::streamsize ret = this->dest->sputn(s, n);
+                if (ret > 0) this->count += (size_t)ret;
+                return ret;
+            }
+            int sync() override { return this->dest->pubsync(); }
+        private:
+            std::streambuf* dest;
+        };
+
+        /** @class Hasher
+         *  @brief Streaming 64-bit hash using the XXH64 algorithm, which
+         *         consumes 32 bytes per round
+         *
+         *  Text can be fed in pieces of any size, e.g. as it is serialized,
+         *  and gives the same digest as hashing it all at once.
+         */
+        class Hasher {
+        public:
+            Hasher(const uint64_t _seed = 0) : seed(_seed) {
+                this->lanes[0] = _seed + P1 + P2;
+                this->lanes[1] = _seed + P2;
+                this->lanes[2] = _seed;
+                this->lanes[3] = _seed - P1;
+            }
+
+            Hasher& update(const char* data, size_t size);
+            Hasher& update(const StringView str) { return this->update(str.data(), str.size()); }
+            Hasher& update(const uint64_t value) { return this->update((const char*)&value, sizeof(value)); }
+            uint64_t digest() const;
+
+            static uint64_t hash(const StringView str, const uint64_t seed = 0);
+
+        private:
+            static const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL,
+                P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+
+            static uint64_t rotl(const uint64_t x, const int r) { return (x << r) | (x >> (64 - r)); }
+            static uint64_t read64(const char* ptr) { uint64_t ret; memcpy(&ret, ptr, 8); return ret; }
+            static uint32_t read32(const char* ptr) { uint32_t ret; memcpy(&ret, ptr, 4); return ret; }
+            static uint64_t round(uint64_t acc, const uint64_t input) {
+                return rotl(acc + input * P2, 31) * P1;
+            }
+            static uint64_t merge(const uint64_t acc, const uint64_t lane) {
+                return (acc ^ round(0, lane)) * P1 + P4;
+            }
+
+            static uint64_t finish(uint64_t hash, const char* ptr, size_t left);
+
+            void consume(const char* block) {
+                /** Mix in one 32-byte block */
+                for (int i = 0; i < 4; i++)
+                    this->lanes[i] = round(this->lanes[i], read64(block + 8 * i));
+            }
+
+            uint64_t seed;
+            uint64_t lanes[4];
+            uint64_t total = 0;  /**< Bytes hashed so far */
+            char buffer[32];     /**< Start of an incomplete block */
+            size_t buffered = 0;
+        };
+
+        inline Hasher& Hasher::update(const char* data, size_t size) {
+            this->total += size;
+            if (this->buffered) {
+                const size_t n = std::min(size, 32 - this->buffered);
+                memcpy(this->buffer + this->buffered, data, n);
+                this->buffered += n;
+                data += n;
+                size -= n;
+                if (this->buffered < 32) return *this;
+                this->consume(this->buffer);
+                this->buffered = 0;
+            }
+
+            for (; size >= 32; data += 32, size -= 32) this->consume(data);
+            if (size) {
+                memcpy(this->buffer, data, size);
+                this->buffered = size;
+            }
+            return *this;
+        }
+
+        inline uint64_t Hasher::digest() const {
+            uint64_t hash;
+            if (this->total >= 32) {
+                hash = rotl(this->lanes[0], 1) + rotl(this->lanes[1], 7) +
+                    rotl(this->lanes[2], 12) + rotl(this->lanes[3], 18);
+                for (int i = 0; i < 4; i++) hash = merge(hash, this->lanes[i]);
+            }
+            else hash = this->seed + P5;
+            return finish(hash + this->total, this->buffer, this->buffered);
+        }
+
+        inline uint64_t Hasher::hash(const StringView str, const uint64_t seed) {
+            /** Hash a string all at once, skipping the buffering for short ones */
+            if (str.size() >= 32) return Hasher(seed).update(str).digest();
+            return finish(seed + P5 + str.size(), str.data(), str.size());
+        }
+
+        inline uint64_t Hasher::finish(uint64_t hash, const char* ptr, size_t left) {
+            /** Mix in whatever didn't fill a block, and avalanche */
+            for (; left >= 8; ptr += 8, left -= 8)
+                hash = rotl(hash ^ round(0, read64(ptr)), 27) * P1 + P4;
+            if (left >= 4) {
+                hash = rotl(hash ^ (uint64_t)read32(ptr) * P1, 23) * P2 + P3;
+                ptr += 4;
+                left -= 4;
+            }
+            for (; left; ptr++, left--)
+                hash = rotl(hash ^ (unsigned char)*ptr * P5, 11) * P1;
+
+            hash ^= hash >> 33;
+            hash *= P2;
+            hash ^= hash >> 29;
+            hash *= P3;
+            hash ^= hash >> 32;
+            return hash;
+        }
+
+        /** A std::streambuf which hashes whatever is written to it */
+        class HashingBuf : public std::streambuf {
+        public:
+            Hasher hasher;
+        protected:
+            int_type overflow(int_type ch) override {
+                if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                    const char c = traits_type::to_char_type(ch);
+                    this->hasher.update(&c, 1);
+                }
+                return traits_type::not_eof(ch);
+            }
+            std::streamsize xsputn(const char* data, std::streamsize n) override {
+                this->hasher.update(data, (size_t)n);
+                return n;
+            }
+        };
+
+        inline uint64_t hash_string(const StringView str, uint64_t hash = 14695981039346656037ULL) {
+            /** 64-bit hash of a string and its length, seeded with a previous hash to
+             *  chain several: XXH64, except FNV-1a for short strings like most attribute
+             *  values, where setting up XXH64 takes longer than hashing byte by byte
+             */
+            if (str.size() >= 16) return Hasher::hash(str, hash);
+            for (auto& ch : str) {
+                hash ^= (unsigned char)ch;
+                hash *= 1099511628211ULL;
+            }
+            return (hash ^ str.size()) * 1099511628211ULL;
+        }
+
+        inline uint64_t hash_combine(const uint64_t seed, const uint64_t value) {
+            return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+        }
+
+        inline std::vector<double> parse_numbers(const std::string& str) {
+            /** Parse a list of numbers separated by whitespace and/or commas,
+             *  e.g. the points attribute of a polygon
+             */
+            std::vector<double> ret;
+            const char* ptr = str.c_str();
+            char* end;
+            while (*ptr) {
+                if (isspace((unsigned char)*ptr) || *ptr == ',') {
+                    ptr++;
+                    continue;
+                }
+
+                double value = strtod(ptr, &end);
+                if (end == ptr) break; // Not a number
+                ret.push_back(value);
+                ptr = end;
+            }
+
+            return ret;
+        }
+
+        inline bool parse_path(const std::string& d, std::vector<std::vector<Point>>& subpaths,
+            std::vector<bool>& closed) {
+            /** Convert the path data of a polyline-only path (M, L, H, V, Z and
+             *  their relative forms) into a list of subpaths
+             *
+             *  Returns false if the path contains curves or arcs.
+             */
+            const char* ptr = d.c_str();
+            char* end;
+            char command = 0;
+            Point current(0, 0), start(0, 0);
+
+            auto next_number = [&](double& value) {
+                while (isspace((unsigned char)*ptr) || *ptr == ',') ptr++;
+                value = strtod(ptr, &end);
+                if (end == ptr) return false;
+                ptr = end;
+                return true;
+            };
+
+            while (true) {
+                while (isspace((unsigned char)*ptr) || *ptr == ',') ptr++;
+                if (!*ptr) break;
+
+                if (isalpha((unsigned char)*ptr)) command = *ptr++;
+                else if (!command) return false;
+
+                bool relative = islower((unsigned char)command) != 0;
+                double x, y;
+                switch (toupper((unsigned char)command)) {
+                case 'M':
+                    if (!next_number(x) || !next_number(y)) return false;
+                    current = relative ? Point(current.first + x, current.second + y) : Point(x, y);
+                    start = current;
+                    subpaths.push_back({ current });
+                    closed.push_back(false);
+                    command = relative ? 'l' : 'L'; // Extra coordinate pairs are implicit line-tos
+                    continue;
+                case 'L':
+                    if (!next_number(x) || !next_number(y)) return false;
+                    current = relative ? Point(current.first + x, current.second + y) : Point(x, y);
+                    break;
+                case 'H':
+                    if (!next_number(x)) return false;
+                    current.first = relative ? current.first + x : x;
+                    break;
+                case 'V':
+                    if (!next_number(y)) return false;
+                    current.second = relative ? current.second + y : y;
+                    break;
+                case 'Z':
+                    if (!closed.empty()) closed.back() = true;
+                    current = start;
+                    command = 0;
+                    continue;
+                default:
+                    return false;
+                }
+
+                if (subpaths.empty()) return false; // Path data must begin with a move-to
+                subpaths.back().push_back(current);
+            }
+
+            return true;
+        }
+
+        inline std::vector<Point> clip_polygon(const std::vector<Point>& points, const QuadCoord& box) {
+            /** Clip a polygon to a rectangle via the Sutherland-Hodgman algorithm */
+            std::vector<Point> ret = points, input;
+
+            // Clip against each edge in turn: left, right, top, bottom
+            for (int edge = 0; edge < 4 && !ret.empty(); edge++) {
+                auto inside = [&](const Point& pt) {
+                    switch (edge) {
+                    case 0: return pt.first >= box.x1;
+                    case 1: return pt.first <= box.x2;
+                    case 2: return pt.second >= box.y1;
+                    default: return pt.second <= box.y2;
+                    }
+                };
+
+                auto intersection = [&](const Point& a, const Point& b) {
+                    double t;
+                    switch (edge) {
+                    case 0: t = (box.x1 - a.first) / (b.first - a.first); break;
+                    case 1: t = (box.x2 - a.first) / (b.first - a.first); break;
+                    case 2: t = (box.y1 - a.second) / (b.second - a.second); break;
+                    default: t = (box.y2 - a.second) / (b.second - a.second); break;
+                    }
+                    return Point(a.first + t * (b.first - a.first), a.second + t * (b.second - a.second));
+                };
+
+                input.swap(ret);
+                ret.clear();
+                Point prev = input.back();
+                for (auto& current : input) {
+                    if (inside(current)) {
+                        if (!inside(prev)) ret.push_back(intersection(prev, current));
+                        ret.push_back(current);
+                    }
+                    else if (inside(prev)) {
+                        ret.push_back(intersection(prev, current));
+                    }
+                    prev = current;
+                }
+            }
+
+            return ret;
+        }
+
+        inline bool clip_segment(Point& a, Point& b, const QuadCoord& box) {
+            /** Clip a line segment to a rectangle via the Liang-Barsky algorithm
+             *
+             *  Returns false if the segment lies entirely outside of the box
+             */
+            double t0 = 0, t1 = 1,
+                dx = b.first - a.first, dy = b.second - a.second;
+            const double p[4] = { -dx, dx, -dy, dy },
+                q[4] = { a.first - box.x1, box.x2 - a.first, a.second - box.y1, box.y2 - a.second };
+
+            for (int i = 0; i < 4; i++) {
+                if (p[i] == 0) {
+                    if (q[i] < 0) return false; // Parallel and outside
+                    continue;
+                }
+
+                double t = q[i] / p[i];
+                if (p[i] < 0) t0 = std::max(t0, t);
+                else t1 = std::min(t1, t);
+                if (t0 > t1) return false;
+            }
+
+            b = Point(a.first + t1 * dx, a.second + t1 * dy);
+            a = Point(a.first + t0 * dx, a.second + t0 * dy);
+            return true;
+        }
+
+        inline std::vector<Point> simplify_polyline(const std::vector<Point>& points, const double tolerance) {
+            /** Drop vertices which lie within tolerance of the last vertex kept
+             *  (radial distance simplification). The end points are always kept.
+             */
+            if (points.size() < 3) return points;
+
+            std::vector<Point> ret = { points.front() };
+            const double tol2 = tolerance * tolerance;
+            for (size_t i = 1; i + 1 < points.size(); i++) {
+                double dx = points[i].first - ret.back().first,
+                    dy = points[i].second - ret.back().second;
+                if (dx * dx + dy * dy >= tol2) ret.push_back(points[i]);
+            }
+
+            ret.push_back(points.back());
+            return ret;
+        }
+
+        inline std::vector<std::vector<Point>> clip_polyline(const std::vector<Point>& points, const QuadCoord& box) {
+            /** Clip an open polyline to a rectangle, splitting it wherever it leaves the box */
+            std::vector<std::vector<Point>> ret;
+            bool connected = false; // Whether the last clipped segment ended at its original end point
+
+            for (size_t i = 1; i < points.size(); i++) {
+                Point a = points[i - 1], b = points[i];
+                if (!clip_segment(a, b, box)) {
+                    connected = false;
+                    continue;
+                }
+
+                if (!connected) ret.push_back({ a });
+                ret.back().push_back(b);
+                connected = (b == points[i]);
+            }
+
+            return ret;
+        }
+    }
+
+    /** @enum ElementKind
+     *  @brief Identifies the built-in element classes without RTTI (see Element::kind())
+     *
+     *  Classes derived from a built-in element are of kind Other, since they
+     *  may be tagged or written differently (see Element::exact_kind()).
+     */
+    enum class ElementKind : uint8_t {
+        Unknown, /**< Not determined yet */
+        Other,   /**< A user-defined class */
+        SVG, Style, Group, Rect, Circle, Line, Path, Polygon, Text, Generic
+    };
+
+    inline constexpr util::StringView kind_tag(const ElementKind kind) {
+        /** The tag name shared by every element of a built-in kind, e.g.
+         *  kind_tag(KindOf<Rect>::value) == "rect" (empty for Generic and Other)
+         */
+        switch (kind) {
+        case ElementKind::SVG: return "svg";
+        case ElementKind::Style: return "style";
+        case ElementKind::Group: return "g";
+        case ElementKind::Rect: return "rect";
+        case ElementKind::Circle: return "circle";
+        case ElementKind::Line: return "line";
+        case ElementKind::Path: return "path";
+        case ElementKind::Polygon: return "polygon";
+        case ElementKind::Text: return "text";
+        default: return util::StringView();
+        }
+    }
+
+    template<typename T>
+    struct KindOf {
+        /** The ElementKind of T, specialized for each built-in class */
+        static const ElementKind value = ElementKind::Other;
+    };
+
+    /** @namespace metrics
+     *  @brief Always-on counters of library activity, e.g. for a service to scrape
+     *
+     *  Each thread increments its own shard without contention, and a snapshot
+     *  sums over all shards (including those of threads which have exited).
+     *  Counters only ever increase, so rates are taken from the difference
+     *  between two snapshots.
+     */
+    namespace metrics {
+        enum : size_t { N_KINDS = (size_t)ElementKind::Generic + 1 };
+
+        enum Operation : size_t {
+            SVG_TO_STRING, SERIALIZE, AUTOSCALE, MERGE, FRAME_ANIMATE, N_OPERATIONS
+        };
+
+        /** Index of each counter, where those marked "+ kind" or "+ operation"
+         *  have one slot per ElementKind or Operation
+         */
+        enum Counter : size_t {
+            ELEMENTS_ADDED = 0,                             /**< + kind */
+            ELEMENT_BYTES = ELEMENTS_ADDED + N_KINDS,       /**< + kind */
+            ATTRIBUTES_FORMATTED = ELEMENT_BYTES + N_KINDS,
+            SERIALIZED_BYTES,
+            BBOX_CACHE_HITS,
+            BBOX_CACHE_MISSES,
+            OPERATION_CALLS,                                /**< + operation */
+            OPERATION_NANOSECONDS = OPERATION_CALLS + N_OPERATIONS, /**< + operation */
+            N_COUNTERS = OPERATION_NANOSECONDS + N_OPERATIONS
+        };
+
+        struct Shard {
+            std::atomic<uint64_t> values[N_COUNTERS] = {};
+        };
+
+        struct Registry {
+            std::mutex lock;
+            std::vector<std::shared_ptr<Shard>> shards;
+        };
+
+        inline Registry& registry() {
+            static Registry ret;
+            return ret;
+        }
+
+        inline Shard& local_shard() {
+            /** This thread's counters, registered on first use */
+            thread_local std::shared_ptr<Shard> shard = [] {
+                auto& reg = registry();
+                std::lock_guard<std::mutex> guard(reg.lock);
+                reg.shards.push_back(std::make_shared<Shard>());
+                return reg.shards.back();
+            }();
+            return *shard;
+        }
+
+        inline void add(const size_t counter, const uint64_t n = 1) {
+            /** Only the owning thread writes to a shard, so no read-modify-write is needed */
+            auto& value = local_shard().values[counter];
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        inline std::vector<uint64_t> snapshot() {
+            /** Return the sum of every counter over all threads, indexed by Counter */
+            std::vector<uint64_t> ret(N_COUNTERS);
+            auto& reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            for (auto& shard : reg.shards)
+                for (size_t i = 0; i < N_COUNTERS; i++)
+                    ret[i] += shard->values[i].load(std::memory_order_relaxed);
+            return ret;
+        }
+
+        class Timer {
+        public:
+            Timer(const Operation _operation) : operation(_operation), start(std::chrono::steady_clock::now()) {};
+            Timer(const Timer&) = delete;
+            Timer& operator=(const Timer&) = delete;
+            ~Timer() {
+                add(OPERATION_CALLS + this->operation);
+                add(OPERATION_NANOSECONDS + this->operation, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - this->start).count());
+            }
+
+        private:
+            Operation operation;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        inline void write_prometheus(std::ostream& out) {
+            /** Write a snapshot of every counter in the Prometheus text exposition format */
+            static const char* const operations[N_OPERATIONS] = {
+                "svg_to_string", "serialize", "autoscale", "merge", "frame_animate"
+            };
+            auto values = snapshot();
+
+            auto header = [&out](const char* name, const char* help) {
+                out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n";
+            };
+            auto by_kind = [&out, &values](const char* name, const size_t first) {
+                for (size_t kind = (size_t)ElementKind::Other; kind < N_KINDS; kind++) {
+                    const util::StringView tag = kind_tag((ElementKind)kind);
+                    out << name << "{type=\"" << (tag.empty() ?
+                        (kind == (size_t)ElementKind::Other ? "other" : "generic") : std::string(tag))
+                        << "\"} " << values[first + kind] << "\n";
+                }
+            };
+
+            header("svg_elements_added_total", "Elements added to a parent, by type");
+            by_kind("svg_elements_added_total", ELEMENTS_ADDED);
+            header("svg_element_bytes_total", "Bytes of markup formatted for elements themselves, excluding children");
+            by_kind("svg_element_bytes_total", ELEMENT_BYTES);
+            header("svg_attributes_formatted_total", "Numeric attribute values converted to text");
+            out << "svg_attributes_formatted_total " << values[ATTRIBUTES_FORMATTED] << "\n";
+            header("svg_serialized_bytes_total", "Bytes of complete documents or subtrees written out");
+            out << "svg_serialized_bytes_total " << values[SERIALIZED_BYTES] << "\n";
+            header("svg_bbox_cache_hits_total", "Bounding boxes served from the cache");
+            out << "svg_bbox_cache_hits_total " << values[BBOX_CACHE_HITS] << "\n";
+            header("svg_bbox_cache_misses_total", "Bounding boxes recomputed");
+            out << "svg_bbox_cache_misses_total " << values[BBOX_CACHE_MISSES] << "\n";
+
+            header("svg_operation_calls_total", "Calls to expensive operations");
+            for (size_t i = 0; i < N_OPERATIONS; i++)
+                out << "svg_operation_calls_total{operation=\"" << operations[i] << "\"} "
+                    << values[OPERATION_CALLS + i] << "\n";
+            header("svg_operation_seconds_total", "Time spent in expensive operations");
+            for (size_t i = 0; i < N_OPERATIONS; i++)
+                out << "svg_operation_seconds_total{operation=\"" << operations[i] << "\"} "
+                    << values[OPERATION_NANOSECONDS + i] / 1e9 << "\n";
+        }
+
+        inline std::string prometheus() {
+            std::stringstream ss;
+            write_prometheus(ss);
+            return ss.str();
+        }
+
+        inline bool save(const std::string& filename) {
+            /** Write a snapshot to a file for a scraper to pick up (e.g. node_exporter's
+             *  textfile collector), replacing it at once so a partial file is never read
+             */
+            const std::string temp = filename + ".tmp";
+            {
+                std::ofstream outfile(temp, std::ios::binary);
+                write_prometheus(outfile);
+                if (!outfile) return false;
+            }
+            std::remove(filename.c_str()); // rename() doesn't replace files on Windows
+            return std::rename(temp.c_str(), filename.c_str()) == 0;
+        }
     }
 
     inline std::string to_string(const double& value) {
         /** Trim off all but one decimal place when converting a double to string */
+        metrics::add(metrics::ATTRIBUTES_FORMATTED);
         std::stringstream ss;
         ss << std::fixed << std::setprecision(1);
         ss << value;
@@ -172,6 +1052,7 @@ namespace SVG {
 
             template<typename T>
             AttrSetter& operator<<(T value) {
+                metrics::add(metrics::ATTRIBUTES_FORMATTED);
                 attr += std::to_string(value);
                 return *this;
             }
@@ -179,18 +1060,29 @@ namespace SVG {
 
         AttributeMap() = default;
         AttributeMap(SVGAttrib _attr) : attr(_attr) {};
+        AttributeMap(const AttributeMap&) = default;
+        AttributeMap(AttributeMap&&) = default;
+        AttributeMap& operator=(const AttributeMap&) = default;
+        AttributeMap& operator=(AttributeMap&&) = default;
+        virtual ~AttributeMap() = default;
         SVGAttrib attr;
 
         template<typename T>
         AttributeMap& set_attr(const std::string key, T value) {
+            metrics::add(metrics::ATTRIBUTES_FORMATTED);
             this->attr[key] = std::to_string(value);
+            this->attr_changed();
             return *this;
         }
 
         AttrSetter set_attr(const std::string key) {
             if (this->attr.find(key) == this->attr.end()) this->attr[key] = "";
+            this->attr_changed();
             return AttrSetter(this->attr.at(key));
         };
+
+    protected:
+        virtual void attr_changed() {} /**< Called whenever set_attr() modifies an attribute */
     };
 
     template<>
@@ -203,6 +1095,7 @@ namespace SVG {
     inline AttributeMap& AttributeMap::set_attr(const std::string key, const double value) {
         /** Modify the attribute specified by key */
         this->attr[key] = to_string(value);
+        this->attr_changed();
         return *this;
     }
 
@@ -210,6 +1103,7 @@ namespace SVG {
     inline AttributeMap& AttributeMap::set_attr(const std::string key, const char * value) {
         /** Modify the attribute specified by key */
         this->attr[key] = value;
+        this->attr_changed();
         return *this;
     }
 
@@ -217,55 +1111,195 @@ namespace SVG {
     inline AttributeMap& AttributeMap::set_attr(const std::string key, const std::string value) {
         /** Modify the attribute specified by key */
         this->attr[key] = value;
+        this->attr_changed();
         return *this;
     }
 
-    /** @class Element
-     *  @brief Abstract base class for all SVG elements
+    /** @struct MemoryStats
+     *  @brief Heap usage of an element tree, as returned by Element::memory_stats()
+     *
+     *  Sizes are estimated from the containers' contents (e.g. one block per
+     *  std::map node and per string too long for the small string buffer),
+     *  so they don't include allocator overhead.
      */
-    class Element: public AttributeMap {
-    public:
-        /** @class BoundingBox
-         *  @brief Represents the top left and bottom right corners of a bounding rectangle
-         */
-        class BoundingBox : public QuadCoord {
-        public:
-            using QuadCoord::QuadCoord;
-            BoundingBox() = default;
-            BoundingBox(double a, double b, double c, double d) : QuadCoord({ a, b, c, d }) {};
+    struct MemoryStats {
+        struct Usage {
+            size_t bytes = 0;       /**< Bytes requested from the allocator */
+            size_t allocations = 0; /**< Number of live heap blocks */
+
+            void add(const size_t _bytes, const size_t _allocations = 1) {
+                this->bytes += _bytes;
+                this->allocations += _allocations;
+            }
 
-            BoundingBox operator+ (const BoundingBox& other) {
-                /** Return a new bounding box which envelopes both original boxes */
-                using namespace util;
-                BoundingBox new_box;
-                new_box.x1 = min_or_not_nan(this->x1, other.x1);
-                new_box.x2 = max_or_not_nan(this->x2, other.x2);
-                new_box.y1 = min_or_not_nan(this->y1, other.y1);
-                new_box.y2 = max_or_not_nan(this->y2, other.y2);
-                return new_box;
+            Usage& operator+=(const Usage& other) {
+                this->add(other.bytes, other.allocations);
+                return *this;
             }
         };
-        using ChildList = std::vector<Element*>;
-        using ChildMap = std::map<std::string, ChildList>;
 
-        Element() = default;
-        Element(const Element& other) = delete; // No copy constructor
-        Element(Element&& other) = default; // Move constructor
-        Element& operator=(const Element&) = delete; // No copy assignment
-        Element& operator=(Element&& other) = default;
+        size_t elements = 0; /**< Number of elements in the subtree */
+        Usage nodes;         /**< The element objects themselves */
+        Usage attributes;    /**< Attribute map nodes, names and values */
+        Usage children;      /**< Arrays of child pointers */
+        Usage content;       /**< Text, stylesheet rules and other per-class data */
+        Usage cache;         /**< Cached serialized output */
+        std::map<std::string, Usage> by_tag; /**< Sum of the above for each type of element */
+
+        Usage total() const {
+            Usage ret;
+            ret += this->nodes;
+            ret += this->attributes;
+            ret += this->children;
+            ret += this->content;
+            ret += this->cache;
+            return ret;
+        }
 
-        Element(const char* id) : AttributeMap(
-            SVGAttrib({ { "id", id } })) {};
-        using AttributeMap::AttributeMap;
+        static Usage string_usage(const std::string& str) {
+            /** Heap used by a string, which is none if it fits inside the object itself */
+            Usage ret;
+            const char* data = str.data(), *self = (const char*)&str;
+            if (data < self || data >= self + sizeof(str)) ret.add(str.capacity() + 1);
+            return ret;
+        }
 
-        // Implicit string conversion
+        template<typename Map>
+        static Usage node_usage(const Map& map) {
+            /** Heap used by the nodes of a std::map (a red-black tree), but not what they point to */
+            Usage ret;
+            ret.add(map.size() * (sizeof(typename Map::value_type) + 4 * sizeof(void*)), map.size());
+            return ret;
+        }
+
+        static Usage attribute_usage(const SVGAttrib& attrs) {
+            Usage ret = node_usage(attrs);
+            for (auto& pair : attrs) {
+                ret += string_usage(pair.first);
+                ret += string_usage(pair.second);
+            }
+            return ret;
+        }
+
+        static Usage selector_usage(const SelectorProperties& css) {
+            Usage ret = node_usage(css);
+            for (auto& rule : css) {
+                ret += string_usage(rule.first);
+                ret += attribute_usage(rule.second.attr);
+            }
+            return ret;
+        }
+    };
+
+    /** @struct AllocationCounts
+     *  @brief Totals kept by the global operator new/delete defined when
+     *         SVG_DEFINE_ALLOCATION_HOOKS is set (see allocation_counts())
+     */
+    struct AllocationCounts {
+        size_t allocations = 0;   /**< Calls to operator new */
+        size_t deallocations = 0; /**< Calls to operator delete with a non-null pointer */
+        size_t bytes = 0;         /**< Bytes requested by all calls to operator new */
+
+        size_t live() const { return this->allocations - this->deallocations; }
+    };
+
+    namespace util {
+        inline std::atomic<size_t>* allocation_counters() {
+            /** Storage for AllocationCounts shared by all translation units */
+            static std::atomic<size_t> counters[3];
+            return counters;
+        }
+    }
+
+    inline AllocationCounts allocation_counts() {
+        /** Return the number of heap allocations made by the whole program so far
+         *
+         *  Counting is off by default. To turn it on, define SVG_DEFINE_ALLOCATION_HOOKS
+         *  before including svg.hpp in exactly one source file, which replaces the
+         *  global operator new and delete. Otherwise every count stays zero.
+         */
+        AllocationCounts ret;
+        ret.allocations = util::allocation_counters()[0].load(std::memory_order_relaxed);
+        ret.deallocations = util::allocation_counters()[1].load(std::memory_order_relaxed);
+        ret.bytes = util::allocation_counters()[2].load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    /** @class Element
+     *  @brief Abstract base class for all SVG elements
+     */
+    class Element: public AttributeMap {
+    public:
+        /** @class BoundingBox
+         *  @brief Represents the top left and bottom right corners of a bounding rectangle
+         */
+        class BoundingBox : public QuadCoord {
+        public:
+            using QuadCoord::QuadCoord;
+            BoundingBox() = default;
+            BoundingBox(double a, double b, double c, double d) : QuadCoord({ a, b, c, d }) {};
+
+            BoundingBox operator+ (const BoundingBox& other) {
+                /** Return a new bounding box which envelopes both original boxes */
+                using namespace util;
+                BoundingBox new_box;
+                new_box.x1 = min_or_not_nan(this->x1, other.x1);
+                new_box.x2 = max_or_not_nan(this->x2, other.x2);
+                new_box.y1 = min_or_not_nan(this->y1, other.y1);
+                new_box.y2 = max_or_not_nan(this->y2, other.y2);
+                return new_box;
+            }
+
+            bool intersects(const BoundingBox& other) const {
+                /** Return true if both boxes overlap (or touch). Always false for NAN boxes. */
+                return this->x1 <= other.x2 && other.x1 <= this->x2 &&
+                    this->y1 <= other.y2 && other.y1 <= this->y2;
+            }
+
+            bool contains(const Point& pt) const {
+                /** Return true if the point lies inside of (or on the edge of) this box */
+                return this->x1 <= pt.first && pt.first <= this->x2 &&
+                    this->y1 <= pt.second && pt.second <= this->y2;
+            }
+
+            bool contains(const BoundingBox& other) const {
+                /** Return true if the other box lies completely inside of this one */
+                return this->x1 <= other.x1 && other.x2 <= this->x2 &&
+                    this->y1 <= other.y1 && other.y2 <= this->y2;
+            }
+
+            BoundingBox normalized() const {
+                /** Return a copy where x1 <= x2 and y1 <= y2, e.g. for lines drawn right to left */
+                return {
+                    std::min(this->x1, this->x2), std::max(this->x1, this->x2),
+                    std::min(this->y1, this->y2), std::max(this->y1, this->y2)
+                };
+            }
+        };
+        using ChildList = std::vector<Element*>;
+        using ChildMap = std::map<std::string, ChildList, util::StringLess>;
+
+        Element() = default;
+        Element(const Element& other) = delete; // No copy constructor
+        Element(Element&& other); // Move constructor
+        Element& operator=(const Element&) = delete; // No copy assignment
+        Element& operator=(Element&& other);
+
+        Element(const char* id) : AttributeMap(
+            SVGAttrib({ { "id", id } })) {};
+        using AttributeMap::AttributeMap;
+
+        // Implicit string conversion
         operator std::string() { return this->svg_to_string(0); };
 
+        friend std::ostream& operator<<(std::ostream& out, Element& elem);
+
         template<typename T, typename... Args>
         T* add_child(Args&&... args) {
             /** Add an SVG element as a child and return a pointer to the element added */
             SVG_TYPE_CHECK;
             this->children.push_back(std::make_unique<T>(std::forward<Args>(args)...));
+            this->adopt_back();
             return (T*)this->children.back().get();
         }
 
@@ -274,9 +1308,23 @@ namespace SVG {
             /** Move an SVG element into this container */
             SVG_TYPE_CHECK;
             this->children.push_back(std::make_unique<T>(std::move(node)));
+            this->adopt_back();
             return *this;
         }
 
+        template<typename T>
+        T* adopt(std::unique_ptr<T> child) {
+            /** Take ownership of a detached subtree in O(1) and return a pointer to it
+             *
+             *  Unlike operator<<, the subtree itself is not moved, so pointers into it stay valid.
+             */
+            SVG_TYPE_CHECK;
+            T* ret = child.get();
+            this->children.push_back(std::move(child));
+            this->adopt_back();
+            return ret;
+        }
+
         template<typename T>
         std::vector<T*> get_children() {
             /** Return all children of type T */
@@ -285,7 +1333,7 @@ namespace SVG {
             auto child_elems = this->get_children_helper();
             
             for (auto& child: child_elems)
-                if (typeid(*child) == typeid(T)) ret.push_back((T*)child);
+                if (is_a<T>(child)) ret.push_back((T*)child);
 
             return ret;
         }
@@ -296,34 +1344,156 @@ namespace SVG {
             SVG_TYPE_CHECK;
             std::vector<T*> ret;
             for (auto& child : this->children)
-                if (typeid(*child) == typeid(T)) ret.push_back((T*)child.get());
+                if (is_a<T>(child.get())) ret.push_back((T*)child.get());
 
             return ret;
         }
 
+        template<typename T>
+        static bool is_a(Element* elem) {
+            /** Return true if elem is exactly a T, comparing kinds for built-in
+             *  classes (subclasses of which are of kind Other) and falling back
+             *  to RTTI for others
+             */
+            return KindOf<T>::value != ElementKind::Other ?
+                elem->kind() == KindOf<T>::value : typeid(*elem) == typeid(T);
+        }
+
+        ElementKind kind() {
+            /** Return which built-in class this is (cached when the element is added to a parent) */
+            return this->kind_cache != ElementKind::Unknown ? this->kind_cache : this->exact_kind();
+        }
+
+        template<typename Visitor> void visit(Visitor&& visitor);
+
         Element* get_element_by_id(const std::string& id);
         std::vector<Element*> get_elements_by_class(const std::string& clsname);
         void autoscale(const Margins& margins=DEFAULT_MARGINS);
         void autoscale(const double margin);
+        static SVGAttrib autoscale_attributes(const BoundingBox& bbox, const Margins& margins=DEFAULT_MARGINS);
         virtual BoundingBox get_bbox();
+        BoundingBox subtree_bbox();
         ChildMap get_children();
+        Element* get_parent() { return this->parent; }
+        std::unique_ptr<Element> detach();
+        void invalidate();
+        uint64_t subtree_hash();
+        uint64_t output_hash(const SerializeOptions& options);
+
+        std::string serialize(const SerializeOptions& options);
+        void serialize(std::ostream& out, const SerializeOptions& options);
+        size_t serialized_size();
+        size_t serialized_size(const SerializeOptions& options);
+        MemoryStats memory_stats();
+
+        /** Length of a subtree's output, which depends on the level it's indented at */
+        struct OutputSize {
+            size_t bytes; /**< Bytes written at indentation level 0 */
+            size_t lines; /**< Lines starting with indentation, i.e. extra bytes per level */
+
+            size_t at(const size_t indent_level) const { return this->bytes + indent_level * this->lines; }
+        };
 
     protected:
+        friend class AnimationWriter;
+        friend class SpatialIndex;
+        friend class TilePyramid;
+        friend class Rasterizer;
+        friend class Parser;
+        friend class GenericElement;
+        friend class Patch;
+        friend class BinaryDocument;
+        friend class GatherWriter;
+        friend class MappedWriter;
+        friend class ChunkedSerializer;
+        friend class StreamingBuilder;
+
         std::vector<std::unique_ptr<Element>> children; /** Smart pointers to child elements */
+        Element* parent = nullptr;  /**< Element which owns this one, if any */
+        bool bbox_valid = false;    /**< Whether bbox_cache is up to date */
+        BoundingBox bbox_cache;     /**< Cached result of subtree_bbox() */
+        bool bbox_foreign = false;  /**< Whether the subtree has its own coordinate systems, per subtree_bbox() */
+        bool output_valid = false;  /**< Whether output_cache is up to date */
+        size_t output_indent = 0;   /**< Indentation level output_cache was written at */
+        std::string output_cache;   /**< Serialized subtree, written with default options */
+        bool size_valid = false;    /**< Whether size_cache is up to date */
+        OutputSize size_cache = { 0, 0 }; /**< Cached result of output_size() with default options */
+        bool hash_valid = false;    /**< Whether hash_cache is up to date */
+        uint64_t hash_cache = 0;    /**< Cached result of subtree_hash() */
+        ElementKind kind_cache = ElementKind::Unknown; /**< Cached result of exact_kind() */
+
         std::vector<Element*> get_children_helper();
         void get_bbox(Element::BoundingBox&);
-        virtual std::string svg_to_string(const size_t indent_level); /** SVG string corresponding to this element */
+        void attr_changed() override { this->invalidate(); }
+        void adopt_back();
+        bool own_coordinates();
+        bool outside(const SerializeOptions& options);
+
+        std::string svg_to_string(const size_t indent_level); /** SVG string corresponding to this element */
+        const std::string& cached_output(const size_t indent_level);
+        static bool use_cache(const SerializeOptions& options);
+        bool default_layout();
+        virtual void svg_to_stream(std::ostream& out, const size_t indent_level,
+            const SerializeOptions& options); /** Write this element to a stream */
+        virtual bool empty_output() { return false; } /** True if this element would not produce any output */
+        void write_element(std::ostream& out, const size_t indent_level,
+            const SerializeOptions& options, const SVGAttrib& attrs);
+        void write_metered(std::ostream& out, const size_t indent_level, const SerializeOptions& options);
+        void serialize_metered(std::ostream& out, const size_t indent_level, const SerializeOptions& options);
+        OutputSize subtree_size(const SerializeOptions& options);
+        virtual OutputSize output_size(const SerializeOptions& options); /** Size of what svg_to_stream() writes */
+        OutputSize element_size(const SerializeOptions& options, const SVGAttrib& attrs);
+        OutputSize counted_size(const SerializeOptions& options);
+        size_t tag_size();
+        void svg_open_tag(std::ostream& out, const size_t indent_level, const bool self_closing);
+        void svg_open_tag(std::ostream& out, const size_t indent_level, const bool self_closing,
+            const SVGAttrib& attrs);
+        void svg_close_tag(std::ostream& out, const size_t indent_level);
         virtual std::string tag() = 0; /** The SVG tag of this element */
+        virtual util::StringView tag_view() { return kind_tag(this->kind()); }
+        void write_tag(std::ostream& out);
+        virtual ElementKind element_kind() { return ElementKind::Other; }
+        ElementKind exact_kind();
+        virtual std::string own_content() { return ""; } /** Anything besides attributes and children which gets written out */
+        virtual MemoryStats::Usage content_usage() { return MemoryStats::Usage(); } /** Heap used by own_content() and the like */
 
         double find_numeric(const std::string& key) {
             /** Return the numeric attribute (if it exists) or NAN
              *
              *  @param[in] key Name of the attribute
              */
-            if (attr.find(key) != attr.end())
-                return std::stof(attr[key]);
+            auto it = attr.find(key);
+            if (it != attr.end())
+                return std::stof(it->second);
             return NAN;
         }
+
+        const std::string& find_attr(const std::string& key) const {
+            /** Return the attribute (if it exists) or an empty string, without inserting it */
+            static const std::string empty;
+            auto it = attr.find(key);
+            return it == attr.end() ? empty : it->second;
+        }
+    };
+
+    /** @struct SerializeOptions
+     *  @brief Options controlling how an element tree is written out
+     */
+    struct SerializeOptions {
+        SerializeOptions() = default;
+        SerializeOptions(const Element::BoundingBox& _viewport) : cull(true), viewport(_viewport.normalized()) {};
+
+        bool cull = false; /**< Skip subtrees whose bounding boxes lie outside of the viewport */
+        bool clip = true;  /**< When culling, clip polygons and paths which cross the viewport's edge */
+        double simplify = 0; /**< Drop polygon and path vertices closer than this to the previous vertex */
+        Element::BoundingBox viewport = { NAN, NAN, NAN, NAN }; /**< Visible region, in user coordinates */
+        bool cache = false; /**< Keep the output of each subtree for next time, so only the elements
+                                 changed since are formatted again. Changes made through attr directly,
+                                 or through a Style& kept from style() or keyframes(), aren't noticed
+                                 until invalidate() is called. */
+
+        /** Whether output under these options is the same as the default, and may be cached */
+        bool cacheable() const { return !this->cull && this->simplify <= 0; }
     };
 
     template<>
@@ -334,6 +1504,100 @@ namespace SVG {
         return ret;
     }
 
+    inline std::ostream& operator<<(std::ostream& out, Element& elem) {
+        /** Write an element directly to a stream */
+        elem.serialize(out, SerializeOptions());
+        return out;
+    }
+
+    inline Element::Element(Element&& other) : AttributeMap(std::move(other)),
+        children(std::move(other.children)) {
+        /** Move constructor which re-parents the moved children */
+        for (auto& child : this->children) child->parent = this;
+    }
+
+    inline Element& Element::operator=(Element&& other) {
+        AttributeMap::operator=(std::move(other));
+        this->children = std::move(other.children);
+        for (auto& child : this->children) child->parent = this;
+        this->invalidate();
+        return *this;
+    }
+
+    inline void Element::adopt_back() {
+        /** Take ownership of the most recently added child */
+        this->children.back()->kind_cache = this->children.back()->exact_kind();
+        this->children.back()->parent = this;
+        metrics::add(metrics::ELEMENTS_ADDED + (size_t)this->children.back()->kind_cache);
+        this->invalidate();
+    }
+
+    inline void Element::invalidate() {
+        /** Mark the cached bounding boxes and output of this element and its ancestors as stale
+         *
+         *  This is done automatically by set_attr(), add_child() and operator<<,
+         *  but must be called manually after modifying attr (or a stylesheet's css) directly.
+         */
+        for (Element* current = this; current && (current->bbox_valid || current->output_valid ||
+            current->size_valid || current->hash_valid); current = current->parent) {
+            current->bbox_valid = false;
+            current->output_valid = false;
+            current->size_valid = false;
+            current->hash_valid = false;
+        }
+    }
+
+    inline Element::BoundingBox Element::subtree_bbox() {
+        /** Return the bounding box of this element and all of its descendants,
+         *  computing it only if something changed since the last call
+         */
+        if (!this->bbox_valid) {
+            metrics::add(metrics::BBOX_CACHE_MISSES);
+            this->bbox_cache = this->get_bbox().normalized();
+            this->bbox_foreign = this->own_coordinates();
+            for (auto& child : this->children) {
+                this->bbox_cache = this->bbox_cache + child->subtree_bbox();
+                this->bbox_foreign = this->bbox_foreign || child->bbox_foreign;
+            }
+            this->bbox_valid = true;
+        }
+        else metrics::add(metrics::BBOX_CACHE_HITS);
+
+        return this->bbox_cache;
+    }
+
+    inline uint64_t Element::subtree_hash() {
+        /** Return a hash of this element's tag, attributes, content and descendants,
+         *  computing it only if something changed since the last call
+         */
+        if (!this->hash_valid) {
+            const util::StringView tag = this->tag_view();
+            uint64_t hash = tag.empty() ? util::hash_string(this->tag()) : util::hash_string(tag);
+            for (auto& pair : this->attr) {
+                hash = util::hash_string(pair.first, hash);
+                hash = util::hash_string(pair.second, hash);
+            }
+            hash = util::hash_string(this->own_content(), hash);
+            for (auto& child : this->children)
+                hash = util::hash_combine(hash, child->subtree_hash());
+
+            this->hash_cache = hash;
+            this->hash_valid = true;
+        }
+
+        return this->hash_cache;
+    }
+
+    inline uint64_t Element::output_hash(const SerializeOptions& options) {
+        /** Return a hash of what serialize() would write, computed as it's formatted
+         *  rather than kept in memory
+         */
+        util::HashingBuf buffer;
+        std::ostream out(&buffer);
+        this->serialize(out, options);
+        return buffer.hasher.digest();
+    }
+
     inline Element* Element::get_element_by_id(const std::string &id) {
         /** Return the SVG element that has a certain id */
         auto child_elems = this->get_children_helper();
@@ -412,14 +1676,25 @@ namespace SVG {
             std::map<std::string, SelectorProperties> keyframes; /**< CSS animations */
 
         protected:
-            std::string svg_to_string(const size_t) override;
+            void svg_to_stream(std::ostream&, const size_t, const SerializeOptions&) override;
+            OutputSize output_size(const SerializeOptions&) override;
+            bool empty_output() override { return this->css.empty() && this->keyframes.empty(); }
             std::string tag() override { return "style"; };
+            ElementKind element_kind() override { return ElementKind::Style; }
+            std::string own_content() override;
+            MemoryStats::Usage content_usage() override;
+            void rules_to_stream(std::ostream& out, const size_t indent_level);
         };
 
         SVG(SVGAttrib _attr =
                 { { "xmlns", "http://www.w3.org/2000/svg" } }
         ) : Shape(_attr) {}; /**< Create an <svg> with specified attributes */
-        AttributeMap& style(const std::string& key) { return this->css->css[key]; }
+        AttributeMap& style(const std::string& key) {
+            /** Add or modify a CSS rule (the stylesheet is assumed to change) */
+            if (!this->css) this->css = this->add_child<Style>();
+            this->css->invalidate();
+            return this->css->css[key];
+        }
 
         std::map<std::string, AttributeMap>& keyframes(const std::string& key) {
             /** Add or modify an animation keyframe
@@ -427,6 +1702,7 @@ namespace SVG {
              *  @param[in] key The name of the animation
              */
             if (!this->css) this->css = this->add_child<Style>();
+            this->css->invalidate();
             return this->css->keyframes[key];
         }
 
@@ -434,6 +1710,7 @@ namespace SVG {
 
     protected:
         std::string tag() override { return "svg"; }
+        ElementKind element_kind() override { return ElementKind::SVG; }
     };
 
     class Path : public Shape {
@@ -448,6 +1725,7 @@ namespace SVG {
             this->attr["d"] = "M " + std::to_string(x) + " " + std::to_string(y);
             this->x_start = x;
             this->y_start = y;
+            this->invalidate();
         }
 
         template<typename T>
@@ -459,9 +1737,11 @@ namespace SVG {
 
             if (this->attr.find("d") == this->attr.end())
                 start(x, y);
-            else
+            else {
                 this->attr["d"] += " L " + std::to_string(x) +
                                    " " + std::to_string(y);
+                this->invalidate();
+            }
         }
 
         inline void line_to(std::pair<double, double> coord) {
@@ -473,8 +1753,13 @@ namespace SVG {
             this->line_to(x_start, y_start);
         }
 
+        Element::BoundingBox get_bbox() override;
+
     protected:
+        void svg_to_stream(std::ostream&, const size_t, const SerializeOptions&) override;
+        OutputSize output_size(const SerializeOptions&) override;
         std::string tag() override { return "path"; }
+        ElementKind element_kind() override { return ElementKind::Path; }
 
     private:
         double x_start;
@@ -496,9 +1781,15 @@ namespace SVG {
                 Text(xy.first, xy.second, _content) {};
 
     protected:
+        friend class Parser;
+        friend class BinaryDocument;
         std::string content;
-        std::string svg_to_string(const size_t) override;
+        void svg_to_stream(std::ostream&, const size_t, const SerializeOptions&) override;
+        OutputSize output_size(const SerializeOptions&) override;
         std::string tag() override { return "text"; }
+        ElementKind element_kind() override { return ElementKind::Text; }
+        std::string own_content() override { return this->content; }
+        MemoryStats::Usage content_usage() override { return MemoryStats::string_usage(this->content); }
     };
 
     class Group : public Element {
@@ -506,6 +1797,7 @@ namespace SVG {
         using Element::Element;
     protected:
         std::string tag() override { return "g"; }
+        ElementKind element_kind() override { return ElementKind::Group; }
     };
 
     class Line : public Shape {
@@ -540,6 +1832,7 @@ namespace SVG {
     protected:
         Element::BoundingBox get_bbox() override;   
         std::string tag() override { return "line"; }
+        ElementKind element_kind() override { return ElementKind::Line; }
     };
 
     class Rect : public Shape {
@@ -559,6 +1852,7 @@ namespace SVG {
         Element::BoundingBox get_bbox() override;
     protected:
         std::string tag() override { return "rect"; }
+        ElementKind element_kind() override { return ElementKind::Rect; }
     };
 
     class Circle : public Shape {
@@ -584,6 +1878,7 @@ namespace SVG {
 
     protected:
         std::string tag() override { return "circle"; }
+        ElementKind element_kind() override { return ElementKind::Circle; }
     };
 
     class Polygon : public Element {
@@ -598,10 +1893,159 @@ namespace SVG {
                 point_str += to_string(pt) + " ";
         };
 
+        std::vector<Point> points();
+        Element::BoundingBox get_bbox() override;
+
     protected:
+        void svg_to_stream(std::ostream&, const size_t, const SerializeOptions&) override;
+        OutputSize output_size(const SerializeOptions&) override;
         std::string tag() override { return "polygon"; }
+        ElementKind element_kind() override { return ElementKind::Polygon; }
+    };
+
+    /** @class GenericElement
+     *  @brief Any element without a dedicated class, e.g. <defs> or <title>, as
+     *         created when loading existing documents
+     */
+    class GenericElement : public Element {
+    public:
+        GenericElement(const std::string& _tag, SVGAttrib _attr = {}) : Element(_attr), tag_name(_tag) {};
+        std::string content; /**< Character data, written out before any children */
+
+    protected:
+        void svg_to_stream(std::ostream&, const size_t, const SerializeOptions&) override;
+        OutputSize output_size(const SerializeOptions&) override;
+        std::string tag() override { return this->tag_name; }
+        util::StringView tag_view() override { return this->tag_name; }
+        ElementKind element_kind() override { return ElementKind::Generic; }
+        std::string own_content() override { return this->content; }
+        MemoryStats::Usage content_usage() override {
+            MemoryStats::Usage ret = MemoryStats::string_usage(this->content);
+            ret += MemoryStats::string_usage(this->tag_name);
+            return ret;
+        }
+
+    private:
+        std::string tag_name;
     };
 
+    template<> struct KindOf<SVG> { static const ElementKind value = ElementKind::SVG; };
+    template<> struct KindOf<SVG::Style> { static const ElementKind value = ElementKind::Style; };
+    template<> struct KindOf<Group> { static const ElementKind value = ElementKind::Group; };
+    template<> struct KindOf<Rect> { static const ElementKind value = ElementKind::Rect; };
+    template<> struct KindOf<Circle> { static const ElementKind value = ElementKind::Circle; };
+    template<> struct KindOf<Line> { static const ElementKind value = ElementKind::Line; };
+    template<> struct KindOf<Path> { static const ElementKind value = ElementKind::Path; };
+    template<> struct KindOf<Polygon> { static const ElementKind value = ElementKind::Polygon; };
+    template<> struct KindOf<Text> { static const ElementKind value = ElementKind::Text; };
+    template<> struct KindOf<GenericElement> { static const ElementKind value = ElementKind::Generic; };
+
+    inline ElementKind Element::exact_kind() {
+        /** Return element_kind(), or Other if this is an instance of a class
+         *  derived from that built-in class, which may override tag() or
+         *  svg_to_stream()
+         */
+        const ElementKind kind = this->element_kind();
+        const std::type_info& type = typeid(*this);
+        bool exact = true;
+        switch (kind) {
+        case ElementKind::SVG: exact = type == typeid(SVG); break;
+        case ElementKind::Style: exact = type == typeid(SVG::Style); break;
+        case ElementKind::Group: exact = type == typeid(Group); break;
+        case ElementKind::Rect: exact = type == typeid(Rect); break;
+        case ElementKind::Circle: exact = type == typeid(Circle); break;
+        case ElementKind::Line: exact = type == typeid(Line); break;
+        case ElementKind::Path: exact = type == typeid(Path); break;
+        case ElementKind::Polygon: exact = type == typeid(Polygon); break;
+        case ElementKind::Text: exact = type == typeid(Text); break;
+        case ElementKind::Generic: exact = type == typeid(GenericElement); break;
+        default: break;
+        }
+
+        return exact ? kind : ElementKind::Other;
+    }
+
+    template<typename Visitor>
+    inline void dispatch(Element& elem, Visitor&& visitor) {
+        /** Call visitor with elem cast to its actual class, using a switch
+         *  instead of dynamic_cast. Visitors can overload operator() for the
+         *  classes they care about and take an Element& for the rest.
+         */
+        switch (elem.kind()) {
+        case ElementKind::SVG: visitor(static_cast<SVG&>(elem)); break;
+        case ElementKind::Style: visitor(static_cast<SVG::Style&>(elem)); break;
+        case ElementKind::Group: visitor(static_cast<Group&>(elem)); break;
+        case ElementKind::Rect: visitor(static_cast<Rect&>(elem)); break;
+        case ElementKind::Circle: visitor(static_cast<Circle&>(elem)); break;
+        case ElementKind::Line: visitor(static_cast<Line&>(elem)); break;
+        case ElementKind::Path: visitor(static_cast<Path&>(elem)); break;
+        case ElementKind::Polygon: visitor(static_cast<Polygon&>(elem)); break;
+        case ElementKind::Text: visitor(static_cast<Text&>(elem)); break;
+        case ElementKind::Generic: visitor(static_cast<GenericElement&>(elem)); break;
+        default: visitor(elem);
+        }
+    }
+
+    template<typename Visitor>
+    inline void Element::visit(Visitor&& visitor) {
+        /** Dispatch this element and then its descendants (depth-first, in document order) to visitor */
+        dispatch(*this, visitor);
+        for (auto& child : this->children)
+            child->visit(visitor);
+    }
+
+    namespace util {
+        struct ObjectSize {
+            /** Visitor which records the size of an element's actual class */
+            size_t bytes = 0;
+            template<typename T> void operator()(T&) { this->bytes = sizeof(T); }
+        };
+    }
+
+    inline MemoryStats Element::memory_stats() {
+        /** Estimate the heap used by this element and its descendants
+         *
+         *  This element is counted as if it were heap-allocated, even if it
+         *  lives on the stack. Objects of user-defined classes are counted as
+         *  sizeof(Element).
+         */
+        MemoryStats stats;
+        std::vector<Element*> stack = { this };
+        while (!stack.empty()) {
+            Element* elem = stack.back();
+            stack.pop_back();
+
+            util::ObjectSize size;
+            dispatch(*elem, size);
+            MemoryStats::Usage node, attributes, children, content, cache;
+            node.add(size.bytes);
+            attributes = MemoryStats::attribute_usage(elem->attr);
+            if (elem->children.capacity())
+                children.add(elem->children.capacity() * sizeof(std::unique_ptr<Element>));
+            content = elem->content_usage();
+            cache = MemoryStats::string_usage(elem->output_cache);
+
+            stats.elements++;
+            stats.nodes += node;
+            stats.attributes += attributes;
+            stats.children += children;
+            stats.content += content;
+            stats.cache += cache;
+
+            const util::StringView tag = elem->tag_view();
+            MemoryStats::Usage& by_tag = stats.by_tag[tag.empty() ? elem->tag() : std::string(tag)];
+            by_tag += node;
+            by_tag += attributes;
+            by_tag += children;
+            by_tag += content;
+            by_tag += cache;
+
+            for (auto& child : elem->children) stack.push_back(child.get());
+        }
+
+        return stats;
+    }
+
     inline Element::BoundingBox Line::get_bbox() {
         return { x1(), x2(), y1(), y2() };
     }
@@ -612,6 +2056,24 @@ namespace SVG {
         return { x, x + width, y, y + height };
     }
 
+    inline std::unique_ptr<Element> Element::detach() {
+        /** Remove this element from its parent and return ownership of it, or
+         *  nullptr if it has no parent (i.e. is already owned by someone else)
+         */
+        if (!this->parent) return nullptr;
+        auto& siblings = this->parent->children;
+        auto it = std::find_if(siblings.begin(), siblings.end(),
+            [this](const std::unique_ptr<Element>& sibling) { return sibling.get() == this; });
+
+        std::unique_ptr<Element> ret = std::move(*it);
+        siblings.erase(it);
+        auto svg = dynamic_cast<SVG*>(this->parent);
+        if (svg && svg->css == this) svg->css = nullptr;
+        this->parent->invalidate();
+        this->parent = nullptr;
+        return ret;
+    }
+
     inline Element::BoundingBox Circle::get_bbox() {
         double x = this->x(), y = this->y(), radius = this->radius();
 
@@ -623,6 +2085,38 @@ namespace SVG {
         };
     }
 
+    inline std::vector<Point> Polygon::points() {
+        /** Return the vertices of this polygon */
+        std::vector<Point> ret;
+        auto coords = util::parse_numbers(this->find_attr("points"));
+        for (size_t i = 0; i + 1 < coords.size(); i += 2)
+            ret.push_back(Point(coords[i], coords[i + 1]));
+        return ret;
+    }
+
+    inline Element::BoundingBox Polygon::get_bbox() {
+        Element::BoundingBox ret = { NAN, NAN, NAN, NAN };
+        for (auto& pt : this->points())
+            ret = ret + Element::BoundingBox(pt.first, pt.first, pt.second, pt.second);
+        return ret;
+    }
+
+    inline Element::BoundingBox Path::get_bbox() {
+        /** Compute the bounding box of a path made of straight lines
+         *  (paths with curves have no bounding box)
+         */
+        Element::BoundingBox ret = { NAN, NAN, NAN, NAN };
+        std::vector<std::vector<Point>> subpaths;
+        std::vector<bool> closed;
+        if (!util::parse_path(this->find_attr("d"), subpaths, closed))
+            return ret;
+
+        for (auto& subpath : subpaths)
+            for (auto& pt : subpath)
+                ret = ret + Element::BoundingBox(pt.first, pt.first, pt.second, pt.second);
+        return ret;
+    }
+
     inline std::pair<double, double> Line::along(double percent) {
         /** Return the coordinates required to place an element along
          *   this line
@@ -660,149 +2154,4479 @@ namespace SVG {
          *
          *  @param[out] indent_level The current level of indentation
          */
-         
-        auto indent = std::string(indent_level, '\t');
-        std::string ret = indent + "<" + tag();
+        SVG_TRACE_SCOPE("svg_to_string");
+        metrics::Timer timer(metrics::SVG_TO_STRING);
+        std::stringstream ss;
+        this->serialize_metered(ss, indent_level, SerializeOptions());
+        return ss.str();
+    }
 
-        // Set attributes
-        for (auto& pair: attr)
-            ret += " " + pair.first + "=" + "\"" + pair.second + "\"";
+    inline void Element::serialize_metered(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options) {
+        /** Write this element to a stream without the cache, counting the bytes
+         *  written by each element and in total
+         */
+        util::MeteredBuf meter(out.rdbuf());
+        std::ostream metered(&meter);
+        this->write_metered(metered, indent_level, options);
+        metrics::add(metrics::SERIALIZED_BYTES, meter.count);
+        if (!metered) out.setstate(std::ios::badbit);
+    }
 
-        if (!this->children.empty()) {
-            ret += ">\n";
+    inline void Element::write_metered(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options) {
+        /** Write this element, crediting the bytes it writes itself (excluding
+         *  those of children written the same way) to its kind if out is metered
+         */
+        auto meter = dynamic_cast<util::MeteredBuf*>(out.rdbuf());
+        if (!meter) {
+            this->svg_to_stream(out, indent_level, options);
+            return;
+        }
 
-            // Recursively get strings for child elements
-            for (auto& child : children) {
-                // Avoid adding empty strings
-                auto str = child->svg_to_string(indent_level + 1);
-                if (str.size()) ret += str +"\n";
-            }
+        const size_t start = meter->count, attributed = meter->attributed;
+        this->svg_to_stream(out, indent_level, options);
+        const size_t total = meter->count - start;
+        metrics::add(metrics::ELEMENT_BYTES + (size_t)this->kind(), total - (meter->attributed - attributed));
+        meter->attributed = attributed + total;
+    }
 
-            return ret += indent + "</" + tag() + ">";
+    inline const std::string& Element::cached_output(const size_t indent_level) {
+        /** Return the string representation of this element with default options,
+         *  only regenerating it if this element or one of its descendants changed
+         *
+         *  Parents are built by splicing together the cached output of their
+         *  children, so after a change only the path from the modified element
+         *  to the root is reformatted.
+         */
+        if (!this->output_valid || this->output_indent != indent_level) {
+            SerializeOptions options;
+            options.cache = true;
+            std::stringstream ss;
+            this->svg_to_stream(ss, indent_level, options);
+            this->output_cache = ss.str();
+            this->output_indent = indent_level;
+            this->output_valid = true;
+
+            // Children were just brought up to date, so what's left was written for this element
+            size_t own_bytes = this->output_cache.size();
+            for (auto& child : this->children)
+                own_bytes -= std::min(own_bytes, child->output_cache.size());
+            metrics::add(metrics::ELEMENT_BYTES + (size_t)this->kind(), own_bytes);
         }
 
-        return ret += " />";
+        return this->output_cache;
     }
 
-    inline std::string to_string(const std::map<std::string, AttributeMap>& css, const size_t indent_level) {
-        /** Print out a CSS attribute block */
-        auto indent = std::string(indent_level, '\t'), ret = std::string();
-        for (auto& selector : css) {
-            // Loop over each selector's attribute/value pairs
-            ret += indent + "\t\t" + selector.first + " {\n";
-            for (auto& attr : selector.second.attr)
-                ret += indent + "\t\t\t" + attr.first + ": " + attr.second + ";\n";
-            ret += indent + "\t\t" + "}\n";
-        }
-        return ret;
+    inline bool Element::use_cache(const SerializeOptions& options) {
+        /** Whether to write elements from (and into) their output caches */
+        return options.cache && options.cacheable();
     }
 
-    inline std::string SVG::Style::svg_to_string(const size_t indent_level) {
-        /** Create a CSS stylesheet */
-        auto indent = std::string(indent_level, '\t');
+    inline bool Element::default_layout() {
+        /** Whether this element is written by write_element(), i.e. as its start
+         *  tag, a line for each child and its end tag
+         */
+        const ElementKind kind = this->kind();
+        return kind == ElementKind::SVG || kind == ElementKind::Group ||
+            kind == ElementKind::Rect || kind == ElementKind::Circle || kind == ElementKind::Line;
+    }
 
-        if (!this->css.empty() || !this->keyframes.empty()) {
-            std::string ret = indent + "<style type=\"text/css\">\n" +
-                indent + "\t<![CDATA[\n";
+    inline std::string Element::serialize(const SerializeOptions& options) {
+        /** Return the string representation of this element, subject to options */
+        std::stringstream ss;
+        this->serialize(ss, options);
+        return ss.str();
+    }
 
-            // Begin CSS stylesheet
-            ret += to_string(this->css, indent_level);
+    inline void Element::serialize(std::ostream& out, const SerializeOptions& options) {
+        /** Write this element to a stream, subject to options
+         *
+         *  When culling, the viewport is taken to be in this element's user
+         *  coordinates. Nested <svg> elements and elements with a transform
+         *  establish their own coordinate systems, so they and their contents
+         *  are never culled.
+         */
+        SVG_TRACE_SCOPE("serialize");
+        metrics::Timer timer(metrics::SERIALIZE);
+        if (use_cache(options)) {
+            auto& output = this->cached_output(0);
+            metrics::add(metrics::SERIALIZED_BYTES, output.size());
+            out << output;
+        }
+        else this->serialize_metered(out, 0, options);
+    }
 
-            // Animation frames
-            for (auto& anim : this->keyframes) {
-                ret += indent + "\t\t@keyframes " + anim.first + " {\n" +
-                    to_string(anim.second, indent_level + 1) +
-                    indent + "\t\t" + "}\n";
-            }
+    inline void Element::svg_open_tag(std::ostream& out, const size_t indent_level, const bool self_closing) {
+        this->svg_open_tag(out, indent_level, self_closing, this->attr);
+    }
 
-            ret += indent + "\t]]>\n";
-            return ret + indent + "</style>";
-        }
+    inline void Element::svg_open_tag(std::ostream& out, const size_t indent_level, const bool self_closing,
+        const SVGAttrib& attrs) {
+        /** Write the opening tag of this element with the given attributes */
+        util::write_indent(out, indent_level);
+        out << "<";
+        this->write_tag(out);
+        for (auto& pair: attrs)
+            out << " " << pair.first << "=\"" << pair.second << "\"";
+        out << (self_closing ? " />" : ">");
+    }
 
-        return "";
+    inline void Element::svg_close_tag(std::ostream& out, const size_t indent_level) {
+        util::write_indent(out, indent_level);
+        out << "</";
+        this->write_tag(out);
+        out << ">";
     }
 
-    inline std::string Text::svg_to_string(const size_t indent_level) {
-        auto indent = std::string(indent_level, '\t');
-        std::string ret = indent + "<text";
-        for (auto& pair: attr)
-            ret += " " + pair.first + "=" + "\"" + pair.second + "\"";
-        return ret += ">" + this->content + "</text>";
+    inline void Element::write_tag(std::ostream& out) {
+        /** Write this element's tag, only calling tag() for user-defined classes */
+        const util::StringView tag = this->tag_view();
+        if (tag.empty()) out << this->tag();
+        else out << tag;
     }
 
-    inline void Element::autoscale(const double margin) {
-        /** Like other autoscale() but accepts margin as a percentage */
-        Element::BoundingBox bbox = this->get_bbox();
-        this->get_bbox(bbox);
-        double width = abs(bbox.x1) + abs(bbox.x2),
-            height = abs(bbox.y1) + abs(bbox.y2);
+    inline void Element::svg_to_stream(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options) {
+        /** Write the string representation of an SVG element to a stream
+         *
+         *  @param[out] indent_level The current level of indentation
+         */
+        this->write_element(out, indent_level, options, this->attr);
+    }
 
-        this->autoscale({
-            width * margin, width * margin,
-            height * margin, height * margin 
-        });
+    inline bool Element::own_coordinates() {
+        /** Return true if this element's contents aren't in its parent's user coordinates */
+        return dynamic_cast<SVG*>(this) || this->attr.find("transform") != this->attr.end();
     }
 
-    inline void Element::autoscale(const Margins& margins) {
-        /** Automatically set the width, height, and viewBox attribute of this item
-         *  so that it can contain all of its children without clipping
+    inline bool Element::outside(const SerializeOptions& options) {
+        /** Return true if culling skips this subtree, which lies outside of the viewport
          *
-         *  @param[in] margins Extra margins for the sides
+         *  Subtrees with nested <svg> elements or transforms anywhere are kept, as
+         *  their bounding boxes aren't in the viewport's coordinates.
          */
-        using std::stof;
+        if (!options.cull) return false;
+        auto bbox = this->subtree_bbox();
+        return !this->bbox_foreign && !isnan(bbox.x1) && !bbox.intersects(options.viewport);
+    }
 
-        Element::BoundingBox bbox = this->get_bbox();
-        this->get_bbox(bbox); // Compute the bounding box (recursive)
-        double width = abs(bbox.x1) + abs(bbox.x2) + margins.x1 + margins.x2,
-            height = abs(bbox.y1) + abs(bbox.y2) + margins.y1 + margins.y2,
-            x1 = bbox.x1 - margins.x1, y1 = bbox.y1 - margins.y1;
+    inline void Element::write_element(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options, const SVGAttrib& attrs) {
+        /** Write this element and its children, using attrs in place of this->attr */
+        if (this->children.empty()) {
+            this->svg_open_tag(out, indent_level, true, attrs);
+            return;
+        }
 
-        this->set_attr("width", width)
-             .set_attr("height", height);
+        this->svg_open_tag(out, indent_level, false, attrs);
+        out << "\n";
 
-        if (x1 < 0 || y1 < 0) {
-            std::stringstream viewbox;
-            viewbox << std::fixed << std::setprecision(1)
-                << x1 << " " // min-x
-                << y1 << " " // min-y
-                << width << " "
-                << height;
-            this->set_attr("viewBox", viewbox.str());
+        // Nested <svg> elements and transforms have their own coordinate systems
+        SerializeOptions uncull = options;
+        uncull.cull = false;
+
+        // Recursively write child elements
+        for (auto& child : children) {
+            if (use_cache(options)) {
+                // Caching empty output too keeps every ancestor of a stale element stale
+                auto& output = child->cached_output(indent_level + 1);
+                if (!output.empty()) out << output << "\n";
+                continue;
+            }
+
+            // Avoid adding empty lines
+            if (child->empty_output() || child->outside(options)) continue;
+
+            bool nested = options.cull && child->own_coordinates();
+            child->write_metered(out, indent_level + 1, nested ? uncull : options);
+            out << "\n";
         }
-    }
 
-    inline void Element::get_bbox(Element::BoundingBox& box) {
-        /** Recursively compute a bounding box */
-        auto this_bbox = this->get_bbox();
-        box = this_bbox + box; // Take union of both
-        for (auto& child: this->children) child->get_bbox(box); // Recursion
+        this->svg_close_tag(out, indent_level);
     }
 
-    inline Element::ChildMap Element::get_children() {
+    inline void Polygon::svg_to_stream(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options) {
+        /** Write this polygon, simplifying it and clipping it to the viewport if
+         *  it crosses the edge, as requested by options
+         */
+        auto bbox = this->get_bbox();
+        const bool crosses = options.cull && options.clip && !isnan(bbox.x1) &&
+            !options.viewport.contains(bbox);
+        if (!crosses && options.simplify <= 0) {
+            this->write_element(out, indent_level, options, this->attr);
+            return;
+        }
+
+        auto points = this->points();
+        if (options.simplify > 0) points = util::simplify_polyline(points, options.simplify);
+        if (crosses) points = util::clip_polygon(points, options.viewport);
+
+        SVGAttrib modified = this->attr;
+        std::string& point_str = modified["points"];
+        point_str.clear();
+        for (auto& pt : points)
+            point_str += to_string(pt) + " ";
+        this->write_element(out, indent_level, options, modified);
+    }
+
+    inline void Path::svg_to_stream(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options) {
+        /** Write this path, simplifying it and clipping it to the viewport if
+         *  it crosses the edge, as requested by options
+         *
+         *  Closed subpaths are clipped as polygons, and open subpaths as polylines.
+         */
+        auto bbox = this->get_bbox();
+        const bool crosses = options.cull && options.clip && !isnan(bbox.x1) &&
+            !options.viewport.contains(bbox);
+        if (isnan(bbox.x1) || (!crosses && options.simplify <= 0)) {
+            this->write_element(out, indent_level, options, this->attr);
+            return;
+        }
+
+        std::vector<std::vector<Point>> subpaths;
+        std::vector<bool> closed;
+        util::parse_path(this->find_attr("d"), subpaths, closed);
+
+        std::string d;
+        auto write_points = [&d](const std::vector<Point>& points, const bool close) {
+            for (size_t i = 0; i < points.size(); i++) {
+                d += (d.empty() ? "" : " ") + std::string(i ? "L " : "M ") +
+                    std::to_string(points[i].first) + " " + std::to_string(points[i].second);
+            }
+            if (close) d += " Z";
+        };
+
+        for (size_t i = 0; i < subpaths.size(); i++) {
+            auto subpath = subpaths[i];
+            const bool is_closed = closed[i] || (subpath.size() > 2 && subpath.front() == subpath.back());
+            if (options.simplify > 0) subpath = util::simplify_polyline(subpath, options.simplify);
+
+            if (!crosses) {
+                write_points(subpath, closed[i]);
+            }
+            else if (is_closed) {
+                auto clipped = util::clip_polygon(subpath, options.viewport);
+                if (!clipped.empty()) write_points(clipped, true);
+            }
+            else {
+                for (auto& piece : util::clip_polyline(subpath, options.viewport))
+                    write_points(piece, false);
+            }
+        }
+
+        SVGAttrib modified = this->attr;
+        modified["d"] = d;
+        this->write_element(out, indent_level, options, modified);
+    }
+
+    inline void css_to_stream(std::ostream& out, const std::map<std::string, AttributeMap>& css, const size_t indent_level) {
+        /** Write out a CSS attribute block */
+        auto indent = std::string(indent_level, '\t');
+        for (auto& selector : css) {
+            // Loop over each selector's attribute/value pairs
+            out << indent << "\t\t" << selector.first << " {\n";
+            for (auto& attr : selector.second.attr)
+                out << indent << "\t\t\t" << attr.first << ": " << attr.second << ";\n";
+            out << indent << "\t\t" << "}\n";
+        }
+    }
+
+    inline std::string to_string(const std::map<std::string, AttributeMap>& css, const size_t indent_level) {
+        /** Print out a CSS attribute block */
+        std::stringstream ss;
+        css_to_stream(ss, css, indent_level);
+        return ss.str();
+    }
+
+    inline void SVG::Style::svg_to_stream(std::ostream& out, const size_t indent_level,
+        const SerializeOptions&) {
+        /** Create a CSS stylesheet */
+        if (this->empty_output()) return;
+        auto indent = std::string(indent_level, '\t');
+
+        out << indent << "<style type=\"text/css\">\n" <<
+            indent << "\t<![CDATA[\n";
+        this->rules_to_stream(out, indent_level);
+        out << indent << "\t]]>\n" << indent << "</style>";
+    }
+
+    inline void SVG::Style::rules_to_stream(std::ostream& out, const size_t indent_level) {
+        /** Write the CSS rules and keyframes of this stylesheet */
+        auto indent = std::string(indent_level, '\t');
+        css_to_stream(out, this->css, indent_level);
+
+        // Animation frames
+        for (auto& anim : this->keyframes) {
+            out << indent << "\t\t@keyframes " << anim.first << " {\n";
+            css_to_stream(out, anim.second, indent_level + 1);
+            out << indent << "\t\t" << "}\n";
+        }
+    }
+
+    inline MemoryStats::Usage SVG::Style::content_usage() {
+        MemoryStats::Usage ret = MemoryStats::selector_usage(this->css);
+        ret += MemoryStats::node_usage(this->keyframes);
+        for (auto& anim : this->keyframes) {
+            ret += MemoryStats::string_usage(anim.first);
+            ret += MemoryStats::selector_usage(anim.second);
+        }
+        return ret;
+    }
+
+    inline std::string SVG::Style::own_content() {
+        std::stringstream ss;
+        this->rules_to_stream(ss, 0);
+        return ss.str();
+    }
+
+    inline void Text::svg_to_stream(std::ostream& out, const size_t indent_level,
+        const SerializeOptions&) {
+        util::write_indent(out, indent_level);
+        out << "<text";
+        for (auto& pair: attr)
+            out << " " << pair.first << "=" << "\"" << pair.second << "\"";
+        out << ">" << this->content << "</text>";
+    }
+
+    inline void GenericElement::svg_to_stream(std::ostream& out, const size_t indent_level,
+        const SerializeOptions& options) {
+        if (this->content.empty()) {
+            this->write_element(out, indent_level, options, this->attr);
+            return;
+        }
+
+        this->svg_open_tag(out, indent_level, false);
+        out << this->content;
+        if (this->children.empty()) {
+            out << "</" << this->tag_name << ">";
+            return;
+        }
+
+        out << "\n";
+        for (auto& child : this->children) {
+            if (use_cache(options)) {
+                auto& output = child->cached_output(indent_level + 1);
+                if (!output.empty()) out << output << "\n";
+                continue;
+            }
+
+            if (child->empty_output()) continue;
+            child->write_metered(out, indent_level + 1, options);
+            out << "\n";
+        }
+        this->svg_close_tag(out, indent_level);
+    }
+
+    inline size_t Element::serialized_size() {
+        /** Return the length of this element's string representation, without writing it */
+        return this->serialized_size(SerializeOptions());
+    }
+
+    inline size_t Element::serialized_size(const SerializeOptions& options) {
+        /** Return exactly how many bytes serialize() would write with the same
+         *  options, e.g. to preallocate a buffer or file
+         *
+         *  Sizes are computed from the lengths of tags, attributes, and content
+         *  rather than by formatting. With options.cache set they are cached
+         *  alongside the output, so only subtrees which changed since the last
+         *  call are visited again. Polygons and paths which would be simplified or
+         *  clipped, and user-defined classes, are formatted to be measured.
+         */
+        SVG_TRACE_SCOPE("serialized_size");
+        return this->subtree_size(options).at(0);
+    }
+
+    inline Element::OutputSize Element::subtree_size(const SerializeOptions& options) {
+        /** Return the size of this element's output, caching it along with the output
+         *
+         *  User-defined classes, including those derived from built-in ones,
+         *  may write anything, so they are measured by formatting them.
+         */
+        auto measure = [this](const SerializeOptions& measured) {
+            return this->kind() == ElementKind::Other ? this->counted_size(measured) : this->output_size(measured);
+        };
+        if (!use_cache(options)) return measure(options);
+        if (!this->size_valid) {
+            this->size_cache = measure(SerializeOptions());
+            this->size_valid = true;
+        }
+
+        return this->size_cache;
+    }
+
+    inline Element::OutputSize Element::output_size(const SerializeOptions& options) {
+        /** Return the size of what svg_to_stream() writes. Built-in classes
+         *  which write themselves differently override both.
+         */
+        return this->element_size(options, this->attr);
+    }
+
+    inline Element::OutputSize Element::element_size(const SerializeOptions& options, const SVGAttrib& attrs) {
+        /** Return the size of what write_element() writes */
+        OutputSize ret = { this->tag_size() + 2, 1 }; // "<" tag ">"
+        for (auto& pair : attrs)
+            ret.bytes += pair.first.size() + pair.second.size() + 4; // ' key="value"'
+
+        if (this->children.empty()) {
+            ret.bytes += 2; // " />" instead of ">"
+            return ret;
+        }
+
+        SerializeOptions uncull = options;
+        uncull.cull = false;
+
+        ret.bytes += 1 + this->tag_size() + 3; // Newline, then "</" tag ">"
+        ret.lines++;
+        for (auto& child : this->children) {
+            if (child->empty_output() || child->outside(options)) continue;
+
+            bool nested = options.cull && child->own_coordinates();
+            OutputSize child_size = child->subtree_size(nested ? uncull : options);
+            ret.bytes += child_size.at(1) + 1; // One level deeper, and a newline
+            ret.lines += child_size.lines;
+        }
+
+        return ret;
+    }
+
+    inline Element::OutputSize Element::counted_size(const SerializeOptions& options) {
+        /** Measure this element's output by formatting it at two indentation levels */
+        util::CountingBuf buffer;
+        std::ostream out(&buffer);
+        this->svg_to_stream(out, 0, options);
+        const size_t bytes = buffer.count;
+        this->svg_to_stream(out, 1, options);
+        return { bytes, buffer.count - 2 * bytes };
+    }
+
+    inline size_t Element::tag_size() {
+        const util::StringView tag = this->tag_view();
+        return tag.empty() ? this->tag().size() : tag.size();
+    }
+
+    inline Element::OutputSize Polygon::output_size(const SerializeOptions& options) {
+        auto bbox = this->get_bbox();
+        const bool crosses = options.cull && options.clip && !isnan(bbox.x1) &&
+            !options.viewport.contains(bbox);
+        if (!crosses && options.simplify <= 0) return this->element_size(options, this->attr);
+        return this->counted_size(options);
+    }
+
+    inline Element::OutputSize Path::output_size(const SerializeOptions& options) {
+        auto bbox = this->get_bbox();
+        const bool crosses = options.cull && options.clip && !isnan(bbox.x1) &&
+            !options.viewport.contains(bbox);
+        if (isnan(bbox.x1) || (!crosses && options.simplify <= 0))
+            return this->element_size(options, this->attr);
+        return this->counted_size(options);
+    }
+
+    inline Element::OutputSize SVG::Style::output_size(const SerializeOptions&) {
+        if (this->empty_output()) return { 0, 0 };
+
+        // Each line of a CSS block is indented by two tabs, plus one per level of nesting
+        auto css_size = [](const SelectorProperties& css) {
+            OutputSize ret = { 0, 0 };
+            for (auto& selector : css) {
+                ret.bytes += 2 + selector.first.size() + 3 + 4; // "\t\tselector {\n" and "\t\t}\n"
+                ret.lines += 2 + selector.second.attr.size();
+                for (auto& attr : selector.second.attr)
+                    ret.bytes += 3 + attr.first.size() + 2 + attr.second.size() + 2; // "\t\t\tkey: value;\n"
+            }
+            return ret;
+        };
+
+        // <style type="text/css">, <![CDATA[, ]]> and </style> lines
+        OutputSize ret = { 24 + 11 + 5 + 8, 4 };
+        OutputSize rules = css_size(this->css);
+        ret.bytes += rules.bytes;
+        ret.lines += rules.lines;
+
+        for (auto& anim : this->keyframes) {
+            OutputSize frames = css_size(anim.second);
+            ret.bytes += (2 + 11 + anim.first.size() + 3) + frames.at(1) + 4; // "\t\t@keyframes name {\n" ... "\t\t}\n"
+            ret.lines += 2 + frames.lines;
+        }
+
+        return ret;
+    }
+
+    inline Element::OutputSize Text::output_size(const SerializeOptions&) {
+        OutputSize ret = { 5 + 1 + this->content.size() + 7, 1 }; // "<text" ">" content "</text>"
+        for (auto& pair : this->attr)
+            ret.bytes += pair.first.size() + pair.second.size() + 4;
+        return ret;
+    }
+
+    inline Element::OutputSize GenericElement::output_size(const SerializeOptions& options) {
+        if (this->content.empty()) return this->element_size(options, this->attr);
+
+        OutputSize ret = { this->tag_name.size() + 2 + this->content.size(), 1 };
+        for (auto& pair : this->attr)
+            ret.bytes += pair.first.size() + pair.second.size() + 4;
+
+        ret.bytes += this->tag_name.size() + 3; // "</" tag ">"
+        if (this->children.empty()) return ret;
+
+        ret.bytes += 1; // Newline after the content, and the closing tag gets its own line
+        ret.lines++;
+        for (auto& child : this->children) {
+            if (child->empty_output()) continue;
+            OutputSize child_size = child->subtree_size(options);
+            ret.bytes += child_size.at(1) + 1;
+            ret.lines += child_size.lines;
+        }
+
+        return ret;
+    }
+
+    inline void Element::autoscale(const double margin) {
+        /** Like other autoscale() but accepts margin as a percentage */
+        Element::BoundingBox bbox = this->subtree_bbox();
+        double width = abs(bbox.x1) + abs(bbox.x2),
+            height = abs(bbox.y1) + abs(bbox.y2);
+
+        this->autoscale({
+            width * margin, width * margin,
+            height * margin, height * margin 
+        });
+    }
+
+    inline void Element::autoscale(const Margins& margins) {
+        /** Automatically set the width, height, and viewBox attribute of this item
+         *  so that it can contain all of its children without clipping
+         *
+         *  @param[in] margins Extra margins for the sides
+         */
+        SVG_TRACE_SCOPE("autoscale");
+        metrics::Timer timer(metrics::AUTOSCALE);
+        using std::stof;
+
+        // Compute the bounding box (recursive, cached)
+        for (auto& pair : Element::autoscale_attributes(this->subtree_bbox(), margins))
+            this->set_attr(pair.first, pair.second);
+    }
+
+    inline SVGAttrib Element::autoscale_attributes(const BoundingBox& bbox, const Margins& margins) {
+        /** Return the width, height, and (if needed) viewBox attributes which
+         *  fit a drawing with the given bounding box
+         */
+        double width = abs(bbox.x1) + abs(bbox.x2) + margins.x1 + margins.x2,
+            height = abs(bbox.y1) + abs(bbox.y2) + margins.y1 + margins.y2,
+            x1 = bbox.x1 - margins.x1, y1 = bbox.y1 - margins.y1;
+
+        SVGAttrib ret;
+        ret["width"] = to_string(width);
+        ret["height"] = to_string(height);
+
+        if (x1 < 0 || y1 < 0) {
+            std::stringstream viewbox;
+            viewbox << std::fixed << std::setprecision(1)
+                << x1 << " " // min-x
+                << y1 << " " // min-y
+                << width << " "
+                << height;
+            ret["viewBox"] = viewbox.str();
+        }
+
+        return ret;
+    }
+
+    inline void Element::get_bbox(Element::BoundingBox& box) {
+        /** Recursively compute a bounding box */
+        auto this_bbox = this->get_bbox();
+        box = this_bbox + box; // Take union of both
+        for (auto& child: this->children) child->get_bbox(box); // Recursion
+    }
+
+    inline Element::ChildMap Element::get_children() {
         /** Recursively compute all of the children of an SVG element */
         Element::ChildMap child_map;
-        for (auto& child : this->get_children_helper())
-            child_map[child->tag()].push_back(child);
+        ChildList* by_kind[(size_t)ElementKind::Generic] = {}; // Only look up each built-in tag once
+
+        for (auto& child : this->get_children_helper()) {
+            const ElementKind kind = child->kind();
+            if (kind == ElementKind::Other) {
+                child_map[child->tag()].push_back(child);
+                continue;
+            }
+            else if (kind >= ElementKind::Generic) {
+                // Only copy the tag name the first time it's seen
+                const util::StringView tag = child->tag_view();
+                auto list = child_map.find(tag);
+                if (list == child_map.end()) list = child_map.emplace(std::string(tag), ChildList()).first;
+                list->second.push_back(child);
+                continue;
+            }
+
+            ChildList*& list = by_kind[(size_t)kind];
+            if (!list) list = &child_map[kind_tag(kind)];
+            list->push_back(child);
+        }
         return child_map;
     }
 
-    inline std::vector<Element*> Element::get_children_helper() {
-        /** Helper function which populates a std::deque with all of an Element's children */
-        std::deque<Element*> temp;
-        std::vector<Element*> ret;
+    inline std::vector<Element*> Element::get_children_helper() {
+        /** Return all of an Element's descendants in breadth-first order */
+        std::vector<Element*> ret;
+        for (auto& child : this->children) { ret.push_back(child.get()); }
+
+        // ret doubles as the queue of elements whose children haven't been added yet
+        for (size_t i = 0; i < ret.size(); i++)
+            for (auto& child : ret[i]->children) { ret.push_back(child.get()); }
+
+        return ret;
+    };
+
+    /** @class SpatialIndex
+     *  @brief An R-tree over the bounding boxes of an element's descendants, used
+     *         for region queries and hit-testing
+     *
+     *  The tree is bulk-loaded with Sort-Tile-Recursive (STR) packing in O(n log n).
+     *  Elements do not notify the index when they change, so call update() after
+     *  moving or resizing an indexed element. Insertions go into a small overflow
+     *  list and removals leave tombstones; both are folded back into a freshly
+     *  packed tree once they make up a sizable fraction of the index.
+     *
+     *  Elements without a bounding box (e.g. groups) are not indexed.
+     */
+    class SpatialIndex {
+    public:
+        using BoundingBox = Element::BoundingBox;
+
+        SpatialIndex(Element& root, const size_t _node_capacity = 16);
+        SpatialIndex(const std::vector<Element*>& elems, const size_t _node_capacity = 16);
+
+        std::vector<Element*> query(const BoundingBox& region) const;
+        std::vector<Element*> query(const Point& pt) const;
+        Element* nearest(const Point& pt) const;
+
+        void insert(Element* elem);
+        bool remove(Element* elem);
+        void update(Element* elem);
+        void rebuild();
+        size_t size() const { return this->positions.size(); }
+
+    private:
+        struct Entry {
+            BoundingBox box;
+            Element* elem;
+        };
+
+        struct Node {
+            BoundingBox box;
+            size_t begin; /**< First child (node in the level below, or entry) */
+            size_t end;   /**< One past the last child */
+        };
+
+        size_t node_capacity;
+        size_t tombstones = 0;
+        std::vector<Entry> entries;            /**< Packed leaf entries, in STR order */
+        std::vector<std::vector<Node>> levels; /**< levels[0] spans entries, levels[i] spans levels[i - 1] */
+        std::vector<Entry> pending;            /**< Entries inserted since the last rebuild */
+        std::unordered_map<Element*, size_t> positions; /**< Index into entries, or entries.size() + index into pending */
+
+        template<typename T>
+        void str_sort(std::vector<T>& items) const;
+        template<typename T>
+        std::vector<Node> pack(const std::vector<T>& items) const;
+        void maybe_rebuild();
+
+        static double distance2(const BoundingBox& box, const Point& pt) {
+            /** Squared distance from a point to the closest point of a box */
+            double dx = std::max({ box.x1 - pt.first, 0.0, pt.first - box.x2 }),
+                dy = std::max({ box.y1 - pt.second, 0.0, pt.second - box.y2 });
+            return dx * dx + dy * dy;
+        }
+    };
+
+    inline SpatialIndex::SpatialIndex(Element& root, const size_t _node_capacity) :
+        SpatialIndex(root.get_children_helper(), _node_capacity) {};
+
+    inline SpatialIndex::SpatialIndex(const std::vector<Element*>& elems, const size_t _node_capacity) :
+        node_capacity(std::max(_node_capacity, (size_t)2)) {
+        for (auto& elem : elems) {
+            auto box = elem->get_bbox().normalized();
+            if (isnan(box.x1) || isnan(box.y1)) continue;
+            this->pending.push_back({ box, elem });
+        }
+
+        this->rebuild();
+    }
+
+    template<typename T>
+    inline void SpatialIndex::str_sort(std::vector<T>& items) const {
+        /** Order items so that consecutive runs of node_capacity items are
+         *  spatially compact: sort by x, cut into vertical slices, then sort
+         *  each slice by y
+         */
+        auto center_x = [](const T& item) { return item.box.x1 + item.box.x2; };
+        auto center_y = [](const T& item) { return item.box.y1 + item.box.y2; };
+
+        const size_t n_nodes = (items.size() + node_capacity - 1) / node_capacity,
+            n_slices = (size_t)std::ceil(std::sqrt((double)n_nodes)),
+            slice_size = n_slices * node_capacity;
+
+        std::sort(items.begin(), items.end(), [&](const T& a, const T& b) {
+            return center_x(a) < center_x(b); });
+
+        for (size_t i = 0; i < items.size(); i += slice_size) {
+            auto end = items.begin() + std::min(i + slice_size, items.size());
+            std::sort(items.begin() + i, end, [&](const T& a, const T& b) {
+                return center_y(a) < center_y(b); });
+        }
+    }
+
+    template<typename T>
+    inline std::vector<SpatialIndex::Node> SpatialIndex::pack(const std::vector<T>& items) const {
+        /** Group consecutive runs of (already sorted) items into parent nodes */
+        std::vector<Node> ret;
+        for (size_t i = 0; i < items.size(); i += node_capacity) {
+            Node node = { items[i].box, i, std::min(i + node_capacity, items.size()) };
+            for (size_t j = node.begin + 1; j < node.end; j++)
+                node.box = node.box + items[j].box;
+            ret.push_back(node);
+        }
+
+        return ret;
+    }
+
+    inline void SpatialIndex::rebuild() {
+        /** Repack every live element into a new tree */
+        std::vector<Entry> live;
+        live.reserve(this->entries.size() - this->tombstones + this->pending.size());
+        for (auto& entry : this->entries)
+            if (entry.elem) live.push_back(entry);
+        for (auto& entry : this->pending) live.push_back(entry);
+
+        this->entries = std::move(live);
+        this->pending.clear();
+        this->levels.clear();
+        this->tombstones = 0;
+
+        this->str_sort(this->entries);
+        this->positions.clear();
+        this->positions.reserve(this->entries.size());
+        for (size_t i = 0; i < this->entries.size(); i++)
+            this->positions[this->entries[i].elem] = i;
+
+        if (this->entries.empty()) return;
+        this->levels.push_back(this->pack(this->entries));
+        while (this->levels.back().size() > 1) {
+            // Reordering a level is fine because each node keeps its own child span
+            this->str_sort(this->levels.back());
+            auto parents = this->pack(this->levels.back());
+            this->levels.push_back(std::move(parents));
+        }
+    }
+
+    inline void SpatialIndex::maybe_rebuild() {
+        const size_t stale = this->pending.size() + this->tombstones;
+        if (stale > std::max((size_t)64, this->entries.size() / 4))
+            this->rebuild();
+    }
+
+    inline void SpatialIndex::insert(Element* elem) {
+        /** Add an element (or refresh its bounding box if it is already indexed) */
+        if (this->positions.count(elem)) {
+            this->update(elem);
+            return;
+        }
+
+        auto box = elem->get_bbox().normalized();
+        if (isnan(box.x1) || isnan(box.y1)) return;
+        this->positions[elem] = this->entries.size() + this->pending.size();
+        this->pending.push_back({ box, elem });
+        this->maybe_rebuild();
+    }
+
+    inline bool SpatialIndex::remove(Element* elem) {
+        /** Remove an element from the index. Returns false if it was not indexed. */
+        auto it = this->positions.find(elem);
+        if (it == this->positions.end()) return false;
+
+        const size_t pos = it->second;
+        this->positions.erase(it);
+
+        if (pos < this->entries.size()) {
+            this->entries[pos].elem = nullptr;
+            this->tombstones++;
+        }
+        else {
+            // Swap and pop, fixing up the position of the moved entry
+            const size_t i = pos - this->entries.size();
+            if (i + 1 != this->pending.size()) {
+                this->pending[i] = this->pending.back();
+                this->positions[this->pending[i].elem] = pos;
+            }
+            this->pending.pop_back();
+        }
+
+        this->maybe_rebuild();
+        return true;
+    }
+
+    inline void SpatialIndex::update(Element* elem) {
+        /** Re-read the bounding box of an element whose geometry has changed */
+        this->remove(elem);
+        this->insert(elem);
+    }
+
+    inline std::vector<Element*> SpatialIndex::query(const BoundingBox& region) const {
+        /** Return every indexed element whose bounding box intersects region */
+        std::vector<Element*> ret;
+        auto search = region.normalized();
+
+        if (!this->levels.empty()) {
+            // Stack of (level, node) pairs left to visit
+            std::vector<std::pair<size_t, size_t>> stack;
+            const size_t top = this->levels.size() - 1;
+            for (size_t i = 0; i < this->levels[top].size(); i++)
+                stack.push_back({ top, i });
+
+            while (!stack.empty()) {
+                auto current = stack.back();
+                stack.pop_back();
+                const Node& node = this->levels[current.first][current.second];
+                if (!node.box.intersects(search)) continue;
+
+                for (size_t i = node.begin; i < node.end; i++) {
+                    if (current.first > 0)
+                        stack.push_back({ current.first - 1, i });
+                    else if (this->entries[i].elem && this->entries[i].box.intersects(search))
+                        ret.push_back(this->entries[i].elem);
+                }
+            }
+        }
+
+        for (auto& entry : this->pending)
+            if (entry.box.intersects(search)) ret.push_back(entry.elem);
+
+        return ret;
+    }
+
+    inline std::vector<Element*> SpatialIndex::query(const Point& pt) const {
+        /** Return every indexed element whose bounding box contains a point */
+        return this->query(BoundingBox(pt.first, pt.first, pt.second, pt.second));
+    }
+
+    inline Element* SpatialIndex::nearest(const Point& pt) const {
+        /** Return the element whose bounding box is closest to a point
+         *  (or nullptr if the index is empty)
+         */
+        Element* best = nullptr;
+        double best_dist = INFINITY;
+
+        for (auto& entry : this->pending) {
+            double dist = distance2(entry.box, pt);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = entry.elem;
+            }
+        }
+
+        if (this->levels.empty()) return best;
+
+        // Best-first search: (distance, level, index), with level 0 denoting entries
+        using Candidate = std::tuple<double, size_t, size_t>;
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+        const size_t top = this->levels.size() - 1;
+        for (size_t i = 0; i < this->levels[top].size(); i++)
+            queue.push(Candidate(distance2(this->levels[top][i].box, pt), top + 1, i));
+
+        while (!queue.empty()) {
+            double dist;
+            size_t level, i;
+            std::tie(dist, level, i) = queue.top();
+            queue.pop();
+            if (dist >= best_dist) break; // Nothing left can be closer
+
+            if (level == 0) {
+                best_dist = dist;
+                best = this->entries[i].elem;
+                break;
+            }
+
+            const Node& node = this->levels[level - 1][i];
+            for (size_t j = node.begin; j < node.end; j++) {
+                if (level == 1) {
+                    if (this->entries[j].elem)
+                        queue.push(Candidate(distance2(this->entries[j].box, pt), 0, j));
+                }
+                else {
+                    queue.push(Candidate(distance2(this->levels[level - 2][j].box, pt), level - 1, j));
+                }
+            }
+        }
+
+        return best;
+    }
+
+    /** @class TilePyramid
+     *  @brief Exports a document as a pyramid of square SVG tiles, laid out like a slippy map
+     *
+     *  Zoom level z covers the document's bounding square with 2^z x 2^z tiles,
+     *  which are written to directory/z/x/y.svg. A tile only contains the elements
+     *  intersecting it, nested inside copies of their ancestors (so group attributes
+     *  still apply), plus the root stylesheet. At each level, elements smaller than
+     *  a pixel are thinned out to one per pixel, and polygons and paths are simplified
+     *  to a pixel's tolerance and clipped to the tile.
+     *
+     *  Elements without a bounding box of their own, such as text, curved paths
+     *  or <use>, can't be placed and are written to every tile. The same goes for
+     *  nested <svg> elements and elements with a transform, along with everything
+     *  inside of them, since their bounding boxes aren't in the document's coordinates.
+     */
+    class TilePyramid {
+    public:
+        TilePyramid(Element& _root, const unsigned int _tile_size = 256);
+
+        std::string tile(const unsigned int z, const unsigned int x, const unsigned int y) const;
+        size_t write(const std::string& directory, const unsigned int max_zoom,
+            unsigned int n_threads = std::thread::hardware_concurrency()) const;
+        Element::BoundingBox tile_bbox(const unsigned int z, const unsigned int x, const unsigned int y) const;
+
+    private:
+        Element& root;
+        unsigned int tile_size;
+        Element::BoundingBox bounds;                 /**< Square region covered by zoom level 0 */
+        std::unordered_map<Element*, size_t> order;  /**< Document order of each drawable element */
+        std::unique_ptr<SpatialIndex> index;
+        std::vector<Element*> unbounded;             /**< Drawable elements which can't be placed */
+
+        void collect(Element* elem, std::vector<Element*>& drawable);
+    };
+
+    inline TilePyramid::TilePyramid(Element& _root, const unsigned int _tile_size) :
+        root(_root), tile_size(_tile_size) {
+        /** Index every drawable element of a document in a single pass */
+        // Filling every bounding box cache now means tiles can be generated concurrently
+        auto bbox = this->root.subtree_bbox();
+
+        std::vector<Element*> drawable;
+        for (auto& child : this->root.children)
+            this->collect(child.get(), drawable);
+        this->index = std::make_unique<SpatialIndex>(drawable);
+
+        // Only what can be placed counts towards the area covered
+        if (!drawable.empty()) {
+            bbox = Element::BoundingBox();
+            for (auto& elem : drawable)
+                bbox = bbox + elem->subtree_bbox();
+        }
+        const double side = std::max(bbox.x2 - bbox.x1, bbox.y2 - bbox.y1);
+        this->bounds = { bbox.x1, bbox.x1 + side, bbox.y1, bbox.y1 + side };
+    }
+
+    inline void TilePyramid::collect(Element* elem, std::vector<Element*>& drawable) {
+        /** Record elements with their own bounding box in document order, treating
+         *  each as an indivisible unit
+         *
+         *  Containers without a bounding box are descended into, while other elements
+         *  without one (e.g. text) and subtrees with their own coordinate systems are
+         *  kept aside for every tile.
+         */
+        // The root stylesheet is written separately
+        if (elem->empty_output() || (elem->kind() == ElementKind::Style && elem->parent == &this->root))
+            return;
+
+        const bool bounded = !isnan(elem->get_bbox().x1) && !elem->own_coordinates();
+        if (bounded || elem->children.empty() || !elem->own_content().empty() || elem->own_coordinates()) {
+            const size_t position = this->order.size();
+            this->order[elem] = position;
+            if (bounded) drawable.push_back(elem);
+            else this->unbounded.push_back(elem);
+            return;
+        }
+
+        for (auto& child : elem->children)
+            this->collect(child.get(), drawable);
+    }
+
+    inline Element::BoundingBox TilePyramid::tile_bbox(const unsigned int z, const unsigned int x,
+        const unsigned int y) const {
+        /** Return the region of the document covered by a tile */
+        const double side = (this->bounds.x2 - this->bounds.x1) / (double)(1ull << z);
+        return {
+            this->bounds.x1 + x * side, this->bounds.x1 + (x + 1) * side,
+            this->bounds.y1 + y * side, this->bounds.y1 + (y + 1) * side
+        };
+    }
+
+    inline std::string TilePyramid::tile(const unsigned int z, const unsigned int x, const unsigned int y) const {
+        /** Return the SVG for one tile. Safe to call from several threads at once. */
+        auto region = this->tile_bbox(z, x, y);
+        const double pixel = (region.x2 - region.x1) / this->tile_size;
+
+        SerializeOptions options(region);
+        options.simplify = pixel;
+        SerializeOptions foreign; // Neither the tile nor its pixels apply in other coordinate systems
+
+        auto found = this->index->query(region);
+        found.insert(found.end(), this->unbounded.begin(), this->unbounded.end());
+        std::sort(found.begin(), found.end(), [this](Element* a, Element* b) {
+            return this->order.at(a) < this->order.at(b); });
+
+        std::stringstream out;
+        SVG tile_root;
+        tile_root.set_attr("width", std::to_string(this->tile_size))
+            .set_attr("height", std::to_string(this->tile_size))
+            .set_attr("viewBox", std::to_string(region.x1) + " " + std::to_string(region.y1) + " " +
+                std::to_string(region.x2 - region.x1) + " " + std::to_string(region.y2 - region.y1));
+        tile_root.svg_open_tag(out, 0, false);
+        out << "\n";
+
+        auto svg_root = dynamic_cast<SVG*>(&this->root);
+        Element* stylesheet = svg_root ? svg_root->css : nullptr;
+        if (stylesheet && !stylesheet->empty_output()) {
+            stylesheet->svg_to_stream(out, 1, options);
+            out << "\n";
+        }
+
+        std::vector<Element*> open, chain; // Ancestors written so far, and those of the current element
+        std::unordered_set<uint64_t> filled; // Pixels already holding a sub-pixel element
+
+        for (auto& elem : found) {
+            auto bbox = elem->get_bbox().normalized();
+            const bool own_coordinates = elem->own_coordinates();
+            if (!own_coordinates && bbox.x2 - bbox.x1 < pixel && bbox.y2 - bbox.y1 < pixel) {
+                uint64_t px = (uint64_t)std::max(0.0, ((bbox.x1 + bbox.x2) / 2 - region.x1) / pixel),
+                    py = (uint64_t)std::max(0.0, ((bbox.y1 + bbox.y2) / 2 - region.y1) / pixel);
+                if (!filled.insert((px << 32) | py).second) continue;
+            }
+
+            chain.clear();
+            for (Element* current = elem->parent; current && current != &this->root; current = current->parent)
+                chain.push_back(current);
+            std::reverse(chain.begin(), chain.end());
+
+            // Close ancestors not shared with this element, then open new ones
+            size_t common = 0;
+            while (common < open.size() && common < chain.size() && open[common] == chain[common])
+                common++;
+            while (open.size() > common) {
+                open.back()->svg_close_tag(out, open.size());
+                out << "\n";
+                open.pop_back();
+            }
+            for (size_t i = common; i < chain.size(); i++) {
+                chain[i]->svg_open_tag(out, i + 1, false);
+                out << "\n";
+                open.push_back(chain[i]);
+            }
+
+            elem->svg_to_stream(out, chain.size() + 1, own_coordinates ? foreign : options);
+            out << "\n";
+        }
+
+        while (!open.empty()) {
+            open.back()->svg_close_tag(out, open.size());
+            out << "\n";
+            open.pop_back();
+        }
+
+        tile_root.svg_close_tag(out, 0);
+        return out.str();
+    }
+
+    inline size_t TilePyramid::write(const std::string& directory, const unsigned int max_zoom,
+        unsigned int n_threads) const {
+        /** Write zoom levels 0 through max_zoom to directory/z/x/y.svg, generating
+         *  tiles in parallel. Returns the number of tiles written, and throws
+         *  std::runtime_error if a directory can't be created.
+         */
+        using Tile = std::tuple<unsigned int, unsigned int, unsigned int>;
+        std::vector<Tile> tiles;
+
+        auto make_directory = [](const std::string& path) {
+            if (!util::make_directory(path)) throw std::runtime_error("Could not create " + path);
+        };
+
+        make_directory(directory);
+        for (unsigned int z = 0; z <= max_zoom; z++) {
+            const std::string z_dir = directory + "/" + std::to_string(z);
+            make_directory(z_dir);
+            for (unsigned int x = 0; x < (1u << z); x++) {
+                make_directory(z_dir + "/" + std::to_string(x));
+                for (unsigned int y = 0; y < (1u << z); y++)
+                    tiles.push_back(Tile(z, x, y));
+            }
+        }
+
+        std::atomic<size_t> next(0), written(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < tiles.size(); i = next++) {
+                unsigned int z, x, y;
+                std::tie(z, x, y) = tiles[i];
+                std::ofstream outfile(directory + "/" + std::to_string(z) + "/" +
+                    std::to_string(x) + "/" + std::to_string(y) + ".svg");
+                outfile << this->tile(z, x, y);
+                if (outfile) written++;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < std::max(n_threads, 1u); i++)
+            threads.push_back(std::thread(worker));
+        worker();
+        for (auto& thread : threads) thread.join();
+
+        return written;
+    }
+
+    /** @struct Color
+     *  @brief An 8-bit RGBA color
+     */
+    struct Color {
+        uint8_t r;
+        uint8_t g;
+        uint8_t b;
+        uint8_t a;
+
+        bool operator==(const Color& other) const {
+            return r == other.r && g == other.g && b == other.b && a == other.a;
+        }
+    };
+
+    const static Color WHITE = { 255, 255, 255, 255 };
+    const static Color BLACK = { 0, 0, 0, 255 };
+
+    namespace util {
+        inline bool parse_color(const std::string& value, Color& color) {
+            /** Parse a CSS color (#rgb, #rrggbb, rgb(r, g, b), "none" or a basic color keyword)
+             *
+             *  Returns false if the color could not be understood.
+             */
+            static const std::map<std::string, Color> keywords = {
+                { "none", { 0, 0, 0, 0 } }, { "transparent", { 0, 0, 0, 0 } },
+                { "black", BLACK }, { "white", WHITE },
+                { "red", { 255, 0, 0, 255 } }, { "green", { 0, 128, 0, 255 } },
+                { "lime", { 0, 255, 0, 255 } }, { "blue", { 0, 0, 255, 255 } },
+                { "yellow", { 255, 255, 0, 255 } }, { "cyan", { 0, 255, 255, 255 } },
+                { "aqua", { 0, 255, 255, 255 } }, { "magenta", { 255, 0, 255, 255 } },
+                { "fuchsia", { 255, 0, 255, 255 } }, { "gray", { 128, 128, 128, 255 } },
+                { "grey", { 128, 128, 128, 255 } }, { "silver", { 192, 192, 192, 255 } },
+                { "maroon", { 128, 0, 0, 255 } }, { "navy", { 0, 0, 128, 255 } },
+                { "olive", { 128, 128, 0, 255 } }, { "purple", { 128, 0, 128, 255 } },
+                { "teal", { 0, 128, 128, 255 } }, { "orange", { 255, 165, 0, 255 } }
+            };
+
+            std::string str;
+            for (auto& ch : value)
+                if (!isspace((unsigned char)ch)) str += (char)tolower((unsigned char)ch);
+
+            auto keyword = keywords.find(str);
+            if (keyword != keywords.end()) {
+                color = keyword->second;
+                return true;
+            }
+
+            if (str.size() && str[0] == '#') {
+                auto hex = str.substr(1);
+                if (hex.find_first_not_of("0123456789abcdef") != std::string::npos) return false;
+                if (hex.size() == 3) hex = { hex[0], hex[0], hex[1], hex[1], hex[2], hex[2] };
+                if (hex.size() != 6) return false;
+                color = {
+                    (uint8_t)std::stoi(hex.substr(0, 2), nullptr, 16),
+                    (uint8_t)std::stoi(hex.substr(2, 2), nullptr, 16),
+                    (uint8_t)std::stoi(hex.substr(4, 2), nullptr, 16),
+                    255
+                };
+                return true;
+            }
+
+            if (str.compare(0, 4, "rgb(") == 0) {
+                auto channels = parse_numbers(str.substr(4, str.find(')') - 4));
+                if (channels.size() != 3) return false;
+                auto clamp = [](double x) { return (uint8_t)std::max(0.0, std::min(255.0, x)); };
+                color = { clamp(channels[0]), clamp(channels[1]), clamp(channels[2]), 255 };
+                return true;
+            }
+
+            return false;
+        }
+
+        inline uint32_t crc32(const uint8_t* data, const size_t len, uint32_t crc = 0) {
+            /** CRC-32 (as used by PNG and zlib), which can be computed incrementally */
+            static const std::vector<uint32_t> table = []() {
+                std::vector<uint32_t> ret(256);
+                for (uint32_t i = 0; i < 256; i++) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    ret[i] = c;
+                }
+                return ret;
+            }();
+
+            crc = ~crc;
+            for (size_t i = 0; i < len; i++)
+                crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            return ~crc;
+        }
+
+        inline void accumulate_line(float* acc, const size_t stride, const size_t rows, Point p0, Point p1) {
+            /** Add the signed area covered by one polygon edge to an accumulation buffer
+             *
+             *  After a running sum along each row, the buffer holds the (signed) coverage
+             *  of every pixel. Points must lie within [0, stride - 2] x [0, rows].
+             *
+             *  Ref: https://medium.com/@raphlinus/inside-the-fastest-font-renderer-in-the-world-75ae5270c445
+             */
+            if (p0.second == p1.second) return;
+            double dir = 1;
+            if (p0.second > p1.second) {
+                std::swap(p0, p1);
+                dir = -1;
+            }
+
+            const double dxdy = (p1.first - p0.first) / (p1.second - p0.second);
+            double x = p0.first;
+            const size_t y_end = std::min(rows, (size_t)std::ceil(p1.second));
+
+            for (size_t y = (size_t)p0.second; y < y_end; y++) {
+                float* row = acc + y * stride;
+                const double dy = std::min((double)(y + 1), p1.second) - std::max((double)y, p0.second),
+                    x_next = x + dxdy * dy, d = dy * dir,
+                    xa = std::max(0.0, std::min(x, x_next)), xb = std::max(0.0, std::max(x, x_next)),
+                    xa_floor = std::floor(xa), xb_ceil = std::ceil(xb);
+                const size_t xai = (size_t)xa_floor, xbi = (size_t)xb_ceil;
+
+                if (xbi <= xai + 1) {
+                    // Edge stays within one pixel
+                    const double xmf = 0.5 * (x + x_next) - xa_floor;
+                    row[xai] += (float)(d - d * xmf);
+                    row[xai + 1] += (float)(d * xmf);
+                }
+                else {
+                    const double s = 1.0 / (xb - xa), xaf = xa - xa_floor,
+                        a0 = 0.5 * s * (1 - xaf) * (1 - xaf),
+                        xbf = xb - xb_ceil + 1.0,
+                        am = 0.5 * s * xbf * xbf;
+
+                    row[xai] += (float)(d * a0);
+                    if (xbi == xai + 2) {
+                        row[xai + 1] += (float)(d * (1 - a0 - am));
+                    }
+                    else {
+                        const double a1 = s * (1.5 - xaf);
+                        row[xai + 1] += (float)(d * (a1 - a0));
+                        for (size_t xi = xai + 2; xi < xbi - 1; xi++)
+                            row[xi] += (float)(d * s);
+                        const double a2 = a1 + (xbi - xai - 3) * s;
+                        row[xbi - 1] += (float)(d * (1 - a2 - am));
+                    }
+                    row[xbi] += (float)(d * am);
+                }
+
+                x = x_next;
+            }
+        }
+
+        inline void blend_span(uint32_t* dst, const float* coverage, const size_t n, const Color& color) {
+            /** Blend a color into a run of RGBA pixels, weighted by per-pixel coverage
+             *
+             *  Alpha is quantized to 7 bits so that the SSE2 and scalar paths,
+             *  which produce identical results, fit in 16-bit lanes.
+             */
+            const float scale = 128.0f * color.a / 255.0f;
+            uint32_t solid;
+            const uint8_t rgba[4] = { color.r, color.g, color.b, 255 };
+            memcpy(&solid, rgba, 4);
+
+            size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+            const __m128i zero = _mm_setzero_si128(),
+                src = _mm_set_epi16(255, color.b, color.g, color.r, 255, color.b, color.g, color.r);
+            const __m128 vscale = _mm_set1_ps(scale), half = _mm_set1_ps(0.5f);
+            for (; i + 4 <= n; i += 4) {
+                __m128i alpha = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coverage + i), vscale), half));
+                alpha = _mm_packs_epi32(alpha, alpha);     // a0 a1 a2 a3 a0 a1 a2 a3
+                alpha = _mm_unpacklo_epi16(alpha, alpha);  // a0 a0 a1 a1 a2 a2 a3 a3
+                const __m128i alpha_lo = _mm_unpacklo_epi32(alpha, alpha),
+                    alpha_hi = _mm_unpackhi_epi32(alpha, alpha);
+
+                __m128i px = _mm_loadu_si128((__m128i*)(dst + i)),
+                    lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+                lo = _mm_add_epi16(lo, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(src, lo), alpha_lo), 7));
+                hi = _mm_add_epi16(hi, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(src, hi), alpha_hi), 7));
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; i < n; i++) {
+                const int alpha = (int)(coverage[i] * scale + 0.5f);
+                if (alpha >= 128) {
+                    dst[i] = solid;
+                    continue;
+                }
+
+                uint8_t px[4];
+                memcpy(px, dst + i, 4);
+                for (int c = 0; c < 4; c++)
+                    px[c] = (uint8_t)(px[c] + (((int)rgba[c] - (int)px[c]) * alpha >> 7));
+                memcpy(dst + i, px, 4);
+            }
+        }
+    }
+
+    /** @class Canvas
+     *  @brief An RGBA image which polygons can be rasterized onto
+     */
+    class Canvas {
+    public:
+        Canvas(const unsigned int _width, const unsigned int _height, const Color& background = WHITE);
+
+        unsigned int width() const { return this->_width; }
+        unsigned int height() const { return this->_height; }
+        Color get_pixel(const unsigned int x, const unsigned int y) const;
+
+        void fill(const std::vector<std::vector<Point>>& polygons, const Color& color);
+        void fill(const std::vector<std::vector<Point>>& polygons, const Color& color,
+            const QuadCoord& clip, std::vector<float>& scratch);
+
+        void write_ppm(std::ostream& out) const;
+        void write_png(std::ostream& out) const;
+        bool save(const std::string& filename) const;
+
+    private:
+        unsigned int _width;
+        unsigned int _height;
+        std::vector<uint32_t> pixels; /**< Row-major pixels, stored as R, G, B, A bytes */
+    };
+
+    inline Canvas::Canvas(const unsigned int w, const unsigned int h, const Color& background) :
+        _width(w), _height(h) {
+        uint32_t packed;
+        memcpy(&packed, &background, 4);
+        this->pixels.assign((size_t)w * h, packed);
+    }
+
+    inline Color Canvas::get_pixel(const unsigned int x, const unsigned int y) const {
+        Color ret;
+        memcpy(&ret, &this->pixels[(size_t)y * this->_width + x], 4);
+        return ret;
+    }
+
+    inline void Canvas::fill(const std::vector<std::vector<Point>>& polygons, const Color& color) {
+        /** Fill polygons (in pixel coordinates) with anti-aliasing, using the nonzero rule */
+        std::vector<float> scratch;
+        this->fill(polygons, color, { 0, (double)this->_width, 0, (double)this->_height }, scratch);
+    }
+
+    inline void Canvas::fill(const std::vector<std::vector<Point>>& polygons, const Color& color,
+        const QuadCoord& clip, std::vector<float>& scratch) {
+        /** Fill polygons, only touching pixels inside of clip
+         *
+         *  @param[in] clip    Pixel-aligned region to draw within
+         *  @param[in] scratch Reusable accumulation buffer
+         */
+        if (color.a == 0) return;
+        const QuadCoord bounds = {
+            std::max(0.0, clip.x1), std::min((double)this->_width, clip.x2),
+            std::max(0.0, clip.y1), std::min((double)this->_height, clip.y2)
+        };
+        if (bounds.x1 >= bounds.x2 || bounds.y1 >= bounds.y2) return;
+
+        // Clip to the drawable region and find the pixels affected
+        std::vector<std::vector<Point>> clipped;
+        double min_x = INFINITY, max_x = -INFINITY, min_y = INFINITY, max_y = -INFINITY;
+        for (auto& polygon : polygons) {
+            if (polygon.size() < 3) continue;
+            auto points = util::clip_polygon(polygon, bounds);
+            if (points.size() < 3) continue;
+            for (auto& pt : points) {
+                min_x = std::min(min_x, pt.first);
+                max_x = std::max(max_x, pt.first);
+                min_y = std::min(min_y, pt.second);
+                max_y = std::max(max_y, pt.second);
+            }
+            clipped.push_back(std::move(points));
+        }
+        if (clipped.empty()) return;
+
+        // Clipping can leave points a rounding error outside of bounds
+        const size_t x0 = (size_t)std::floor(std::max(min_x, bounds.x1)),
+            y0 = (size_t)std::floor(std::max(min_y, bounds.y1)),
+            x_end = (size_t)std::ceil(std::min(max_x, bounds.x2)),
+            y_end = (size_t)std::ceil(std::min(max_y, bounds.y2));
+        if (x_end <= x0 || y_end <= y0) return;
+        const size_t span = x_end - x0, rows = y_end - y0, stride = span + 2;
+        scratch.assign(stride * rows, 0);
+
+        for (auto& points : clipped) {
+            Point prev = points.back();
+            for (auto& pt : points) {
+                util::accumulate_line(scratch.data(), stride, rows,
+                    Point(std::min((double)span, std::max(0.0, prev.first - x0)),
+                        std::min((double)rows, std::max(0.0, prev.second - y0))),
+                    Point(std::min((double)span, std::max(0.0, pt.first - x0)),
+                        std::min((double)rows, std::max(0.0, pt.second - y0))));
+                prev = pt;
+            }
+        }
+
+        // Turn accumulated areas into coverage, one row at a time
+        for (size_t y = 0; y < rows; y++) {
+            float* row = scratch.data() + y * stride;
+            float sum = 0;
+            for (size_t x = 0; x < span; x++) {
+                sum += row[x];
+                row[x] = std::min(1.0f, std::abs(sum));
+            }
+
+            util::blend_span(this->pixels.data() + (y0 + y) * this->_width + x0, row, span, color);
+        }
+    }
+
+    inline void Canvas::write_ppm(std::ostream& out) const {
+        /** Write this image as a binary PPM (alpha is discarded) */
+        out << "P6\n" << this->_width << " " << this->_height << "\n255\n";
+        std::vector<char> row(this->_width * 3);
+        for (size_t y = 0; y < this->_height; y++) {
+            for (size_t x = 0; x < this->_width; x++) {
+                const uint8_t* px = (const uint8_t*)&this->pixels[y * this->_width + x];
+                row[x * 3] = px[0];
+                row[x * 3 + 1] = px[1];
+                row[x * 3 + 2] = px[2];
+            }
+            out.write(row.data(), row.size());
+        }
+    }
+
+    inline void Canvas::write_png(std::ostream& out) const {
+        /** Write this image as an RGBA PNG
+         *
+         *  To avoid depending on zlib, image data is stored in uncompressed
+         *  deflate blocks, which are streamed out without buffering the image.
+         */
+        auto write_u32 = [](std::ostream& out, uint32_t value, uint32_t* crc) {
+            const uint8_t bytes[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16),
+                (uint8_t)(value >> 8), (uint8_t)value };
+            out.write((const char*)bytes, 4);
+            if (crc) *crc = util::crc32(bytes, 4, *crc);
+        };
+
+        auto write_chunk = [&](const char* type, const std::vector<uint8_t>& data) {
+            write_u32(out, (uint32_t)data.size(), nullptr);
+            uint32_t crc = util::crc32((const uint8_t*)type, 4);
+            crc = util::crc32(data.data(), data.size(), crc);
+            out.write(type, 4);
+            out.write((const char*)data.data(), data.size());
+            write_u32(out, crc, nullptr);
+        };
+
+        out.write("\x89PNG\r\n\x1a\n", 8);
+
+        std::vector<uint8_t> header(13, 0);
+        for (int i = 0; i < 4; i++) {
+            header[i] = (uint8_t)(this->_width >> (24 - 8 * i));
+            header[4 + i] = (uint8_t)(this->_height >> (24 - 8 * i));
+        }
+        header[8] = 8; // Bit depth
+        header[9] = 6; // RGBA
+        write_chunk("IHDR", header);
+
+        // Each row is a filter type byte (none) followed by the pixels
+        const uint64_t row_size = 1 + 4 * (uint64_t)this->_width,
+            raw_size = row_size * this->_height,
+            n_blocks = std::max((uint64_t)1, (raw_size + 65534) / 65535),
+            zlib_size = 2 + raw_size + 5 * n_blocks + 4;
+        if (zlib_size > 0x7FFFFFFF)
+            throw std::runtime_error("Image is too large for an uncompressed PNG");
+
+        write_u32(out, (uint32_t)zlib_size, nullptr);
+        uint32_t crc = util::crc32((const uint8_t*)"IDAT", 4);
+        out.write("IDAT", 4);
+
+        uint32_t adler_a = 1, adler_b = 0;
+        std::vector<uint8_t> block;
+        block.reserve(65535);
+        uint64_t remaining = raw_size;
+
+        auto flush_block = [&]() {
+            remaining -= block.size();
+            const uint16_t len = (uint16_t)block.size();
+            const uint8_t block_header[5] = { (uint8_t)(remaining == 0), (uint8_t)len, (uint8_t)(len >> 8),
+                (uint8_t)~len, (uint8_t)(~len >> 8) };
+            out.write((const char*)block_header, 5);
+            crc = util::crc32(block_header, 5, crc);
+            out.write((const char*)block.data(), block.size());
+            crc = util::crc32(block.data(), block.size(), crc);
+            for (auto& byte : block) {
+                adler_a = (adler_a + byte) % 65521;
+                adler_b = (adler_b + adler_a) % 65521;
+            }
+            block.clear();
+        };
+
+        const uint8_t zlib_header[2] = { 0x78, 0x01 };
+        out.write((const char*)zlib_header, 2);
+        crc = util::crc32(zlib_header, 2, crc);
+
+        for (size_t y = 0; y < this->_height; y++) {
+            const uint8_t* row = (const uint8_t*)&this->pixels[y * this->_width];
+            for (uint64_t i = 0; i < row_size; i++) {
+                block.push_back(i == 0 ? 0 : row[i - 1]);
+                if (block.size() == 65535) flush_block();
+            }
+        }
+        if (!block.empty() || raw_size == 0) flush_block();
+
+        write_u32(out, (adler_b << 16) | adler_a, &crc);
+        write_u32(out, crc, nullptr);
+        write_chunk("IEND", {});
+    }
+
+    inline bool Canvas::save(const std::string& filename) const {
+        /** Save as a PNG, or as a PPM if the file name ends in .ppm */
+        SVG_TRACE_SCOPE("Canvas::save");
+        std::ofstream outfile(filename, std::ios::binary);
+        if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".ppm") == 0)
+            this->write_ppm(outfile);
+        else
+            this->write_png(outfile);
+        return (bool)outfile;
+    }
+
+    /** @class Rasterizer
+     *  @brief Renders an element tree to a Canvas
+     *
+     *  Supports rectangles, circles, lines, polygons and straight-line paths,
+     *  filled and stroked according to presentation attributes, style attributes
+     *  and stylesheet rules with simple selectors (tag, .class, #id, or a
+     *  combination like rect.highlight), and placed by transform attributes.
+     *
+     *  Text, curved path segments, <use>, images, gradients, clipping, masks
+     *  and markers are not supported. Non-rendering containers such as <defs>
+     *  or <marker> are skipped along with their contents.
+     *
+     *  The document's viewBox (or width and height, or else its bounding box)
+     *  is scaled to fit the canvas.
+     */
+    class Rasterizer {
+    public:
+        Rasterizer(Element& root, const unsigned int _width, const unsigned int _height);
+        Canvas render(const Color& background = WHITE,
+            unsigned int n_threads = std::thread::hardware_concurrency(),
+            const unsigned int tile_size = 64) const;
+
+    private:
+        /** A shape to be filled with a single color, in pixel coordinates */
+        struct DrawCommand {
+            std::vector<std::vector<Point>> polygons;
+            Color color;
+            Element::BoundingBox bbox;
+        };
+
+        /** An affine transform, as in matrix(a b c d e f) */
+        struct Transform {
+            double a, b, c, d, e, f;
+            Point operator()(const Point& pt) const {
+                return Point(a * pt.first + c * pt.second + e, b * pt.first + d * pt.second + f);
+            }
+            Transform operator*(const Transform& inner) const {
+                return { a * inner.a + c * inner.b, b * inner.a + d * inner.b,
+                    a * inner.c + c * inner.d, b * inner.c + d * inner.d,
+                    a * inner.e + c * inner.f + e, b * inner.e + d * inner.f + f };
+            }
+
+            /** How much lengths are stretched, on average */
+            double scale() const { return std::sqrt(std::abs(a * d - b * c)); }
+        };
+
+        struct Paint {
+            Color fill = BLACK;
+            Color stroke = { 0, 0, 0, 0 };
+            double stroke_width = 1;
+            double fill_opacity = 1;
+            double stroke_opacity = 1;
+            double opacity = 1; /**< Product of the opacities of this element and its ancestors */
+        };
+
+        struct Rule {
+            std::string tag;
+            std::vector<std::string> classes;
+            std::string id;
+            int specificity;
+            const AttributeMap* properties;
+        };
+
+        unsigned int width;
+        unsigned int height;
+        std::vector<Rule> rules;
+        std::vector<DrawCommand> commands;
+
+        void collect_rules(Element* elem);
+        bool matches(const Rule& rule, Element* elem) const;
+        Paint cascade(Element* elem, const Paint& inherited) const;
+        void flatten(Element* elem, const Transform& transform, const Paint& inherited);
+        void add_command(std::vector<std::vector<Point>>&& polygons, const Color& color, const double opacity);
+        static void apply(Paint& paint, double& opacity, const std::string& property, const std::string& value);
+        static Transform parse_transform(const std::string& str);
+        static bool is_rendered(Element* elem);
+        static std::vector<std::vector<Point>> stroke(const std::vector<Point>& points, const bool closed,
+            const double width);
+    };
+
+    inline Rasterizer::Rasterizer(Element& root, const unsigned int _width, const unsigned int _height) :
+        width(_width), height(_height) {
+        /** Convert a document into a list of filled polygons */
+        SVG_TRACE_SCOPE("Rasterizer::Rasterizer");
+        this->collect_rules(&root);
+        std::stable_sort(this->rules.begin(), this->rules.end(), [](const Rule& a, const Rule& b) {
+            return a.specificity < b.specificity; });
+
+        Element::BoundingBox view = { NAN, NAN, NAN, NAN };
+        auto viewbox = util::parse_numbers(root.find_attr("viewBox"));
+        if (viewbox.size() == 4 && viewbox[2] > 0 && viewbox[3] > 0)
+            view = { viewbox[0], viewbox[0] + viewbox[2], viewbox[1], viewbox[1] + viewbox[3] };
+        else if (root.find_numeric("width") > 0 && root.find_numeric("height") > 0)
+            view = { 0, root.find_numeric("width"), 0, root.find_numeric("height") };
+        else
+            view = root.subtree_bbox();
+
+        if (isnan(view.x1) || view.x2 <= view.x1 || view.y2 <= view.y1)
+            view = { 0, (double)this->width, 0, (double)this->height };
+
+        // Scale uniformly and center, like preserveAspectRatio="xMidYMid meet"
+        const double scale = std::min(this->width / (view.x2 - view.x1), this->height / (view.y2 - view.y1));
+        const Transform transform = {
+            scale, 0, 0, scale,
+            (this->width - (view.x2 - view.x1) * scale) / 2 - view.x1 * scale,
+            (this->height - (view.y2 - view.y1) * scale) / 2 - view.y1 * scale
+        };
+
+        // The root's own presentation attributes and rules are inherited by everything
+        const Paint paint = this->cascade(&root, Paint());
+        for (auto& child : root.children)
+            this->flatten(child.get(), transform, paint);
+    }
+
+    inline void Rasterizer::collect_rules(Element* elem) {
+        /** Gather the rules of every stylesheet with selectors we can handle */
+        auto stylesheet = dynamic_cast<SVG::Style*>(elem);
+        if (stylesheet) {
+            for (auto& selector : stylesheet->css) {
+                std::stringstream selectors(selector.first);
+                std::string part;
+                while (std::getline(selectors, part, ',')) {
+                    part.erase(0, part.find_first_not_of(" \t\n"));
+                    part.erase(part.find_last_not_of(" \t\n") + 1);
+                    if (part.empty() || part.find_first_of(" \t\n>+~:[") != std::string::npos)
+                        continue; // Combinators, pseudo-classes and attribute selectors aren't supported
+
+                    Rule rule = { "", {}, "", 0, &selector.second };
+                    size_t pos = part.find_first_of(".#");
+                    rule.tag = part.substr(0, pos);
+                    if (rule.tag == "*") rule.tag.clear();
+                    while (pos != std::string::npos) {
+                        size_t next = part.find_first_of(".#", pos + 1);
+                        auto name = part.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1);
+                        if (part[pos] == '.') rule.classes.push_back(name);
+                        else rule.id = name;
+                        pos = next;
+                    }
+
+                    rule.specificity = (rule.id.empty() ? 0 : 100) + 10 * (int)rule.classes.size() +
+                        (rule.tag.empty() ? 0 : 1);
+                    this->rules.push_back(rule);
+                }
+            }
+        }
+
+        for (auto& child : elem->children)
+            this->collect_rules(child.get());
+    }
+
+    inline bool Rasterizer::matches(const Rule& rule, Element* elem) const {
+        if (!rule.tag.empty() && rule.tag != elem->tag()) return false;
+        if (!rule.id.empty() && rule.id != elem->find_attr("id")) return false;
+
+        if (!rule.classes.empty()) {
+            std::stringstream class_list(elem->find_attr("class"));
+            std::vector<std::string> classes;
+            std::string cls;
+            while (class_list >> cls) classes.push_back(cls);
+
+            for (auto& required : rule.classes)
+                if (std::find(classes.begin(), classes.end(), required) == classes.end())
+                    return false;
+        }
+
+        return true;
+    }
+
+    inline void Rasterizer::apply(Paint& paint, double& opacity, const std::string& property,
+        const std::string& value) {
+        /** Apply one presentation attribute or CSS declaration */
+        if (property == "fill") util::parse_color(value, paint.fill);
+        else if (property == "stroke") util::parse_color(value, paint.stroke);
+        else if (property == "stroke-width") paint.stroke_width = atof(value.c_str());
+        else if (property == "fill-opacity") paint.fill_opacity = atof(value.c_str());
+        else if (property == "stroke-opacity") paint.stroke_opacity = atof(value.c_str());
+        else if (property == "opacity") opacity = atof(value.c_str());
+    }
+
+    inline Rasterizer::Transform Rasterizer::parse_transform(const std::string& str) {
+        /** Parse a transform attribute, e.g. "translate(10 20) rotate(45)",
+         *  ignoring any function we don't recognize
+         */
+        Transform ret = { 1, 0, 0, 1, 0, 0 };
+        size_t pos = 0, open;
+        while ((open = str.find('(', pos)) != std::string::npos) {
+            size_t close = str.find(')', open);
+            if (close == std::string::npos) break;
+
+            std::string name = str.substr(pos, open - pos);
+            name.erase(0, name.find_first_not_of(" \t\n,"));
+            name.erase(name.find_last_not_of(" \t\n") + 1);
+            auto args = util::parse_numbers(str.substr(open + 1, close - open - 1));
+            pos = close + 1;
+
+            Transform next = { 1, 0, 0, 1, 0, 0 };
+            if (name == "matrix" && args.size() == 6)
+                next = { args[0], args[1], args[2], args[3], args[4], args[5] };
+            else if (name == "translate" && !args.empty())
+                next = { 1, 0, 0, 1, args[0], args.size() > 1 ? args[1] : 0 };
+            else if (name == "scale" && !args.empty())
+                next = { args[0], 0, 0, args.size() > 1 ? args[1] : args[0], 0, 0 };
+            else if (name == "rotate" && !args.empty()) {
+                const double angle = args[0] * PI / 180, cx = args.size() == 3 ? args[1] : 0,
+                    cy = args.size() == 3 ? args[2] : 0;
+                next = Transform{ 1, 0, 0, 1, cx, cy } *
+                    Transform{ cos(angle), sin(angle), -sin(angle), cos(angle), 0, 0 } *
+                    Transform{ 1, 0, 0, 1, -cx, -cy };
+            }
+            else if (name == "skewX" && !args.empty())
+                next = { 1, 0, tan(args[0] * PI / 180), 1, 0, 0 };
+            else if (name == "skewY" && !args.empty())
+                next = { 1, tan(args[0] * PI / 180), 0, 1, 0, 0 };
+
+            ret = ret * next;
+        }
+
+        return ret;
+    }
+
+    inline bool Rasterizer::is_rendered(Element* elem) {
+        /** Whether an element (and its subtree) is drawn directly */
+        static const std::set<std::string> hidden = {
+            "clipPath", "defs", "desc", "filter", "linearGradient", "marker", "mask",
+            "metadata", "pattern", "radialGradient", "script", "symbol", "title"
+        };
+
+        const auto kind = elem->kind();
+        if (kind == ElementKind::Style || kind == ElementKind::Text ||
+            (kind == ElementKind::Generic && hidden.count(elem->tag())))
+            return false;
+        return elem->find_attr("display") != "none";
+    }
+
+    inline Rasterizer::Paint Rasterizer::cascade(Element* elem, const Paint& inherited) const {
+        /** Inherited values, then presentation attributes, stylesheet rules, and style="" */
+        Paint paint = inherited;
+        double opacity = 1;
+        for (auto& pair : elem->attr)
+            apply(paint, opacity, pair.first, pair.second);
+        for (auto& rule : this->rules)
+            if (this->matches(rule, elem))
+                for (auto& pair : rule.properties->attr)
+                    apply(paint, opacity, pair.first, pair.second);
+
+        std::stringstream declarations(elem->find_attr("style"));
+        std::string declaration;
+        while (std::getline(declarations, declaration, ';')) {
+            auto colon = declaration.find(':');
+            if (colon == std::string::npos) continue;
+            std::string property = declaration.substr(0, colon), value = declaration.substr(colon + 1);
+            property.erase(0, property.find_first_not_of(" \t\n"));
+            property.erase(property.find_last_not_of(" \t\n") + 1);
+            apply(paint, opacity, property, value);
+        }
+        paint.opacity *= opacity;
+        return paint;
+    }
+
+    inline void Rasterizer::flatten(Element* elem, const Transform& parent_transform, const Paint& inherited) {
+        /** Recursively convert an element and its children into draw commands */
+        if (!is_rendered(elem)) return;
+
+        const Paint paint = this->cascade(elem, inherited);
+        Transform transform = parent_transform * parse_transform(elem->find_attr("transform"));
+        auto nested = dynamic_cast<SVG*>(elem);
+        if (nested) {
+            // Nested <svg> elements are positioned by x and y and may scale their viewBox
+            double x = elem->find_numeric("x"), y = elem->find_numeric("y");
+            transform = transform * Transform{ 1, 0, 0, 1, isnan(x) ? 0 : x, isnan(y) ? 0 : y };
+
+            auto viewbox = util::parse_numbers(elem->find_attr("viewBox"));
+            double w = elem->find_numeric("width"), h = elem->find_numeric("height");
+            if (viewbox.size() == 4 && viewbox[2] > 0 && viewbox[3] > 0 && w > 0 && h > 0) {
+                double scale = std::min(w / viewbox[2], h / viewbox[3]);
+                transform = transform * Transform{ scale, 0, 0, scale, -viewbox[0] * scale, -viewbox[1] * scale };
+            }
+        }
+
+        // Convert the geometry into closed polygons (for filling) and polylines (for stroking)
+        std::vector<std::vector<Point>> shapes;
+        std::vector<bool> closed;
+        bool fillable = true;
+
+        if (auto rect = dynamic_cast<Rect*>(elem)) {
+            double x = rect->x(), y = rect->y(), w = rect->width(), h = rect->height();
+            if (isnan(x)) x = 0;
+            if (isnan(y)) y = 0;
+            if (w > 0 && h > 0) {
+                shapes.push_back({ { x, y }, { x + w, y }, { x + w, y + h }, { x, y + h } });
+                closed.push_back(true);
+            }
+        }
+        else if (auto circle = dynamic_cast<Circle*>(elem)) {
+            double cx = circle->x(), cy = circle->y(), r = circle->radius();
+            if (r > 0) {
+                // Enough segments to stay within a quarter pixel of the true circle
+                double r_px = r * std::max(std::hypot(transform.a, transform.b), std::hypot(transform.c, transform.d));
+                int n = r_px > 0.25 ? (int)std::ceil(PI / std::acos(1 - 0.25 / r_px)) : 8;
+                n = std::max(8, std::min(4096, n));
+
+                shapes.push_back({});
+                for (int i = 0; i < n; i++)
+                    shapes.back().push_back(Point((isnan(cx) ? 0 : cx) + r * cos(2 * PI * i / n),
+                        (isnan(cy) ? 0 : cy) + r * sin(2 * PI * i / n)));
+                closed.push_back(true);
+            }
+        }
+        else if (auto line = dynamic_cast<Line*>(elem)) {
+            shapes.push_back({ { line->x1(), line->y1() }, { line->x2(), line->y2() } });
+            closed.push_back(false);
+            fillable = false;
+        }
+        else if (auto polygon = dynamic_cast<Polygon*>(elem)) {
+            shapes.push_back(polygon->points());
+            closed.push_back(true);
+        }
+        else if (auto path = dynamic_cast<Path*>(elem)) {
+            util::parse_path(path->find_attr("d"), shapes, closed);
+        }
+
+        for (auto& shape : shapes)
+            for (auto& pt : shape) pt = transform(pt);
+
+        if (fillable && !shapes.empty()) {
+            auto polygons = shapes;
+            this->add_command(std::move(polygons), paint.fill, paint.fill_opacity * paint.opacity);
+        }
+
+        const double scale = transform.scale();
+        if (paint.stroke.a && paint.stroke_width > 0) {
+            std::vector<std::vector<Point>> outline;
+            for (size_t i = 0; i < shapes.size(); i++) {
+                auto pieces = stroke(shapes[i], closed[i], paint.stroke_width * scale);
+                std::move(pieces.begin(), pieces.end(), std::back_inserter(outline));
+            }
+            this->add_command(std::move(outline), paint.stroke, paint.stroke_opacity * paint.opacity);
+        }
+
+        for (auto& child : elem->children)
+            this->flatten(child.get(), transform, paint);
+    }
+
+    inline void Rasterizer::add_command(std::vector<std::vector<Point>>&& polygons, const Color& color,
+        const double opacity) {
+        Color blended = color;
+        blended.a = (uint8_t)std::max(0.0, std::min(255.0, color.a * opacity + 0.5));
+        if (blended.a == 0 || polygons.empty()) return;
+
+        Element::BoundingBox bbox = { NAN, NAN, NAN, NAN };
+        for (auto& polygon : polygons)
+            for (auto& pt : polygon)
+                bbox = bbox + Element::BoundingBox(pt.first, pt.first, pt.second, pt.second);
+
+        this->commands.push_back({ std::move(polygons), blended, bbox });
+    }
+
+    inline std::vector<std::vector<Point>> Rasterizer::stroke(const std::vector<Point>& points,
+        const bool closed, const double width) {
+        /** Approximate the stroke of a polyline with a quad per segment and
+         *  round joins, all wound the same way so the nonzero rule unions them
+         */
+        std::vector<std::vector<Point>> ret;
+        const double half = width / 2;
+        auto orient = [](std::vector<Point>& polygon) {
+            double area = 0;
+            for (size_t i = 0; i < polygon.size(); i++) {
+                auto& a = polygon[i];
+                auto& b = polygon[(i + 1) % polygon.size()];
+                area += a.first * b.second - b.first * a.second;
+            }
+            if (area < 0) std::reverse(polygon.begin(), polygon.end());
+        };
+
+        const size_t n_segments = closed ? points.size() : points.size() - 1;
+        for (size_t i = 0; points.size() >= 2 && i < n_segments; i++) {
+            auto& a = points[i];
+            auto& b = points[(i + 1) % points.size()];
+            double dx = b.first - a.first, dy = b.second - a.second, len = std::sqrt(dx * dx + dy * dy);
+            if (len == 0) continue;
+
+            double nx = -dy / len * half, ny = dx / len * half;
+            std::vector<Point> quad = {
+                { a.first + nx, a.second + ny }, { b.first + nx, b.second + ny },
+                { b.first - nx, b.second - ny }, { a.first - nx, a.second - ny }
+            };
+            orient(quad);
+            ret.push_back(std::move(quad));
+
+            // Round join at the end of this segment
+            if (half > 1 && (closed || i + 2 < points.size())) {
+                std::vector<Point> join;
+                for (int k = 0; k < 16; k++)
+                    join.push_back(Point(b.first + half * cos(PI * k / 8), b.second + half * sin(PI * k / 8)));
+                orient(join);
+                ret.push_back(std::move(join));
+            }
+        }
+
+        return ret;
+    }
+
+    inline Canvas Rasterizer::render(const Color& background, unsigned int n_threads,
+        const unsigned int tile_size) const {
+        /** Draw every command in document order
+         *
+         *  The canvas is split into square tiles, and each command is binned into
+         *  the tiles its bounding box overlaps. Tiles cover disjoint pixels, so
+         *  threads can take tiles off a shared counter and draw them without locking.
+         */
+        SVG_TRACE_SCOPE("Rasterizer::render");
+        Canvas canvas(this->width, this->height, background);
+        const unsigned int tile = std::max(tile_size, 1u),
+            tiles_x = (this->width + tile - 1) / tile, tiles_y = (this->height + tile - 1) / tile;
+
+        std::vector<std::vector<size_t>> bins((size_t)tiles_x * tiles_y);
+        for (size_t i = 0; i < this->commands.size(); i++) {
+            auto& bbox = this->commands[i].bbox;
+            if (isnan(bbox.x1) || bbox.x2 < 0 || bbox.y2 < 0 || bbox.x1 >= this->width || bbox.y1 >= this->height)
+                continue;
+
+            const unsigned int x1 = (unsigned int)std::max(0.0, bbox.x1) / tile,
+                x2 = (unsigned int)std::min(bbox.x2, this->width - 1.0) / tile,
+                y1 = (unsigned int)std::max(0.0, bbox.y1) / tile,
+                y2 = (unsigned int)std::min(bbox.y2, this->height - 1.0) / tile;
+            for (unsigned int y = y1; y <= y2; y++)
+                for (unsigned int x = x1; x <= x2; x++)
+                    bins[(size_t)y * tiles_x + x].push_back(i);
+        }
+
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            std::vector<float> scratch;
+            for (size_t i = next++; i < bins.size(); i = next++) {
+                const double x = (double)(i % tiles_x) * tile, y = (double)(i / tiles_x) * tile;
+                const QuadCoord clip = { x, x + tile, y, y + tile };
+                for (auto& command : bins[i])
+                    canvas.fill(this->commands[command].polygons, this->commands[command].color, clip, scratch);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        n_threads = std::min(std::max(n_threads, 1u), (unsigned int)bins.size());
+        for (unsigned int i = 1; i < n_threads; i++)
+            threads.push_back(std::thread(worker));
+        worker();
+        for (auto& thread : threads) thread.join();
+
+        return canvas;
+    }
+
+    inline Canvas rasterize(Element& root, const unsigned int width, const unsigned int height,
+        unsigned int n_threads = std::thread::hardware_concurrency()) {
+        /** Render a document to an image of the given size, using n_threads threads */
+        return Rasterizer(root, width, height).render(WHITE, n_threads);
+    }
+
+    namespace util {
+        inline void parse_css(const char* pos, const char* end, SelectorProperties& css,
+            std::map<std::string, SelectorProperties>* keyframes) {
+            /** Parse rules of the form "selector { property: value; ... }" into css,
+             *  and @keyframes blocks into keyframes (if not null)
+             */
+            auto trim = [](const char* first, const char* last) {
+                while (first < last && isspace((unsigned char)*first)) first++;
+                while (last > first && isspace((unsigned char)*(last - 1))) last--;
+                return std::string(first, last);
+            };
+
+            while (pos < end) {
+                const char* open = std::find(pos, end, '{');
+                if (open == end) break;
+                std::string selector = trim(pos, open);
+
+                // Find the matching brace
+                const char* close = open + 1;
+                for (int depth = 1; close < end; close++) {
+                    if (*close == '{') depth++;
+                    else if (*close == '}' && --depth == 0) break;
+                }
+
+                if (selector.compare(0, 10, "@keyframes") == 0) {
+                    if (keyframes)
+                        parse_css(open + 1, close, (*keyframes)[trim(selector.data() + 10,
+                            selector.data() + selector.size())], nullptr);
+                }
+                else {
+                    auto& properties = css[selector];
+                    for (const char* decl = open + 1; decl < close; ) {
+                        const char* decl_end = std::find(decl, close, ';');
+                        const char* colon = std::find(decl, decl_end, ':');
+                        if (colon != decl_end)
+                            properties.attr[trim(decl, colon)] = trim(colon + 1, decl_end);
+                        decl = decl_end + 1;
+                    }
+                }
+
+                pos = close + 1;
+            }
+        }
+    }
+
+    /** @class Parser
+     *  @brief Builds an element tree from SVG text in a single forward pass
+     *
+     *  Recognized tags become instances of the matching class (SVG, Group, Rect,
+     *  etc.), and anything else becomes a GenericElement. Attribute values and
+     *  text content are kept verbatim, so documents can be loaded, modified and
+     *  written back out, except that double quotes in single-quoted values become
+     *  &quot;. Comments, processing instructions and DOCTYPEs are dropped.
+     */
+    class Parser {
+    public:
+        Parser(const char* data, const size_t size) : begin(data), pos(data), end(data + size) {};
+        std::unique_ptr<Element> parse();
+        static std::unique_ptr<Element> make_element(const std::string& tag_name, SVGAttrib&& attrs);
+
+    private:
+        const char* begin;
+        const char* pos;
+        const char* end;
+
+        void error(const std::string& message) const;
+        bool starts_with(const char* prefix) const;
+        const char* find(const char* needle) const;
+        void skip_whitespace();
+        void skip_past(const char* terminator);
+        std::string read_name();
+        bool read_attributes(SVGAttrib& attrs);
+        std::string read_content(const std::string& tag_name);
+    };
+
+    inline void Parser::error(const std::string& message) const {
+        throw std::runtime_error("SVG parse error at offset " + std::to_string(this->pos - this->begin) +
+            ": " + message);
+    }
+
+    inline bool Parser::starts_with(const char* prefix) const {
+        const size_t len = strlen(prefix);
+        return (size_t)(this->end - this->pos) >= len && memcmp(this->pos, prefix, len) == 0;
+    }
+
+    inline const char* Parser::find(const char* needle) const {
+        /** Return the next occurrence of needle, or end. memchr() is vectorized
+         *  by every major C library, so it does the heavy lifting.
+         */
+        const size_t len = strlen(needle);
+        for (const char* p = this->pos; ; p++) {
+            p = (const char*)memchr(p, needle[0], this->end - p);
+            if (!p || (size_t)(this->end - p) < len) return this->end;
+            if (memcmp(p, needle, len) == 0) return p;
+        }
+    }
+
+    inline void Parser::skip_whitespace() {
+        while (this->pos < this->end && isspace((unsigned char)*this->pos)) this->pos++;
+    }
+
+    inline void Parser::skip_past(const char* terminator) {
+        const char* found = this->find(terminator);
+        if (found == this->end) this->error(std::string("expected ") + terminator);
+        this->pos = found + strlen(terminator);
+    }
+
+    inline std::string Parser::read_name() {
+        const char* start = this->pos;
+        while (this->pos < this->end && !isspace((unsigned char)*this->pos) &&
+            *this->pos != '>' && *this->pos != '/' && *this->pos != '=')
+            this->pos++;
+        if (start == this->pos) this->error("expected a name");
+        return std::string(start, this->pos);
+    }
+
+    inline bool Parser::read_attributes(SVGAttrib& attrs) {
+        /** Read attributes up to and including the end of a start tag,
+         *  returning true if the tag was self-closing
+         */
+        while (true) {
+            this->skip_whitespace();
+            if (this->pos >= this->end) this->error("unterminated tag");
+            if (*this->pos == '>') {
+                this->pos++;
+                return false;
+            }
+            if (this->starts_with("/>")) {
+                this->pos += 2;
+                return true;
+            }
+
+            std::string name = this->read_name();
+            this->skip_whitespace();
+            if (this->pos >= this->end || *this->pos != '=') this->error("expected = after " + name);
+            this->pos++;
+            this->skip_whitespace();
+            if (this->pos >= this->end || (*this->pos != '"' && *this->pos != '\''))
+                this->error("expected a quoted value for " + name);
+
+            const char quote = *this->pos++;
+            const char* close = (const char*)memchr(this->pos, quote, this->end - this->pos);
+            if (!close) this->error("unterminated value for " + name);
+
+            // Values are written back in double quotes
+            std::string value(this->pos, close);
+            if (quote == '\'')
+                for (size_t found = value.find('"'); found != std::string::npos; found = value.find('"', found))
+                    value.replace(found, 1, "&quot;");
+
+            // Documents we write have sorted attributes, which makes this hint exact
+            attrs.emplace_hint(attrs.end(), std::move(name), std::move(value));
+            this->pos = close + 1;
+        }
+    }
+
+    inline std::string Parser::read_content(const std::string& tag_name) {
+        /** Return everything up to the matching end tag verbatim, and skip past it */
+        const std::string end_tag = "</" + tag_name;
+        const char* start = this->pos;
+        const char* close;
+        while (true) {
+            close = this->find(end_tag.c_str());
+            if (close == this->end) {
+                this->pos = start;
+                this->error("unclosed <" + tag_name + ">");
+            }
+
+            // Skip end tags which only start with the same name, like </textPath>
+            const char* after = close + end_tag.size();
+            if (after < this->end && (*after == '>' || isspace((unsigned char)*after))) break;
+            this->pos = close + 1;
+        }
+
+        std::string ret(start, close);
+        this->pos = close;
+        this->skip_past(">");
+        return ret;
+    }
+
+    inline std::unique_ptr<Element> Parser::make_element(const std::string& tag_name, SVGAttrib&& attrs) {
+        /** Create an instance of the class matching a tag */
+        if (tag_name == "g") return std::make_unique<Group>(std::move(attrs));
+        if (tag_name == "rect") return std::make_unique<Rect>(std::move(attrs));
+        if (tag_name == "circle") return std::make_unique<Circle>(std::move(attrs));
+        if (tag_name == "line") return std::make_unique<Line>(std::move(attrs));
+        if (tag_name == "path") return std::make_unique<Path>(std::move(attrs));
+        if (tag_name == "polygon") return std::make_unique<Polygon>(std::move(attrs));
+        if (tag_name == "text") return std::make_unique<Text>(std::move(attrs));
+        if (tag_name == "svg") return std::make_unique<SVG>(std::move(attrs));
+        return std::make_unique<GenericElement>(tag_name, std::move(attrs));
+    }
+
+    inline std::unique_ptr<Element> Parser::parse() {
+        /** Parse a complete document, throwing std::runtime_error if it is malformed */
+        SVG_TRACE_SCOPE("parse");
+        std::unique_ptr<Element> root;
+        std::vector<std::pair<Element*, std::string>> open; // Elements awaiting end tags
+
+        while (true) {
+            const char* tag_start = (const char*)memchr(this->pos, '<', this->end - this->pos);
+            if (!tag_start) tag_start = this->end;
+
+            // Keep character data inside of generic elements like <title>
+            auto generic = open.empty() ? nullptr : dynamic_cast<GenericElement*>(open.back().first);
+            if (generic) {
+                const char* first = this->pos;
+                while (first < tag_start && isspace((unsigned char)*first)) first++;
+                if (first != tag_start) generic->content.append(this->pos, tag_start);
+            }
+
+            this->pos = tag_start;
+            if (this->pos == this->end) break;
+            this->pos++;
+
+            if (this->starts_with("!--")) {
+                this->skip_past("-->");
+            }
+            else if (this->starts_with("![CDATA[")) {
+                const char* start = this->pos - 1;
+                this->skip_past("]]>");
+                if (generic) generic->content.append(start, this->pos);
+            }
+            else if (this->starts_with("?") || this->starts_with("!")) {
+                this->skip_past(">");
+            }
+            else if (this->starts_with("/")) {
+                this->pos++;
+                std::string name = this->read_name();
+                if (open.empty() || open.back().second != name)
+                    this->error("unexpected </" + name + ">");
+                this->skip_past(">");
+                open.pop_back();
+            }
+            else {
+                std::string name = this->read_name();
+                SVGAttrib attrs;
+                const bool self_closing = this->read_attributes(attrs);
+
+                if (open.empty() && root) this->error("more than one root element");
+                if (name == "style") {
+                    if (open.empty()) this->error("<style> cannot be the root element");
+
+                    // Use the stylesheet every <svg> comes with if it hasn't been filled yet
+                    Element* parent = open.back().first;
+                    auto svg = dynamic_cast<SVG*>(parent);
+                    SVG::Style* style = (svg && svg->css && svg->css->css.empty() && svg->css->keyframes.empty()) ?
+                        svg->css : parent->add_child<SVG::Style>();
+                    if (!self_closing) {
+                        std::string css = this->read_content(name);
+                        for (auto marker : { "<![CDATA[", "]]>" }) {
+                            size_t found = css.find(marker);
+                            if (found != std::string::npos) css.erase(found, strlen(marker));
+                        }
+                        for (size_t comment = css.find("/*"); comment != std::string::npos; comment = css.find("/*", comment))
+                            css.erase(comment, css.find("*/", comment) - comment + 2);
+                        util::parse_css(css.data(), css.data() + css.size(), style->css, &style->keyframes);
+                    }
+                    continue;
+                }
+
+                auto elem = make_element(name, std::move(attrs));
+                Element* current = elem.get();
+                if (open.empty()) {
+                    root = std::move(elem);
+                }
+                else {
+                    Element* parent = open.back().first;
+                    parent->children.push_back(std::move(elem));
+                    parent->adopt_back();
+                }
+
+                if (self_closing) continue;
+                if (name == "text") // Keep <tspan>s and the like verbatim
+                    ((Text*)current)->content = this->read_content(name);
+                else
+                    open.push_back(std::make_pair(current, std::move(name)));
+            }
+        }
+
+        if (!open.empty()) this->error("unclosed <" + open.back().second + ">");
+        if (!root) this->error("no root element");
+        return root;
+    }
+
+    inline std::unique_ptr<Element> parse(const std::string& text) {
+        /** Build an element tree from the text of an SVG document */
+        return Parser(text.data(), text.size()).parse();
+    }
+
+    inline std::unique_ptr<Element> load(const std::string& filename) {
+        /** Build an element tree from an SVG file */
+        std::ifstream infile(filename, std::ios::binary);
+        if (!infile) throw std::runtime_error("Could not open " + filename);
+        std::string text((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+        return parse(text);
+    }
+
+    namespace util {
+        inline bool next_attribute(const char*& pos, const char* end, StringView& name, StringView& value) {
+            /** Read the next name="value" pair of a start tag, returning false at the end of the tag */
+            while (pos < end && isspace((unsigned char)*pos)) pos++;
+            const char* name_start = pos;
+            while (pos < end && *pos != '=' && *pos != '>' && *pos != '/' && !isspace((unsigned char)*pos)) pos++;
+            if (pos == name_start) return false;
+            name = StringView(name_start, pos - name_start);
+
+            while (pos < end && (isspace((unsigned char)*pos) || *pos == '=')) pos++;
+            if (pos == end || (*pos != '"' && *pos != '\'')) return false;
+            const char quote = *pos++;
+            const char* close = (const char*)memchr(pos, quote, end - pos);
+            if (!close) return false;
+            value = StringView(pos, close - pos);
+            pos = close + 1;
+            return true;
+        }
+
+        inline std::string escape_attribute(const StringView value, const bool markup = false) {
+            /** Return a value for writing between double quotes, with the characters
+             *  which can't appear there replaced by entities
+             *
+             *  @param[in] markup Whether value is already markup (e.g. taken from a
+             *                    single-quoted attribute), so only double quotes are escaped
+             */
+            std::string ret;
+            ret.reserve(value.size());
+            for (const char* ch = value.data(); ch != value.end(); ch++) {
+                if (*ch == '"') ret += "&quot;";
+                else if (*ch == '&' && !markup) ret += "&amp;";
+                else if (*ch == '<' && !markup) ret += "&lt;";
+                else ret += *ch;
+            }
+            return ret;
+        }
+    }
+
+    /** @class MappedFile
+     *  @brief A read-only view of an entire file, memory-mapped where supported
+     */
+    class MappedFile {
+    public:
+        MappedFile(const std::string& filename);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        const char* data() const { return this->ptr; }
+        size_t size() const { return this->len; }
+
+    private:
+        const char* ptr = nullptr;
+        size_t len = 0;
+#ifdef _WIN32
+        std::string buffer; /**< File contents, since only POSIX mmap() is used */
+#endif
+    };
+
+#ifdef _WIN32
+    inline MappedFile::MappedFile(const std::string& filename) {
+        std::ifstream infile(filename, std::ios::binary);
+        if (!infile) throw std::runtime_error("Could not open " + filename);
+        this->buffer.assign((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+        this->ptr = this->buffer.data();
+        this->len = this->buffer.size();
+    }
+
+    inline MappedFile::~MappedFile() {}
+#else
+    inline MappedFile::MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("Could not open " + filename);
+        }
+
+        this->len = (size_t)info.st_size;
+        if (this->len) {
+            void* mapping = mmap(nullptr, this->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Could not map " + filename);
+            }
+            madvise(mapping, this->len, MADV_SEQUENTIAL);
+            this->ptr = (const char*)mapping;
+        }
+        close(fd); // The mapping stays valid
+    }
+
+    inline MappedFile::~MappedFile() {
+        if (this->ptr) munmap((void*)this->ptr, this->len);
+    }
+#endif
+
+    /** @class MappedDocument
+     *  @brief A read-mostly SVG document whose attributes are read in place
+     *
+     *  Loading only records where each element's start tag is, about 24 bytes
+     *  per element, and attribute values are returned as views into the original
+     *  text. set_attr() stores new values on the side, and write() copies the
+     *  original text verbatim except for the start tags of modified elements.
+     *
+     *  Values are read as they appear in the markup, with entities left as they are.
+     *  set_attr() takes plain text, and escapes &, < and " in it.
+     *
+     *  Use SVG::parse() instead for documents which need structural changes.
+     */
+    class MappedDocument {
+    public:
+        class Node;
+        using StringView = util::StringView;
+
+        MappedDocument(const std::string& filename);
+        MappedDocument(const char* data, const size_t size); /**< Use text owned by the caller */
+        MappedDocument(const MappedDocument&) = delete;
+        MappedDocument& operator=(const MappedDocument&) = delete;
+
+        Node root();
+        Node get_element_by_id(const std::string& id);
+        std::vector<Node> get_elements_by_tag(const std::string& tag);
+        size_t size() const { return this->records.size(); } /**< Number of elements */
+
+        void write(std::ostream& out) const;
+        operator std::string() const;
+
+    private:
+        /** Location of an element's start tag, with links to its relatives */
+        struct Record {
+            uint64_t begin;        /**< Offset of '<' */
+            uint32_t length;       /**< Length of the start tag, including '<' and '>' */
+            uint32_t parent;
+            uint32_t first_child;
+            uint32_t next_sibling;
+        };
+
+        enum : uint32_t { NONE = UINT32_MAX }; /**< Missing parent, child or sibling */
+        std::unique_ptr<MappedFile> file;
+        const char* text;
+        size_t text_size;
+        std::vector<Record> records;
+        std::map<uint32_t, std::vector<std::pair<std::string, std::string>>> modified; /**< Rewritten attributes */
+
+        void index();
+        void write_tag(std::ostream& out, const uint32_t node) const;
+        std::vector<std::pair<StringView, StringView>> attributes(const uint32_t node) const;
+        StringView tag_name(const uint32_t node) const;
+    };
+
+    /** @class MappedDocument::Node
+     *  @brief A handle to one element of a MappedDocument
+     */
+    class MappedDocument::Node {
+        /** Views returned by get_attr() remain valid until this element's next set_attr() */
+    public:
+        Node() = default;
+        bool valid() const { return this->doc != nullptr; }
+        explicit operator bool() const { return this->valid(); }
+
+        StringView tag() const { return this->doc->tag_name(this->index); }
+        StringView get_attr(const std::string& key) const;
+        bool has_attr(const std::string& key) const;
+        SVGAttrib attributes() const;
+        Node& set_attr(const std::string& key, const std::string& value);
+        Node& set_attr(const std::string& key, const char* value) { return this->set_attr(key, std::string(value)); }
+        Node& set_attr(const std::string& key, const double value) { return this->set_attr(key, to_string(value)); }
+
+        Node parent() const;
+        std::vector<Node> children() const;
+
+    private:
+        friend class MappedDocument;
+        Node(MappedDocument* _doc, const uint32_t _index) : doc(_doc), index(_index) {};
+
+        MappedDocument* doc = nullptr;
+        uint32_t index = 0;
+    };
+
+    inline MappedDocument::MappedDocument(const std::string& filename) : file(new MappedFile(filename)) {
+        SVG_TRACE_SCOPE("MappedDocument::load");
+        this->text = this->file->data();
+        this->text_size = this->file->size();
+        this->index();
+    }
+
+    inline MappedDocument::MappedDocument(const char* data, const size_t size) : text(data), text_size(size) {
+        this->index();
+    }
+
+    inline void MappedDocument::index() {
+        /** Record the start tag of every element in a single pass */
+        const char *pos = this->text, *end = this->text + this->text_size;
+        std::vector<std::pair<uint32_t, uint32_t>> open; // (element, last child)
+
+        auto error = [&](const std::string& message) {
+            throw std::runtime_error("SVG parse error at offset " + std::to_string(pos - this->text) + ": " + message);
+        };
+        auto skip_past = [&](const char* terminator) {
+            const size_t len = strlen(terminator);
+            for (const char* p = pos; ; p++) {
+                p = (const char*)memchr(p, terminator[0], end - p);
+                if (!p || (size_t)(end - p) < len) error(std::string("expected ") + terminator);
+                if (memcmp(p, terminator, len) == 0) {
+                    pos = p + len;
+                    return;
+                }
+            }
+        };
+        auto starts_with = [&](const char* prefix) {
+            const size_t len = strlen(prefix);
+            return (size_t)(end - pos) >= len && memcmp(pos, prefix, len) == 0;
+        };
+
+        // An empty file is mapped to nullptr, which memchr() mustn't be given
+        while (pos < end && (pos = (const char*)memchr(pos, '<', end - pos)) != nullptr) {
+            const char* tag_start = pos++;
+            if (starts_with("!--")) skip_past("-->");
+            else if (starts_with("![CDATA[")) skip_past("]]>");
+            else if (starts_with("?") || starts_with("!")) skip_past(">");
+            else if (starts_with("/")) {
+                const char* name = ++pos;
+                skip_past(">");
+                if (open.empty()) error("unexpected end tag");
+
+                StringView expected = this->tag_name(open.back().first), actual(name, pos - 1 - name);
+                while (!actual.empty() && isspace((unsigned char)actual.data()[actual.size() - 1]))
+                    actual = StringView(actual.data(), actual.size() - 1);
+                if (expected != actual) error("expected </" + std::string(expected) + ">");
+                open.pop_back();
+            }
+            else {
+                // Find the end of the start tag, skipping over quoted values
+                char quote = 0;
+                while (pos < end && (quote || *pos != '>')) {
+                    if (quote && *pos == quote) quote = 0;
+                    else if (!quote && (*pos == '"' || *pos == '\'')) quote = *pos;
+                    pos++;
+                }
+                if (pos == end) error("unterminated tag");
+                pos++;
+
+                if (this->records.size() >= NONE) error("too many elements");
+                if (open.empty() && !this->records.empty()) error("more than one root element");
+                const uint32_t node = (uint32_t)this->records.size();
+                this->records.push_back({ (uint64_t)(tag_start - this->text), (uint32_t)(pos - tag_start),
+                    open.empty() ? NONE : open.back().first, NONE, NONE });
+
+                if (!open.empty()) {
+                    auto& parent = open.back();
+                    if (parent.second == NONE) this->records[parent.first].first_child = node;
+                    else this->records[parent.second].next_sibling = node;
+                    parent.second = node;
+                }
+
+                if (*(pos - 2) != '/') open.push_back(std::make_pair(node, NONE));
+            }
+        }
+
+        pos = end;
+        if (!open.empty()) error("unclosed <" + std::string(this->tag_name(open.back().first)) + ">");
+        if (this->records.empty()) error("no root element");
+    }
+
+    inline util::StringView MappedDocument::tag_name(const uint32_t node) const {
+        const char* start = this->text + this->records[node].begin + 1, *pos = start;
+        while (!isspace((unsigned char)*pos) && *pos != '>' && *pos != '/') pos++;
+        return StringView(start, pos - start);
+    }
+
+    inline std::vector<std::pair<util::StringView, util::StringView>> MappedDocument::attributes(
+        const uint32_t node) const {
+        /** Return the attributes of an element as written in the original text */
+        std::vector<std::pair<StringView, StringView>> ret;
+        auto name = this->tag_name(node);
+        const char* pos = name.end(), *end = this->text + this->records[node].begin + this->records[node].length;
+        StringView key, value;
+        while (util::next_attribute(pos, end, key, value))
+            ret.push_back(std::make_pair(key, value));
+        return ret;
+    }
+
+    inline MappedDocument::Node MappedDocument::root() {
+        return Node(this, 0);
+    }
+
+    inline MappedDocument::Node MappedDocument::get_element_by_id(const std::string& id) {
+        /** Return the element with a certain id, or an invalid Node */
+        for (uint32_t i = 0; i < this->records.size(); i++)
+            if (Node(this, i).get_attr("id") == StringView(id)) return Node(this, i);
+        return Node();
+    }
+
+    inline std::vector<MappedDocument::Node> MappedDocument::get_elements_by_tag(const std::string& tag) {
+        std::vector<Node> ret;
+        for (uint32_t i = 0; i < this->records.size(); i++)
+            if (this->tag_name(i) == StringView(tag)) ret.push_back(Node(this, i));
+        return ret;
+    }
+
+    inline void MappedDocument::write_tag(std::ostream& out, const uint32_t node) const {
+        /** Write a start tag with modified attributes */
+        auto& record = this->records[node];
+        out << "<" << this->tag_name(node);
+        for (auto& pair : this->modified.at(node))
+            out << " " << pair.first << "=\"" << pair.second << "\"";
+        out << (this->text[record.begin + record.length - 2] == '/' ? " />" : ">");
+    }
+
+    inline void MappedDocument::write(std::ostream& out) const {
+        /** Write the document, copying everything but modified start tags verbatim */
+        SVG_TRACE_SCOPE("MappedDocument::write");
+        uint64_t copied = 0;
+        for (auto& change : this->modified) {
+            auto& record = this->records[change.first];
+            out.write(this->text + copied, record.begin - copied);
+            this->write_tag(out, change.first);
+            copied = record.begin + record.length;
+        }
+        out.write(this->text + copied, this->text_size - copied);
+    }
+
+    inline MappedDocument::operator std::string() const {
+        std::stringstream ss;
+        this->write(ss);
+        return ss.str();
+    }
+
+    inline util::StringView MappedDocument::Node::get_attr(const std::string& key) const {
+        /** Return an attribute's value, or an empty view if it is not set */
+        auto changes = this->doc->modified.find(this->index);
+        if (changes != this->doc->modified.end()) {
+            for (auto& pair : changes->second)
+                if (pair.first == key) return StringView(pair.second);
+            return StringView();
+        }
+
+        for (auto& pair : this->doc->attributes(this->index))
+            if (pair.first == StringView(key)) return pair.second;
+        return StringView();
+    }
+
+    inline bool MappedDocument::Node::has_attr(const std::string& key) const {
+        auto changes = this->doc->modified.find(this->index);
+        if (changes != this->doc->modified.end()) {
+            for (auto& pair : changes->second)
+                if (pair.first == key) return true;
+            return false;
+        }
+
+        for (auto& pair : this->doc->attributes(this->index))
+            if (pair.first == StringView(key)) return true;
+        return false;
+    }
+
+    inline SVGAttrib MappedDocument::Node::attributes() const {
+        /** Return a copy of all attributes */
+        SVGAttrib ret;
+        auto changes = this->doc->modified.find(this->index);
+        if (changes != this->doc->modified.end())
+            ret.insert(changes->second.begin(), changes->second.end());
+        else
+            for (auto& pair : this->doc->attributes(this->index))
+                ret[pair.first] = pair.second;
+        return ret;
+    }
+
+    inline MappedDocument::Node& MappedDocument::Node::set_attr(const std::string& key, const std::string& value) {
+        /** Modify an attribute, copying this element's attributes out of the original text the first time */
+        auto& changes = this->doc->modified[this->index];
+        if (changes.empty())
+            for (auto& pair : this->doc->attributes(this->index))
+                changes.push_back(std::make_pair(std::string(pair.first), util::escape_attribute(pair.second, true)));
+
+        for (auto& pair : changes) {
+            if (pair.first == key) {
+                pair.second = util::escape_attribute(value);
+                return *this;
+            }
+        }
+
+        changes.push_back(std::make_pair(key, util::escape_attribute(value)));
+        return *this;
+    }
+
+    inline MappedDocument::Node MappedDocument::Node::parent() const {
+        uint32_t parent = this->doc->records[this->index].parent;
+        return parent == NONE ? Node() : Node(this->doc, parent);
+    }
+
+    inline std::vector<MappedDocument::Node> MappedDocument::Node::children() const {
+        std::vector<Node> ret;
+        for (uint32_t child = this->doc->records[this->index].first_child; child != NONE;
+            child = this->doc->records[child].next_sibling)
+            ret.push_back(Node(this->doc, child));
+        return ret;
+    }
+
+    namespace util {
+        /** @struct JsonValue
+         *  @brief A parsed JSON value (numbers are kept as doubles)
+         */
+        struct JsonValue {
+            enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+            bool boolean = false;
+            double number = 0;
+            std::string string;
+            std::vector<JsonValue> array;
+            std::vector<std::pair<std::string, JsonValue>> object;
+
+            const JsonValue& operator[](const std::string& key) const {
+                /** Return a member of an object, or a null value */
+                static const JsonValue null;
+                for (auto& member : this->object)
+                    if (member.first == key) return member.second;
+                return null;
+            }
+        };
+
+        inline std::string json_escape(const std::string& str) {
+            /** Return str as a quoted JSON string */
+            std::string ret = "\"";
+            for (auto& ch : str) {
+                switch (ch) {
+                case '"': ret += "\\\""; break;
+                case '\\': ret += "\\\\"; break;
+                case '\n': ret += "\\n"; break;
+                case '\t': ret += "\\t"; break;
+                case '\r': ret += "\\r"; break;
+                default:
+                    if ((unsigned char)ch < 0x20) {
+                        char escape[7];
+                        snprintf(escape, sizeof(escape), "\\u%04x", ch);
+                        ret += escape;
+                    }
+                    else ret += ch;
+                }
+            }
+            return ret + "\"";
+        }
+
+        inline JsonValue parse_json(const char*& pos, const char* end) {
+            /** Parse one JSON value, advancing pos past it */
+            auto fail = []() -> JsonValue { throw std::runtime_error("Invalid JSON"); };
+            auto skip_whitespace = [&]() { while (pos < end && isspace((unsigned char)*pos)) pos++; };
+            auto next_item = [&](const char close) {
+                // Values are followed by a comma and another value, or the closing bracket
+                skip_whitespace();
+                if (pos == end || (*pos != ',' && *pos != close)) fail();
+                if (*pos == close) return false;
+                pos++;
+                skip_whitespace();
+                if (pos < end && *pos == close) fail();
+                return true;
+            };
+            auto parse_string = [&]() {
+                std::string ret;
+                for (pos++; pos < end && *pos != '"'; pos++) {
+                    if (*pos != '\\') {
+                        ret += *pos;
+                        continue;
+                    }
+                    if (++pos == end) break;
+                    switch (*pos) {
+                    case 'n': ret += '\n'; break;
+                    case 't': ret += '\t'; break;
+                    case 'r': ret += '\r'; break;
+                    case 'b': ret += '\b'; break;
+                    case 'f': ret += '\f'; break;
+                    case 'u': {
+                        // Only what json_escape() produces: code points below 0x80
+                        if (end - pos < 5) fail();
+                        ret += (char)std::stoi(std::string(pos + 1, pos + 5), nullptr, 16);
+                        pos += 4;
+                        break;
+                    }
+                    default: ret += *pos;
+                    }
+                }
+                if (pos == end) fail();
+                pos++;
+                return ret;
+            };
+
+            JsonValue ret;
+            skip_whitespace();
+            if (pos == end) fail();
+
+            if (*pos == '{') {
+                ret.type = JsonValue::OBJECT;
+                pos++;
+                skip_whitespace();
+                if (pos < end && *pos != '}') {
+                    do {
+                        if (*pos != '"') fail();
+                        std::string key = parse_string();
+                        skip_whitespace();
+                        if (pos == end || *pos++ != ':') fail();
+                        ret.object.push_back(std::make_pair(key, parse_json(pos, end)));
+                    } while (next_item('}'));
+                }
+                if (pos == end) fail();
+                pos++;
+            }
+            else if (*pos == '[') {
+                ret.type = JsonValue::ARRAY;
+                pos++;
+                skip_whitespace();
+                if (pos < end && *pos != ']') {
+                    do {
+                        ret.array.push_back(parse_json(pos, end));
+                    } while (next_item(']'));
+                }
+                if (pos == end) fail();
+                pos++;
+            }
+            else if (*pos == '"') {
+                ret.type = JsonValue::STRING;
+                ret.string = parse_string();
+            }
+            else if (end - pos >= 4 && (memcmp(pos, "true", 4) == 0 || memcmp(pos, "null", 4) == 0)) {
+                ret.type = *pos == 't' ? JsonValue::BOOLEAN : JsonValue::NUL;
+                ret.boolean = *pos == 't';
+                pos += 4;
+            }
+            else if (end - pos >= 5 && memcmp(pos, "false", 5) == 0) {
+                ret.type = JsonValue::BOOLEAN;
+                pos += 5;
+            }
+            else if (*pos == '-' || isdigit((unsigned char)*pos)) {
+                const std::string digits(pos, std::min(end, pos + 32));
+                char* number_end;
+                ret.type = JsonValue::NUMBER;
+                ret.number = strtod(digits.c_str(), &number_end);
+                if (number_end == digits.c_str()) fail();
+                pos += number_end - digits.c_str();
+            }
+            else fail();
+
+            return ret;
+        }
+
+        inline JsonValue parse_json(const std::string& text) {
+            /** Parse a complete JSON document, which may only be followed by whitespace */
+            const char* pos = text.data();
+            const char* end = text.data() + text.size();
+            JsonValue ret = parse_json(pos, end);
+            while (pos < end && isspace((unsigned char)*pos)) pos++;
+            if (pos != end) throw std::runtime_error("Invalid JSON");
+            return ret;
+        }
+    }
+
+    /** @class Patch
+     *  @brief Computes and applies edit scripts between two versions of a document
+     *
+     *  A patch is a JSON array of operations, applied in order. Elements are
+     *  addressed by "path", the list of child indices leading to them from the root.
+     *
+     *  - `{"op": "attr", "path": [...], "set": {"name": "value"}, "remove": ["name"]}`
+     *  - `{"op": "remove", "path": [..., i]}`
+     *  - `{"op": "insert", "path": [..., i], "svg": "<rect ... />"}`
+     *  - `{"op": "move", "path": [...], "from": i, "to": j}` (reorders children)
+     *  - `{"op": "replace", "path": [...], "svg": "<text ...>...</text>"}`
+     *
+     *  Indices must be non-negative integers, and an empty path (the root) can
+     *  only be replaced or have its attributes changed.
+     *
+     *  Unchanged subtrees are skipped by comparing their cached hashes, so
+     *  diffing takes time proportional to the size of the change.
+     */
+    class Patch {
+    public:
+        static std::string diff(Element& before, Element& after);
+        static void apply(Element& root, const std::string& patch);
+
+    private:
+        using Path = std::vector<size_t>;
+        static void diff(Element& before, Element& after, Path& path, std::vector<std::string>& ops);
+        static void diff_children(Element& before, Element& after, Path& path, std::vector<std::string>& ops);
+        static std::string path_to_json(const Path& path);
+        static std::string markup(Element& elem);
+        static std::unique_ptr<Element> parse_fragment(const std::string& svg);
+        static void release(Element* parent, Element* child);
+    };
+
+    inline std::string Patch::path_to_json(const Path& path) {
+        std::string ret = "[";
+        for (size_t i = 0; i < path.size(); i++)
+            ret += (i ? "," : "") + std::to_string(path[i]);
+        return ret + "]";
+    }
+
+    inline std::string Patch::markup(Element& elem) {
+        /** Return an element's SVG, including elements which normally produce
+         *  no output (i.e. empty stylesheets)
+         */
+        std::stringstream ss;
+        elem.svg_to_stream(ss, 0, SerializeOptions());
+        return ss.tellp() == 0 ? "<" + elem.tag() + " />" : ss.str();
+    }
+
+    inline std::string Patch::diff(Element& before, Element& after) {
+        /** Return a patch which turns before into after */
+        SVG_TRACE_SCOPE("diff");
+        std::vector<std::string> ops;
+        Path path;
+        diff(before, after, path, ops);
+
+        std::string ret = "[";
+        for (size_t i = 0; i < ops.size(); i++)
+            ret += (i ? ",\n" : "\n") + ops[i];
+        return ret + (ops.empty() ? "]" : "\n]");
+    }
+
+    inline void Patch::diff(Element& before, Element& after, Path& path, std::vector<std::string>& ops) {
+        if (before.subtree_hash() == after.subtree_hash()) return;
+
+        if (before.tag() != after.tag() || before.own_content() != after.own_content()) {
+            ops.push_back("{\"op\":\"replace\",\"path\":" + path_to_json(path) +
+                ",\"svg\":" + util::json_escape(markup(after)) + "}");
+            return;
+        }
+
+        if (before.attr != after.attr) {
+            std::string set, remove;
+            for (auto& pair : after.attr) {
+                auto old = before.attr.find(pair.first);
+                if (old == before.attr.end() || old->second != pair.second)
+                    set += (set.empty() ? "" : ",") + util::json_escape(pair.first) + ":" + util::json_escape(pair.second);
+            }
+            for (auto& pair : before.attr)
+                if (after.attr.find(pair.first) == after.attr.end())
+                    remove += (remove.empty() ? "" : ",") + util::json_escape(pair.first);
+            ops.push_back("{\"op\":\"attr\",\"path\":" + path_to_json(path) + ",\"set\":{" + set +
+                "},\"remove\":[" + remove + "]}");
+        }
+
+        diff_children(before, after, path, ops);
+    }
+
+    inline void Patch::diff_children(Element& before, Element& after, Path& path, std::vector<std::string>& ops) {
+        /** Match up children (by id, then identical contents, then tag),
+         *  then remove, reorder and insert children, and diff the matched pairs
+         */
+        const size_t NONE = (size_t)-1;
+        auto& old_children = before.children;
+        auto& new_children = after.children;
+        std::vector<size_t> match(new_children.size(), NONE); // Index of the matching old child
+        std::vector<bool> used(old_children.size(), false);
+
+        std::unordered_map<std::string, size_t> old_ids;
+        std::unordered_map<uint64_t, std::vector<size_t>> old_hashes;
+        for (size_t i = 0; i < old_children.size(); i++) {
+            auto& id = old_children[i]->find_attr("id");
+            if (!id.empty()) old_ids[id] = i;
+        }
+
+        for (size_t j = 0; j < new_children.size(); j++) {
+            auto& id = new_children[j]->find_attr("id");
+            auto old = id.empty() ? old_ids.end() : old_ids.find(id);
+            if (old != old_ids.end() && !used[old->second] &&
+                old_children[old->second]->tag() == new_children[j]->tag()) {
+                match[j] = old->second;
+                used[old->second] = true;
+            }
+        }
+
+        for (size_t i = 0; i < old_children.size(); i++)
+            if (!used[i]) old_hashes[old_children[i]->subtree_hash()].push_back(i);
+        for (size_t j = 0; j < new_children.size(); j++) {
+            if (match[j] != NONE) continue;
+            auto candidates = old_hashes.find(new_children[j]->subtree_hash());
+            if (candidates == old_hashes.end()) continue;
+            for (auto i : candidates->second) {
+                if (!used[i]) {
+                    match[j] = i;
+                    used[i] = true;
+                    break;
+                }
+            }
+        }
+
+        // Pair up what's left with the next unused old child of the same tag
+        std::unordered_map<std::string, size_t> next_of_tag;
+        for (size_t j = 0; j < new_children.size(); j++) {
+            if (match[j] != NONE) continue;
+            const std::string tag = new_children[j]->tag();
+            size_t& i = next_of_tag[tag];
+            while (i < old_children.size() && (used[i] || old_children[i]->tag() != tag)) i++;
+            if (i < old_children.size()) {
+                match[j] = i;
+                used[i] = true;
+            }
+        }
+
+        // Remove unmatched children, last first so indices stay valid
+        for (size_t i = old_children.size(); i-- > 0; ) {
+            if (used[i]) continue;
+            path.push_back(i);
+            ops.push_back("{\"op\":\"remove\",\"path\":" + path_to_json(path) + "}");
+            path.pop_back();
+        }
+
+        // Move and insert children until the order matches
+        std::vector<size_t> current;
+        for (size_t i = 0; i < old_children.size(); i++)
+            if (used[i]) current.push_back(i);
+
+        for (size_t j = 0; j < new_children.size(); j++) {
+            if (match[j] == NONE) {
+                path.push_back(j);
+                ops.push_back("{\"op\":\"insert\",\"path\":" + path_to_json(path) +
+                    ",\"svg\":" + util::json_escape(markup(*new_children[j])) + "}");
+                path.pop_back();
+                current.insert(current.begin() + j, NONE);
+                continue;
+            }
+
+            size_t from = std::find(current.begin() + j, current.end(), match[j]) - current.begin();
+            if (from != j) {
+                ops.push_back("{\"op\":\"move\",\"path\":" + path_to_json(path) +
+                    ",\"from\":" + std::to_string(from) + ",\"to\":" + std::to_string(j) + "}");
+                current.erase(current.begin() + from);
+                current.insert(current.begin() + j, match[j]);
+            }
+        }
+
+        for (size_t j = 0; j < new_children.size(); j++) {
+            if (match[j] == NONE) continue;
+            path.push_back(j);
+            diff(*old_children[match[j]], *new_children[j], path, ops);
+            path.pop_back();
+        }
+    }
+
+    inline std::unique_ptr<Element> Patch::parse_fragment(const std::string& svg) {
+        /** Parse a single element, which may be a stylesheet */
+        auto wrapper = parse("<g>" + svg + "</g>");
+        if (wrapper->children.size() != 1)
+            throw std::runtime_error("Patch must contain exactly one element per insert or replace");
+        auto ret = std::move(wrapper->children[0]);
+        ret->parent = nullptr;
+        return ret;
+    }
+
+    inline void Patch::release(Element* parent, Element* child) {
+        /** Forget about a child that is about to be destroyed or replaced */
+        auto svg = dynamic_cast<SVG*>(parent);
+        if (svg && svg->css == child) svg->css = nullptr;
+    }
+
+    inline void Patch::apply(Element& root, const std::string& patch) {
+        /** Apply a patch created by diff(), throwing std::runtime_error if it doesn't fit this document */
+        SVG_TRACE_SCOPE("apply_patch");
+        auto ops = util::parse_json(patch);
+        if (ops.type != util::JsonValue::ARRAY) throw std::runtime_error("Patch must be a JSON array");
+
+        auto as_index = [](const util::JsonValue& value) {
+            // Anything else would be rounded or wrapped around into some other child
+            if (value.type != util::JsonValue::NUMBER || !(value.number >= 0) ||
+                value.number != std::floor(value.number) || value.number >= 9007199254740992.0)
+                throw std::runtime_error("Patch indices must be non-negative integers");
+            return (size_t)value.number;
+        };
+
+        for (auto& op : ops.array) {
+            if (op["path"].type != util::JsonValue::ARRAY) throw std::runtime_error("Patch operation has no path");
+            auto& path = op["path"].array;
+            const std::string& type = op["op"].string;
+            const bool addresses_child = type == "remove" || type == "insert" || type == "replace";
+            if (path.empty() && (type == "remove" || type == "insert"))
+                throw std::runtime_error("Cannot " + type + " the root");
+
+            // Find the element (or for operations on children, its parent)
+            Element* elem = &root;
+            size_t depth = path.size() - (addresses_child && !path.empty() ? 1 : 0);
+            for (size_t i = 0; i < depth; i++) {
+                size_t index = as_index(path[i]);
+                if (index >= elem->children.size()) throw std::runtime_error("Patch path does not exist");
+                elem = elem->children[index].get();
+            }
+            const size_t index = path.empty() ? 0 : as_index(path.back());
+            auto& children = elem->children;
+
+            if (type == "attr") {
+                for (auto& pair : op["set"].object)
+                    elem->attr[pair.first] = pair.second.string;
+                for (auto& key : op["remove"].array)
+                    elem->attr.erase(key.string);
+                elem->invalidate();
+            }
+            else if (type == "replace" && path.empty()) {
+                // The root can't be swapped out, so take over the contents of the replacement
+                auto replacement = parse_fragment(op["svg"].string);
+                if (replacement->tag() != root.tag()) throw std::runtime_error("Cannot change the type of the root");
+                root = std::move(*replacement);
+                auto svg = dynamic_cast<SVG*>(&root);
+                if (svg) svg->css = svg->get_immediate_children<SVG::Style>().empty() ? nullptr :
+                    svg->get_immediate_children<SVG::Style>()[0];
+            }
+            else if (type == "insert" || type == "replace") {
+                if (index > children.size() || (type == "replace" && index == children.size()))
+                    throw std::runtime_error("Patch path does not exist");
+
+                auto child = parse_fragment(op["svg"].string);
+                child->parent = elem;
+                child->kind_cache = child->exact_kind();
+                auto svg = dynamic_cast<SVG*>(elem);
+                const bool stylesheet = svg && dynamic_cast<SVG::Style*>(child.get()) &&
+                    (!svg->css || (type == "replace" && svg->css == children[index].get()));
+                if (stylesheet) svg->css = (SVG::Style*)child.get();
+
+                if (type == "insert") children.insert(children.begin() + index, std::move(child));
+                else {
+                    if (!stylesheet) release(elem, children[index].get());
+                    children[index] = std::move(child);
+                }
+                elem->invalidate();
+            }
+            else if (type == "remove") {
+                if (index >= children.size()) throw std::runtime_error("Patch path does not exist");
+                release(elem, children[index].get());
+                children.erase(children.begin() + index);
+                elem->invalidate();
+            }
+            else if (type == "move") {
+                size_t from = as_index(op["from"]), to = as_index(op["to"]);
+                if (from >= children.size() || to >= children.size())
+                    throw std::runtime_error("Patch path does not exist");
+                auto child = std::move(children[from]);
+                children.erase(children.begin() + from);
+                children.insert(children.begin() + to, std::move(child));
+                elem->invalidate();
+            }
+            else {
+                throw std::runtime_error("Unknown patch operation: " + type);
+            }
+        }
+    }
+
+    inline std::string diff(Element& before, Element& after) {
+        /** Return a JSON patch which turns before into after (see Patch) */
+        return Patch::diff(before, after);
+    }
+
+    inline void apply_patch(Element& root, const std::string& patch) {
+        /** Apply a JSON patch created by diff() */
+        Patch::apply(root, patch);
+    }
+
+    /** @class BinaryDocument
+     *  @brief A compact binary encoding of an element tree, which can be read lazily
+     *
+     *  All integers are little-endian. The layout (version 1) is
+     *
+     *      header:  "SVGB" u32 version, u32 atom count, u64 atom table offset
+     *      node:    u32 tag atom, u32 attribute count, u32 child count,
+     *               u64 size of this node and its descendants in bytes,
+     *               u32 content length, content bytes, attributes, child nodes
+     *      attr:    u32 name atom, u8 kind, value
+     *      atoms:   (u32 length, bytes) for each atom
+     *
+     *  Tag and attribute names are interned as atoms. Attribute values are stored
+     *  as raw doubles or integers when that loses nothing (i.e. "1.5" and "12",
+     *  but not "1.50"), and as strings otherwise. Node sizes let readers skip
+     *  over subtrees, so a mapped file can be navigated without decoding all of it.
+     */
+    class BinaryDocument {
+    public:
+        class Node;
+        static const uint32_t VERSION = 1;
+
+        BinaryDocument(const std::string& filename);  /**< Map a file */
+        BinaryDocument(const char* data, const size_t size); /**< Use data owned by the caller */
+        BinaryDocument(const BinaryDocument&) = delete;
+        BinaryDocument& operator=(const BinaryDocument&) = delete;
+
+        Node root() const;
+        std::unique_ptr<Element> load() const;
+
+        static void write(std::ostream& out, Element& root);
+
+    private:
+        enum ValueKind : uint8_t { STRING = 0, DOUBLE = 1, INTEGER = 2 };
+
+        std::unique_ptr<MappedFile> file;
+        const char* data;
+        size_t size;
+        std::vector<util::StringView> atoms;
+
+        void read_header();
+        void check(const uint64_t offset, const uint64_t length) const;
+        uint32_t read_u32(const uint64_t offset) const;
+        uint64_t read_u64(const uint64_t offset) const;
+        std::unique_ptr<Element> load(const uint64_t offset) const;
+        SVGAttrib read_attributes(const uint64_t offset, uint64_t& pos) const;
+
+        static void put_u32(std::string& buffer, const uint32_t value);
+        static void put_u64(std::string& buffer, const uint64_t value);
+        static void write_node(std::string& buffer, Element& elem, std::unordered_map<std::string, uint32_t>& atoms,
+            std::vector<const std::string*>& atom_list);
+    };
+
+    /** @class BinaryDocument::Node
+     *  @brief A node of a BinaryDocument, decoded on demand
+     */
+    class BinaryDocument::Node {
+    public:
+        util::StringView tag() const;
+        SVGAttrib attributes() const;
+        util::StringView content() const;
+        std::vector<Node> children() const;
+        uint64_t subtree_bytes() const { return this->doc->read_u64(this->offset + 12); }
+        std::unique_ptr<Element> load() const { return this->doc->load(this->offset); } /**< Decode this subtree */
+
+    private:
+        friend class BinaryDocument;
+        Node(const BinaryDocument* _doc, const uint64_t _offset) : doc(_doc), offset(_offset) {};
+
+        const BinaryDocument* doc;
+        uint64_t offset;
+        uint64_t attributes_offset() const { return this->offset + 24 + this->content().size(); }
+    };
+
+    inline BinaryDocument::BinaryDocument(const std::string& filename) : file(new MappedFile(filename)) {
+        this->data = this->file->data();
+        this->size = this->file->size();
+        this->read_header();
+    }
+
+    inline BinaryDocument::BinaryDocument(const char* _data, const size_t _size) : data(_data), size(_size) {
+        this->read_header();
+    }
+
+    inline void BinaryDocument::check(const uint64_t offset, const uint64_t length) const {
+        if (offset > this->size || length > this->size - offset)
+            throw std::runtime_error("Truncated or corrupt binary SVG");
+    }
+
+    inline uint32_t BinaryDocument::read_u32(const uint64_t offset) const {
+        this->check(offset, 4);
+        const unsigned char* bytes = (const unsigned char*)this->data + offset;
+        return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    }
+
+    inline uint64_t BinaryDocument::read_u64(const uint64_t offset) const {
+        return (uint64_t)this->read_u32(offset) | ((uint64_t)this->read_u32(offset + 4) << 32);
+    }
+
+    inline void BinaryDocument::put_u32(std::string& buffer, const uint32_t value) {
+        const char bytes[4] = { (char)value, (char)(value >> 8), (char)(value >> 16), (char)(value >> 24) };
+        buffer.append(bytes, 4);
+    }
+
+    inline void BinaryDocument::put_u64(std::string& buffer, const uint64_t value) {
+        put_u32(buffer, (uint32_t)value);
+        put_u32(buffer, (uint32_t)(value >> 32));
+    }
+
+    inline void BinaryDocument::read_header() {
+        this->check(0, 20);
+        if (memcmp(this->data, "SVGB", 4) != 0) throw std::runtime_error("Not a binary SVG");
+        if (this->read_u32(4) != VERSION)
+            throw std::runtime_error("Unsupported binary SVG version " + std::to_string(this->read_u32(4)));
+
+        const uint32_t n_atoms = this->read_u32(8);
+        uint64_t offset = this->read_u64(12);
+        this->atoms.reserve(n_atoms);
+        for (uint32_t i = 0; i < n_atoms; i++) {
+            const uint32_t length = this->read_u32(offset);
+            this->check(offset + 4, length);
+            this->atoms.push_back(util::StringView(this->data + offset + 4, length));
+            offset += 4 + length;
+        }
+    }
+
+    inline void BinaryDocument::write(std::ostream& out, Element& root) {
+        /** Write an element tree in binary form */
+        std::string buffer = "SVGB";
+        put_u32(buffer, VERSION);
+        put_u32(buffer, 0);  // Number of atoms
+        put_u64(buffer, 0);  // Offset of the atom table
+
+        std::unordered_map<std::string, uint32_t> atoms;
+        std::vector<const std::string*> atom_list;
+        write_node(buffer, root, atoms, atom_list);
+
+        std::string header;
+        put_u32(header, (uint32_t)atom_list.size());
+        put_u64(header, buffer.size());
+        buffer.replace(8, header.size(), header);
+
+        for (auto atom : atom_list) {
+            put_u32(buffer, (uint32_t)atom->size());
+            buffer += *atom;
+        }
+
+        out.write(buffer.data(), buffer.size());
+    }
+
+    inline void BinaryDocument::write_node(std::string& buffer, Element& elem,
+        std::unordered_map<std::string, uint32_t>& atoms, std::vector<const std::string*>& atom_list) {
+        auto intern = [&](const std::string& str) {
+            auto it = atoms.find(str);
+            if (it == atoms.end()) {
+                it = atoms.insert(std::make_pair(str, (uint32_t)atom_list.size())).first;
+                atom_list.push_back(&it->first);
+            }
+            return it->second;
+        };
+
+        const size_t start = buffer.size();
+        const std::string content = elem.own_content();
+        put_u32(buffer, intern(elem.tag()));
+        put_u32(buffer, (uint32_t)elem.attr.size());
+        put_u32(buffer, (uint32_t)elem.children.size());
+        put_u64(buffer, 0); // Size of the subtree, filled in below
+        put_u32(buffer, (uint32_t)content.size());
+        buffer += content;
+
+        for (auto& pair : elem.attr) {
+            put_u32(buffer, intern(pair.first));
+            const std::string& value = pair.second;
+
+            // Numbers in the forms written by to_string() and std::to_string() are stored raw
+            size_t digits = 0, i = (!value.empty() && value[0] == '-') ? 1 : 0;
+            while (i + digits < value.size() && isdigit((unsigned char)value[i + digits])) digits++;
+            const bool canonical = digits > 0 && (digits == 1 || value[i] != '0');
+
+            if (canonical && digits <= 14 && value.size() == i + digits + 2 && value[i + digits] == '.' &&
+                isdigit((unsigned char)value.back())) {
+                buffer += (char)DOUBLE;
+                double number = strtod(value.c_str(), nullptr);
+                uint64_t bits;
+                memcpy(&bits, &number, 8);
+                put_u64(buffer, bits);
+            }
+            else if (canonical && digits <= 18 && value.size() == i + digits && value != "-0") {
+                buffer += (char)INTEGER;
+                put_u64(buffer, (uint64_t)std::stoll(value));
+            }
+            else {
+                buffer += (char)STRING;
+                put_u32(buffer, (uint32_t)value.size());
+                buffer += value;
+            }
+        }
+
+        for (auto& child : elem.children)
+            write_node(buffer, *child, atoms, atom_list);
+
+        std::string subtree_size;
+        put_u64(subtree_size, buffer.size() - start);
+        buffer.replace(start + 12, 8, subtree_size);
+    }
+
+    inline BinaryDocument::Node BinaryDocument::root() const {
+        return Node(this, 20);
+    }
+
+    inline util::StringView BinaryDocument::Node::tag() const {
+        const uint32_t atom = this->doc->read_u32(this->offset);
+        if (atom >= this->doc->atoms.size()) throw std::runtime_error("Corrupt binary SVG");
+        return this->doc->atoms[atom];
+    }
+
+    inline util::StringView BinaryDocument::Node::content() const {
+        const uint32_t length = this->doc->read_u32(this->offset + 20);
+        this->doc->check(this->offset + 24, length);
+        return util::StringView(this->doc->data + this->offset + 24, length);
+    }
+
+    inline SVGAttrib BinaryDocument::read_attributes(const uint64_t offset, uint64_t& pos) const {
+        /** Decode the attributes of the node at offset, leaving pos at its first child */
+        SVGAttrib ret;
+        const uint32_t count = this->read_u32(offset + 4);
+        pos = offset + 24 + this->read_u32(offset + 20);
+
+        for (uint32_t i = 0; i < count; i++) {
+            const uint32_t name = this->read_u32(pos);
+            this->check(pos + 4, 1);
+            const uint8_t kind = (uint8_t)this->data[pos + 4];
+            if (name >= this->atoms.size()) throw std::runtime_error("Corrupt binary SVG");
+            pos += 5;
+
+            std::string value;
+            if (kind == STRING) {
+                const uint32_t length = this->read_u32(pos);
+                this->check(pos + 4, length);
+                value.assign(this->data + pos + 4, length);
+                pos += 4 + length;
+            }
+            else if (kind == DOUBLE || kind == INTEGER) {
+                uint64_t bits = this->read_u64(pos);
+                pos += 8;
+                if (kind == DOUBLE) {
+                    double number;
+                    memcpy(&number, &bits, 8);
+
+                    // Same as to_string(): these values had exactly one decimal place
+                    long long tenths = std::llround(std::abs(number) * 10);
+                    value = (std::signbit(number) ? "-" : "") + std::to_string(tenths / 10) +
+                        "." + (char)('0' + tenths % 10);
+                }
+                else value = std::to_string((long long)bits);
+            }
+            else throw std::runtime_error("Corrupt binary SVG");
+
+            ret.emplace_hint(ret.end(), this->atoms[name], std::move(value));
+        }
+
+        return ret;
+    }
+
+    inline SVGAttrib BinaryDocument::Node::attributes() const {
+        /** Decode this node's attributes */
+        uint64_t pos;
+        return this->doc->read_attributes(this->offset, pos);
+    }
+
+    inline std::vector<BinaryDocument::Node> BinaryDocument::Node::children() const {
+        /** Return this node's children, skipping over their descendants */
+        std::vector<Node> ret;
+        const uint32_t count = this->doc->read_u32(this->offset + 8);
+        uint64_t pos = this->attributes_offset();
+
+        // Skip attributes
+        for (uint32_t i = 0, n_attrs = this->doc->read_u32(this->offset + 4); i < n_attrs; i++) {
+            this->doc->check(pos + 4, 1);
+            pos += 5 + ((uint8_t)this->doc->data[pos + 4] == STRING ? 4 + this->doc->read_u32(pos + 5) : 8);
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            ret.push_back(Node(this->doc, pos));
+            const uint64_t bytes = ret.back().subtree_bytes();
+            if (bytes == 0) throw std::runtime_error("Corrupt binary SVG");
+            pos += bytes;
+        }
+
+        return ret;
+    }
+
+    inline std::unique_ptr<Element> BinaryDocument::load() const {
+        /** Decode the whole document */
+        return this->load(20);
+    }
+
+    inline std::unique_ptr<Element> BinaryDocument::load(const uint64_t offset) const {
+        Node node(this, offset);
+        uint64_t pos;
+        auto elem = Parser::make_element(node.tag(), this->read_attributes(offset, pos));
+
+        auto content = node.content();
+        if (!content.empty()) {
+            if (auto text = dynamic_cast<Text*>(elem.get())) text->content = content;
+            else if (auto generic = dynamic_cast<GenericElement*>(elem.get())) generic->content = content;
+        }
+
+        auto svg = dynamic_cast<SVG*>(elem.get());
+        for (uint32_t i = 0, n_children = this->read_u32(offset + 8); i < n_children; i++) {
+            Node child(this, pos);
+            const uint64_t bytes = child.subtree_bytes();
+            if (bytes == 0) throw std::runtime_error("Corrupt binary SVG");
+            pos += bytes;
+
+            if (child.tag() == util::StringView("style")) {
+                // Fill in the stylesheet every <svg> comes with, as the parser does
+                SVG::Style* style = (svg && svg->css && svg->css->css.empty() && svg->css->keyframes.empty()) ?
+                    svg->css : elem->add_child<SVG::Style>();
+                auto css = child.content();
+                util::parse_css(css.begin(), css.end(), style->css, &style->keyframes);
+                style->invalidate();
+                continue;
+            }
+
+            elem->children.push_back(this->load(child.offset));
+            elem->adopt_back();
+        }
+
+        return elem;
+    }
+
+    inline std::string to_binary(Element& root) {
+        /** Return the binary encoding of an element tree (see BinaryDocument) */
+        SVG_TRACE_SCOPE("to_binary");
+        std::stringstream ss;
+        BinaryDocument::write(ss, root);
+        return ss.str();
+    }
+
+    inline std::unique_ptr<Element> from_binary(const std::string& binary) {
+        /** Decode an element tree written by to_binary() */
+        SVG_TRACE_SCOPE("from_binary");
+        return BinaryDocument(binary.data(), binary.size()).load();
+    }
+
+    inline void build_parallel(Element& parent, const size_t n_parts,
+        const std::function<std::unique_ptr<Element>(const size_t)>& build,
+        unsigned int n_threads = std::thread::hardware_concurrency()) {
+        /** Build parts of a document concurrently and add them to parent in order
+         *
+         *  build(i) is called once for each i in [0, n_parts) from one of n_threads
+         *  threads, and should construct and return a new, detached subtree. Elements
+         *  are not synchronized, so build() must not touch parent or anything else
+         *  shared, but independent trees may be built freely. The results are then
+         *  adopted by parent in order of i, so the output does not depend on scheduling.
+         */
+        SVG_TRACE_SCOPE("build_parallel");
+        std::vector<std::unique_ptr<Element>> parts(n_parts);
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_lock;
+
+        auto worker = [&]() {
+            for (size_t i = next++; i < n_parts; i = next++) {
+                try {
+                    SVG_TRACE_SCOPE("build_parallel part");
+                    parts[i] = build(i);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(error_lock);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        n_threads = (unsigned int)std::min((size_t)std::max(n_threads, 1u), std::max(n_parts, (size_t)1));
+        for (unsigned int i = 1; i < n_threads; i++)
+            threads.push_back(std::thread(worker));
+        worker();
+        for (auto& thread : threads) thread.join();
+        if (error) std::rethrow_exception(error);
+
+        for (auto& part : parts)
+            if (part) parent.adopt(std::move(part));
+    }
+
+    /** @class AsyncFileBuf
+     *  @brief A file stream buffer which hands full buffers to a background thread
+     *
+     *  Whoever writes to the stream can keep formatting into the next buffer
+     *  while the previous one is written to disk. At most max_buffers buffers
+     *  exist at once (counting the one being filled), so a writer that gets too
+     *  far ahead of the disk blocks until a buffer is free.
+     */
+    class AsyncFileBuf : public std::streambuf {
+    public:
+        AsyncFileBuf(const std::string& filename, const size_t _buffer_size = 1 << 20, const size_t _max_buffers = 4);
+        AsyncFileBuf(const AsyncFileBuf&) = delete;
+        AsyncFileBuf& operator=(const AsyncFileBuf&) = delete;
+        ~AsyncFileBuf() { this->close(); }
+
+        bool is_open() const { return this->io_thread.joinable(); }
+        bool close();
+
+    protected:
+        int_type overflow(int_type ch) override;
+        int sync() override;
+
+    private:
+        std::ofstream file;
+        const size_t buffer_size;
+        const size_t max_buffers;
+
+        std::vector<char> current;                /**< Buffer being filled */
+        std::mutex lock;                          /**< Guards everything below */
+        std::condition_variable filled, emptied;
+        std::deque<std::vector<char>> pending;    /**< Full buffers, in order */
+        std::vector<std::vector<char>> spare;     /**< Written buffers ready for reuse */
+        bool writing = false;                     /**< Whether the I/O thread holds a buffer */
+        bool done = false;
+        bool failed = false;
+        std::thread io_thread;
+
+        void submit();
+        void run();
+    };
+
+    inline AsyncFileBuf::AsyncFileBuf(const std::string& filename, const size_t _buffer_size,
+        const size_t _max_buffers) : file(filename, std::ios::binary),
+        buffer_size(std::max(_buffer_size, (size_t)1)), max_buffers(std::max(_max_buffers, (size_t)2)) {
+        this->current.resize(this->buffer_size);
+        this->setp(this->current.data(), this->current.data() + this->current.size());
+        if (this->file) this->io_thread = std::thread(&AsyncFileBuf::run, this);
+        else this->failed = true;
+    }
+
+    inline bool AsyncFileBuf::close() {
+        /** Write out everything and stop the I/O thread, returning false if any write failed */
+        if (this->is_open()) {
+            this->submit();
+            {
+                std::lock_guard<std::mutex> guard(this->lock);
+                this->done = true;
+            }
+            this->filled.notify_one();
+            this->io_thread.join();
+            this->file.close();
+            if (!this->file) this->failed = true;
+            this->setp(nullptr, nullptr);
+        }
+
+        return !this->failed;
+    }
+
+    inline AsyncFileBuf::int_type AsyncFileBuf::overflow(int_type ch) {
+        if (!this->is_open()) return traits_type::eof();
+        this->submit();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *this->pptr() = traits_type::to_char_type(ch);
+            this->pbump(1);
+        }
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->failed ? traits_type::eof() : traits_type::not_eof(ch);
+    }
+
+    inline int AsyncFileBuf::sync() {
+        /** Hand off what has been written so far and wait until it reaches the file */
+        if (!this->is_open()) return -1;
+        this->submit();
+
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->emptied.wait(guard, [this] { return this->pending.empty() && !this->writing; });
+        this->file.flush();
+        if (!this->file) this->failed = true;
+        return this->failed ? -1 : 0;
+    }
+
+    inline void AsyncFileBuf::submit() {
+        /** Queue the current buffer for writing and start filling another */
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->current.resize(this->pptr() - this->pbase());
+        if (!this->current.empty()) {
+            // Count the buffer being written, those queued, this one and the next one to fill
+            this->emptied.wait(guard, [this] {
+                return this->pending.size() + this->writing + 2 <= this->max_buffers; });
+            this->pending.push_back(std::move(this->current));
+            this->filled.notify_one();
+
+            if (this->spare.empty()) this->current = std::vector<char>();
+            else {
+                this->current = std::move(this->spare.back());
+                this->spare.pop_back();
+            }
+        }
+        guard.unlock();
+
+        this->current.resize(this->buffer_size);
+        this->setp(this->current.data(), this->current.data() + this->current.size());
+    }
+
+    inline void AsyncFileBuf::run() {
+        /** Body of the I/O thread */
+        while (true) {
+            std::vector<char> buffer;
+            {
+                std::unique_lock<std::mutex> guard(this->lock);
+                this->filled.wait(guard, [this] { return !this->pending.empty() || this->done; });
+                if (this->pending.empty()) return;
+                buffer = std::move(this->pending.front());
+                this->pending.pop_front();
+                this->writing = true;
+            }
+
+            this->file.write(buffer.data(), buffer.size());
+            buffer.clear();
+
+            {
+                std::lock_guard<std::mutex> guard(this->lock);
+                if (!this->file) this->failed = true;
+                this->spare.push_back(std::move(buffer));
+                this->writing = false;
+            }
+            this->emptied.notify_all();
+        }
+    }
+
+    /** @class AsyncFileWriter
+     *  @brief An output file stream which writes in the background (see AsyncFileBuf)
+     *
+     *  Elements are written out as they are formatted, so formatting overlaps
+     *  with I/O unless SerializeOptions::cache is set:
+     *
+     *      SVG::AsyncFileWriter out("drawing.svg");
+     *      out << root;
+     *      out.close();
+     */
+    class AsyncFileWriter : public std::ostream {
+    public:
+        AsyncFileWriter(const std::string& filename, const size_t buffer_size = 1 << 20, const size_t max_buffers = 4) :
+            std::ostream(nullptr), buf(filename, buffer_size, max_buffers) {
+            this->init(&this->buf);
+            if (!this->buf.is_open()) this->setstate(std::ios::failbit);
+        }
+
+        bool close() {
+            /** Finish writing, returning false (and setting badbit) if anything failed */
+            if (!this->buf.close()) this->setstate(std::ios::badbit);
+            return !this->bad() && !this->fail();
+        }
+
+    private:
+        AsyncFileBuf buf;
+    };
+
+    /** @class GatherWriter
+     *  @brief Writes a document to a file straight from its cached fragments
+     *
+     *  Serializing normally copies every child's cached output into its
+     *  parent's, so after a small change the whole document is copied again
+     *  (once per level) before being written. Instead, write() walks down to
+     *  the subtrees whose cached output is still valid and queues references to
+     *  those strings, formatting only the tags of the stale elements above them.
+     *  On POSIX systems the fragments are handed to the kernel in batches with
+     *  writev(), so cached output is never copied in user space. Fragments
+     *  shorter than COPY_THRESHOLD are cheaper to copy than to pass separately,
+     *  so runs of them are gathered into one buffer.
+     *
+     *  Like serializing with SerializeOptions::cache, this fills the output
+     *  caches, so changes made through attr directly must be followed by
+     *  invalidate(). Queued fragments point into the document, which must not
+     *  change until the next flush() or close().
+     */
+    class GatherWriter {
+    public:
+        enum : size_t { COPY_THRESHOLD = 256 };
+
+        GatherWriter(const std::string& filename);
+        GatherWriter(const GatherWriter&) = delete;
+        GatherWriter& operator=(const GatherWriter&) = delete;
+        ~GatherWriter() { this->close(); }
+
+        bool is_open() const;
+        void add(const char* data, const size_t size);
+        void add(std::string text);
+        void write(Element& root);
+        bool flush();
+        bool close();
+
+        size_t bytes_written() const { return this->written; }
+        size_t fragments_written() const { return this->n_fragments; }
+
+    private:
+        struct Fragment {
+            const char* data;
+            size_t size;
+        };
+
+        std::vector<Fragment> fragments;
+        std::deque<std::string> owned; /**< Text copied for this batch (a deque, so it never moves) */
+        std::string small;             /**< Short fragments not yet added to owned */
+        size_t queued = 0;             /**< Bytes added since the last flush */
+        size_t written = 0;
+        size_t n_fragments = 0;
+        bool failed = false;
+#ifdef _WIN32
+        std::ofstream file;
+#else
+        int fd = -1;
+#endif
+
+        void write(Element& elem, const size_t indent_level);
+        void end_small();
+    };
+
+    inline GatherWriter::GatherWriter(const std::string& filename) {
+#ifdef _WIN32
+        this->file.open(filename, std::ios::binary);
+        this->failed = !this->file;
+#else
+        this->fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        this->failed = this->fd < 0;
+#endif
+    }
+
+    inline bool GatherWriter::is_open() const {
+#ifdef _WIN32
+        return this->file.is_open();
+#else
+        return this->fd >= 0;
+#endif
+    }
 
-        for (auto& child : this->children) { temp.push_back(child.get()); }
-        while (!temp.empty()) {
-            ret.push_back(temp.front());
-            for (auto& child : temp.front()->children) { temp.push_back(child.get()); }
-            temp.pop_front();
+    inline void GatherWriter::add(const char* data, const size_t size) {
+        /** Queue a reference to text which will stay alive until the next flush() */
+        this->queued += size;
+        if (size < COPY_THRESHOLD) {
+            this->small.append(data, size);
+            return;
         }
 
-        return ret;
+        this->end_small();
+        this->fragments.push_back({ data, size });
+    }
+
+    inline void GatherWriter::add(std::string text) {
+        /** Queue a copy of some text */
+        if (text.size() < COPY_THRESHOLD) {
+            this->add(text.data(), text.size());
+            return;
+        }
+
+        this->end_small();
+        this->queued += text.size();
+        this->owned.push_back(std::move(text));
+        this->fragments.push_back({ this->owned.back().data(), this->owned.back().size() });
+    }
+
+    inline void GatherWriter::end_small() {
+        /** Turn the short fragments added so far into one fragment */
+        if (this->small.empty()) return;
+        this->owned.push_back(std::move(this->small));
+        this->small.clear();
+        this->fragments.push_back({ this->owned.back().data(), this->owned.back().size() });
+    }
+
+    inline void GatherWriter::write(Element& root) {
+        /** Queue the fragments making up root's serialized form (identical to std::string(root)) */
+        this->write(root, 0);
+    }
+
+    inline void GatherWriter::write(Element& elem, const size_t indent_level) {
+        const bool cached = elem.output_valid && elem.output_indent == indent_level;
+
+        // Elements with custom output (or without children) are formatted whole
+        if (cached || !elem.default_layout() || elem.children.empty()) {
+            auto& output = elem.cached_output(indent_level);
+            this->add(output.data(), output.size());
+            return;
+        }
+
+        // Same layout as Element::write_element()
+        std::stringstream tag;
+        elem.svg_open_tag(tag, indent_level, false);
+        tag << "\n";
+        this->add(tag.str());
+
+        for (auto& child : elem.children) {
+            // Children without any output don't get a line either
+            const size_t before = this->queued;
+            this->write(*child, indent_level + 1);
+            if (this->queued > before) this->add("\n", 1);
+        }
+
+        tag.str("");
+        elem.svg_close_tag(tag, indent_level);
+        this->add(tag.str());
+    }
+
+    inline bool GatherWriter::flush() {
+        /** Write out every queued fragment, returning false if anything failed */
+        this->end_small();
+        if (!this->failed) {
+#ifdef _WIN32
+            for (auto& fragment : this->fragments)
+                this->file.write(fragment.data, fragment.size);
+            this->failed = !this->file;
+#else
+            const size_t batch_size = IOV_MAX < 1024 ? IOV_MAX : 1024;
+            std::vector<iovec> batch;
+            for (size_t i = 0; i < this->fragments.size() && !this->failed; ) {
+                batch.clear();
+                for (; i < this->fragments.size() && batch.size() < batch_size; i++)
+                    batch.push_back({ (void*)this->fragments[i].data, this->fragments[i].size });
+
+                // Retry partial writes from wherever the kernel stopped
+                iovec* next = batch.data();
+                int remaining = (int)batch.size();
+                while (remaining > 0) {
+                    const ssize_t n = ::writev(this->fd, next, remaining);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        this->failed = true;
+                        break;
+                    }
+
+                    size_t left = (size_t)n;
+                    while (remaining > 0 && left >= next->iov_len) {
+                        left -= next->iov_len;
+                        next++;
+                        remaining--;
+                    }
+                    if (remaining > 0) {
+                        next->iov_base = (char*)next->iov_base + left;
+                        next->iov_len -= left;
+                    }
+                }
+            }
+#endif
+        }
+
+        if (!this->failed) {
+            this->written += this->queued;
+            this->n_fragments += this->fragments.size();
+        }
+        this->fragments.clear();
+        this->owned.clear();
+        this->queued = 0;
+        return !this->failed;
+    }
+
+    inline bool GatherWriter::close() {
+        /** Flush and close the file, returning false if anything failed */
+        if (!this->is_open()) return !this->failed;
+        this->flush();
+#ifdef _WIN32
+        this->file.close();
+        if (!this->file) this->failed = true;
+#else
+        if (::close(this->fd) != 0) this->failed = true;
+        this->fd = -1;
+#endif
+        return !this->failed;
+    }
+
+    /** @class MappedWriter
+     *  @brief Writes documents straight into a memory-mapped file
+     *
+     *  The exact length of the output is known up front from serialized_size(),
+     *  so the file is grown to size, mapped, and formatted into without any
+     *  intermediate buffers or write() calls. Large subtrees are laid out at
+     *  their final offsets and formatted concurrently by n_threads threads,
+     *  while the tags above them are written by the calling thread.
+     *
+     *  If a document's output turns out to differ from its predicted size,
+     *  e.g. because a user-defined class writes something different each
+     *  time, it is formatted into memory and written the ordinary way instead.
+     *
+     *  Elements are not synchronized, so the document must not change during
+     *  write(). With options.cache set, subtrees which are already cached are
+     *  copied from the cache, but elements which are split up between threads
+     *  don't get cached themselves.
+     */
+    class MappedWriter {
+    public:
+        MappedWriter(const std::string& filename,
+            unsigned int _n_threads = std::thread::hardware_concurrency());
+        MappedWriter(const MappedWriter&) = delete;
+        MappedWriter& operator=(const MappedWriter&) = delete;
+        ~MappedWriter() { this->close(); }
+
+        bool is_open() const;
+        bool write(Element& root);
+        bool write(Element& root, const SerializeOptions& options);
+        bool close();
+
+        size_t bytes_written() const { return this->written; }
+
+    private:
+        /** Consecutive sibling subtrees to be formatted into their own region of the mapping */
+        struct Job {
+            std::vector<Element*> elems;
+            size_t indent_level;
+            const SerializeOptions* options;
+            char* dest;
+            size_t size;
+            bool newlines; /**< Whether each element is followed by a newline */
+        };
+
+        void plan(Element& elem, const size_t indent_level, const SerializeOptions& options,
+            const SerializeOptions& uncull, util::SpanBuf& buffer, std::ostream& out,
+            const size_t grain, const bool newline);
+#ifndef _WIN32
+        bool write_buffered(Element& root, const SerializeOptions& options);
+#endif
+
+        std::vector<Job> jobs;
+        unsigned int n_threads;
+        size_t written = 0;
+        bool failed = false;
+#ifdef _WIN32
+        std::ofstream file;
+#else
+        int fd = -1;
+#endif
+    };
+
+    inline MappedWriter::MappedWriter(const std::string& filename, unsigned int _n_threads) :
+        n_threads(std::max(_n_threads, 1u)) {
+#ifdef _WIN32
+        this->file.open(filename, std::ios::binary);
+        this->failed = !this->file;
+#else
+        // Writable shared mappings need read access too
+        this->fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        this->failed = this->fd < 0;
+#endif
+    }
+
+    inline bool MappedWriter::is_open() const {
+#ifdef _WIN32
+        return this->file.is_open();
+#else
+        return this->fd >= 0;
+#endif
+    }
+
+    inline bool MappedWriter::write(Element& root) {
+        /** Append root's serialized form (identical to std::string(root)) to the file */
+        return this->write(root, SerializeOptions());
+    }
+
+    inline bool MappedWriter::write(Element& root, const SerializeOptions& options) {
+        /** Append root's serialized form to the file, returning false if anything failed */
+        SVG_TRACE_SCOPE("MappedWriter::write");
+        if (this->failed || !this->is_open()) return false;
+
+#ifdef _WIN32
+        root.serialize(this->file, options);
+        this->failed = !this->file;
+        if (!this->failed) this->written = (size_t)this->file.tellp();
+        return !this->failed;
+#else
+        const size_t size = root.serialized_size(options);
+        if (size == 0) return true;
+
+        const size_t offset = this->written,
+            page_size = (size_t)sysconf(_SC_PAGESIZE),
+            map_start = offset / page_size * page_size,
+            map_size = offset + size - map_start;
+        if (::ftruncate(this->fd, (off_t)(offset + size)) != 0) {
+            this->failed = true;
+            return false;
+        }
+
+#ifdef MAP_POPULATE
+        const int flags = MAP_SHARED | MAP_POPULATE; // Fault every page in at once
+#else
+        const int flags = MAP_SHARED;
+#endif
+        void* mapping = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, flags, this->fd, (off_t)map_start);
+        if (mapping == MAP_FAILED) {
+            this->failed = true;
+            return false;
+        }
+
+        // Lay out the subtrees, writing the tags in between
+        char* begin = (char*)mapping + (offset - map_start);
+        util::SpanBuf buffer(begin, begin + size);
+        std::ostream out(&buffer);
+        SerializeOptions uncull = options;
+        uncull.cull = false;
+
+        const size_t grain = std::max(size / (this->n_threads * 8), (size_t)1 << 16);
+        this->jobs.clear();
+        this->plan(root, 0, options, uncull, buffer, out, grain, false);
+        bool success = out && buffer.size() == size;
+
+        // Then format the subtrees into place, each claiming the next unclaimed job
+        std::atomic<size_t> next(0);
+        std::atomic<bool> ok(success);
+        auto worker = [&]() {
+            for (size_t i = next++; i < this->jobs.size(); i = next++) {
+                SVG_TRACE_SCOPE("MappedWriter::write part");
+                const Job& job = this->jobs[i];
+                util::SpanBuf part(job.dest, job.dest + job.size);
+                std::ostream part_out(&part);
+                try {
+                    for (Element* elem : job.elems) {
+                        if (Element::use_cache(*job.options)) {
+                            auto& output = elem->cached_output(job.indent_level);
+                            part_out.write(output.data(), output.size());
+                        }
+                        else elem->svg_to_stream(part_out, job.indent_level, *job.options);
+                        if (job.newlines) part_out << "\n";
+                    }
+                }
+                catch (...) {
+                    ok = false;
+                }
+
+                if (!part_out || part.size() != job.size) ok = false;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        const size_t n_workers = std::min((size_t)this->n_threads, this->jobs.size());
+        for (size_t i = 1; i < n_workers; i++)
+            threads.push_back(std::thread(worker));
+        worker();
+        for (auto& thread : threads) thread.join();
+        this->jobs.clear();
+
+        if (munmap(mapping, map_size) != 0) {
+            // Don't leave a partially written document behind, so later writes can still succeed
+            this->failed = ::ftruncate(this->fd, (off_t)offset) != 0;
+            return false;
+        }
+        if (!ok) return this->write_buffered(root, options);
+
+        metrics::add(metrics::SERIALIZED_BYTES, size);
+        this->written += size;
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    inline bool MappedWriter::write_buffered(Element& root, const SerializeOptions& options) {
+        /** Format root into memory and write it over whatever follows the
+         *  documents written so far
+         */
+        std::string text;
+        bool success = true;
+        try {
+            text = root.serialize(options);
+        }
+        catch (...) {
+            success = false;
+        }
+
+        success = success && ::ftruncate(this->fd, (off_t)(this->written + text.size())) == 0;
+        for (size_t done = 0; success && done < text.size(); ) {
+            const ssize_t n = ::pwrite(this->fd, text.data() + done, text.size() - done, (off_t)(this->written + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) success = false;
+            else done += (size_t)n;
+        }
+
+        if (!success) {
+            // Don't leave a partially written document behind, so later writes can still succeed
+            this->failed = ::ftruncate(this->fd, (off_t)this->written) != 0;
+            return false;
+        }
+
+        metrics::add(metrics::SERIALIZED_BYTES, text.size());
+        this->written += text.size();
+        return true;
+    }
+#endif
+
+    inline void MappedWriter::plan(Element& elem, const size_t indent_level, const SerializeOptions& options,
+        const SerializeOptions& uncull, util::SpanBuf& buffer, std::ostream& out,
+        const size_t grain, const bool newline) {
+        /** Write the tags of elements too large for one job, and leave room for the rest
+         *
+         *  @param[in] newline Whether elem is followed by a newline
+         */
+        const size_t size = elem.subtree_size(options).at(indent_level) + (newline ? 1 : 0);
+        const bool cached = Element::use_cache(options) && elem.output_valid && elem.output_indent == indent_level;
+        if (size <= grain || cached || !elem.default_layout() || elem.children.empty()) {
+            // Add to the previous job if it's for the preceding siblings, and still small
+            Job* last = this->jobs.empty() ? nullptr : &this->jobs.back();
+            if (last && newline && last->newlines && last->indent_level == indent_level &&
+                last->options == &options && last->dest + last->size == buffer.position() &&
+                last->size + size <= grain) {
+                last->elems.push_back(&elem);
+                last->size += size;
+            }
+            else this->jobs.push_back({ { &elem }, indent_level, &options, buffer.position(), size, newline });
+
+            buffer.skip(size);
+            return;
+        }
+
+        // Same layout as Element::write_element()
+        elem.svg_open_tag(out, indent_level, false);
+        out << "\n";
+        for (auto& child : elem.children) {
+            if (child->empty_output() || child->outside(options)) continue;
+
+            bool nested = options.cull && child->own_coordinates();
+            this->plan(*child, indent_level + 1, nested ? uncull : options, uncull, buffer, out, grain, true);
+        }
+        elem.svg_close_tag(out, indent_level);
+        if (newline) out << "\n";
+    }
+
+    inline bool MappedWriter::close() {
+        /** Close the file, returning false if anything failed */
+        if (!this->is_open()) return !this->failed;
+#ifdef _WIN32
+        this->file.close();
+        if (!this->file) this->failed = true;
+#else
+        if (::close(this->fd) != 0) this->failed = true;
+        this->fd = -1;
+#endif
+        return !this->failed;
+    }
+
+    /** @class IncrementalWriter
+     *  @brief Writes documents to files, skipping those which haven't changed
+     *         since they were last written
+     *
+     *  A manifest records the hash and size of every file written. If a
+     *  document's hash matches the recorded one and its file still has the
+     *  recorded size, nothing is written. By default, documents are hashed as
+     *  they're serialized, so edits made any way at all are picked up.
+     *
+     *  Passing hash_output = false hashes trees with subtree_hash() instead, which
+     *  needs no formatting and only revisits subtrees changed since the last call.
+     *  Its hashes are cached, so callers must invalidate() elements after
+     *  modifying their attr (or a stylesheet's css) directly, and user-defined
+     *  classes must not output more than their tag, attributes, and own_content().
+     *
+     *  The manifest is only read from and saved to disk if a filename is given,
+     *  in which case it is saved on destruction.
+     */
+    class IncrementalWriter {
+    public:
+        IncrementalWriter(const std::string& _manifest = "", const bool _hash_output = true);
+        IncrementalWriter(const IncrementalWriter&) = delete;
+        IncrementalWriter& operator=(const IncrementalWriter&) = delete;
+        ~IncrementalWriter() { this->save(); }
+
+        bool write(Element& root, const std::string& filename);
+        bool unchanged(Element& root, const std::string& filename);
+        bool save();
+
+        size_t files_written() const { return this->n_written; }
+        size_t files_skipped() const { return this->n_skipped; }
+
+    private:
+        struct Entry {
+            uint64_t hash;
+            size_t size;
+        };
+
+        uint64_t hash(Element& root);
+        bool unchanged(const uint64_t hash, const std::string& filename);
+
+        std::map<std::string, Entry> entries; /**< Hash and size of each file, by filename */
+        std::string manifest;
+        bool hash_output;
+        bool modified = false;
+        size_t n_written = 0;
+        size_t n_skipped = 0;
+    };
+
+    inline IncrementalWriter::IncrementalWriter(const std::string& _manifest, const bool _hash_output) :
+        manifest(_manifest), hash_output(_hash_output) {
+        /** Load the hashes recorded by a previous run, if any
+         *
+         *  @param[in] _manifest    File to keep the hashes in, one "hash size filename" per line
+         *  @param[in] _hash_output Hash documents' serialized form rather than their
+         *                         (cached) trees
+         */
+        if (this->manifest.empty()) return;
+        std::ifstream infile(this->manifest, std::ios::binary);
+        std::string line;
+        while (std::getline(infile, line)) {
+            std::istringstream fields(line);
+            Entry entry;
+            std::string filename;
+            if (fields >> std::hex >> entry.hash >> std::dec >> entry.size && fields.get() == ' ' &&
+                std::getline(fields, filename) && !filename.empty())
+                this->entries[filename] = entry;
+        }
+    }
+
+    inline uint64_t IncrementalWriter::hash(Element& root) {
+        return this->hash_output ? root.output_hash(SerializeOptions()) : root.subtree_hash();
+    }
+
+    inline bool IncrementalWriter::unchanged(Element& root, const std::string& filename) {
+        /** Return true if filename was last written with an identical document */
+        return this->unchanged(this->hash(root), filename);
+    }
+
+    inline bool IncrementalWriter::unchanged(const uint64_t hash, const std::string& filename) {
+        auto entry = this->entries.find(filename);
+        if (entry == this->entries.end() || entry->second.hash != hash) return false;
+
+        // Catch files which were deleted or truncated since
+        std::ifstream infile(filename, std::ios::binary | std::ios::ate);
+        return infile && (size_t)infile.tellg() == entry->second.size;
+    }
+
+    inline bool IncrementalWriter::write(Element& root, const std::string& filename) {
+        /** Write root to filename unless it's unchanged since the last time
+         *
+         *  @return Whether the file was written
+         *  @throws std::runtime_error if the file could not be written
+         */
+        SVG_TRACE_SCOPE("IncrementalWriter::write");
+        const uint64_t hash = this->hash(root);
+        if (this->unchanged(hash, filename)) {
+            this->n_skipped++;
+            return false;
+        }
+
+        std::ofstream outfile(filename, std::ios::binary);
+        outfile << root;
+        const size_t size = outfile ? (size_t)outfile.tellp() : 0;
+        outfile.close();
+        if (!outfile) {
+            this->entries.erase(filename);
+            throw std::runtime_error("Could not write " + filename);
+        }
+
+        this->entries[filename] = { hash, size };
+        this->modified = true;
+        this->n_written++;
+        return true;
+    }
+
+    inline bool IncrementalWriter::save() {
+        /** Write the manifest if anything changed, replacing it at once so a partial
+         *  manifest is never read
+         */
+        if (this->manifest.empty() || !this->modified) return true;
+        const std::string temp = this->manifest + ".tmp";
+        {
+            std::ofstream outfile(temp, std::ios::binary);
+            for (auto& entry : this->entries)
+                outfile << std::hex << entry.second.hash << std::dec << " " << entry.second.size
+                    << " " << entry.first << "\n";
+            if (!outfile) return false;
+        }
+        std::remove(this->manifest.c_str()); // rename() doesn't replace files on Windows
+        if (std::rename(temp.c_str(), this->manifest.c_str()) != 0) return false;
+        this->modified = false;
+        return true;
+    }
+
+    /** @class ChunkedSerializer
+     *  @brief Produces a document's serialized form a piece at a time, on demand
+     *
+     *  Nothing is written until asked for, and each call does only as much
+     *  work as is needed to fill the requested chunk, so output can be
+     *  interleaved with other work (e.g. in an event loop) without blocking.
+     *  The serializer keeps its position as a stack of (element, next child)
+     *  frames. Subtrees cached earlier (see SerializeOptions::cache) are
+     *  copied straight from their caches, and
+     *  anything else is formatted one element at a time, without filling the
+     *  caches. The output is identical to std::string(root).
+     *
+     *  The document must not change until the serializer is done.
+     */
+    class ChunkedSerializer {
+    public:
+        ChunkedSerializer(Element& root, const size_t _chunk_size = 1 << 16);
+        ChunkedSerializer(const ChunkedSerializer&) = delete;
+        ChunkedSerializer& operator=(const ChunkedSerializer&) = delete;
+
+        bool done() const {
+            return this->started && this->stack.empty() && !this->ref &&
+                this->pending_pos == this->pending.size();
+        }
+
+        size_t read(char* buffer, const size_t size);
+        bool next(std::string& chunk);
+
+    private:
+        struct Frame {
+            Element* elem;
+            size_t indent_level;
+            size_t next_child;
+        };
+
+        /** A std::streambuf which appends to pending, so formatting doesn't allocate a new string each time */
+        class Appender : public std::streambuf {
+        public:
+            Appender(std::string& _target) : target(_target) {};
+        protected:
+            int_type overflow(int_type ch) override {
+                if (!traits_type::eq_int_type(ch, traits_type::eof()))
+                    this->target.push_back(traits_type::to_char_type(ch));
+                return traits_type::not_eof(ch);
+            }
+            std::streamsize xsputn(const char* data, std::streamsize n) override {
+                this->target.append(data, (size_t)n);
+                return n;
+            }
+        private:
+            std::string& target;
+        };
+
+        Element* root;
+        size_t chunk_size;
+        bool started = false;
+        std::vector<Frame> stack;
+        const std::string* ref = nullptr; /**< Cached output being copied out */
+        size_t ref_pos = 0;
+        std::string pending;              /**< Formatted text waiting to be copied out (after ref) */
+        size_t pending_pos = 0;
+        Appender appender;
+        std::ostream out;
+        SerializeOptions options;
+
+        bool enter(Element& elem, const size_t indent_level);
+        void advance();
     };
 
+    inline ChunkedSerializer::ChunkedSerializer(Element& _root, const size_t _chunk_size) :
+        root(&_root), chunk_size(std::max(_chunk_size, (size_t)1)), appender(pending), out(&appender) {}
+
+    inline size_t ChunkedSerializer::read(char* buffer, const size_t size) {
+        /** Fill buffer with up to size bytes of output, returning how many were
+         *  written. Only returns less than size at the end of the document.
+         */
+        size_t written = 0;
+        while (written < size) {
+            if (this->ref) {
+                const size_t n = std::min(size - written, this->ref->size() - this->ref_pos);
+                memcpy(buffer + written, this->ref->data() + this->ref_pos, n);
+                written += n;
+                this->ref_pos += n;
+                if (this->ref_pos == this->ref->size()) this->ref = nullptr;
+            }
+            else if (this->pending_pos < this->pending.size()) {
+                const size_t n = std::min(size - written, this->pending.size() - this->pending_pos);
+                memcpy(buffer + written, this->pending.data() + this->pending_pos, n);
+                written += n;
+                this->pending_pos += n;
+            }
+            else if (this->done()) break;
+            else {
+                this->pending.clear();
+                this->pending_pos = 0;
+                this->advance();
+            }
+        }
+
+        return written;
+    }
+
+    inline bool ChunkedSerializer::next(std::string& chunk) {
+        /** Replace chunk with the next chunk_size (or fewer) bytes, returning false at the end */
+        chunk.resize(this->chunk_size);
+        chunk.resize(this->read(&chunk[0], this->chunk_size));
+        return !chunk.empty();
+    }
+
+    inline bool ChunkedSerializer::enter(Element& elem, const size_t indent_level) {
+        /** Start writing an element, returning false if it has no output at all */
+        if (elem.output_valid && elem.output_indent == indent_level) {
+            if (elem.output_cache.empty()) return false;
+            this->ref = &elem.output_cache;
+            this->ref_pos = 0;
+            return true;
+        }
+
+        // Only expand elements laid out as start tag, children, end tag
+        auto generic = elem.kind() == ElementKind::Generic ? static_cast<GenericElement*>(&elem) : nullptr;
+        if (elem.children.empty() || !(elem.default_layout() || generic)) {
+            const size_t before = this->pending.size();
+            if (!elem.empty_output()) elem.svg_to_stream(this->out, indent_level, this->options);
+            return this->pending.size() > before;
+        }
+
+        elem.svg_open_tag(this->out, indent_level, false);
+        if (generic) this->out << generic->content;
+        this->out << "\n";
+        this->stack.push_back({ &elem, indent_level, 0 });
+        return true;
+    }
+
+    inline void ChunkedSerializer::advance() {
+        /** Queue the next piece of output: one start tag, end tag or leaf element */
+        if (!this->started) {
+            this->started = true;
+            this->enter(*this->root, 0);
+            return;
+        }
+
+        while (!this->stack.empty()) {
+            Frame& frame = this->stack.back();
+            if (frame.next_child == frame.elem->children.size()) {
+                frame.elem->svg_close_tag(this->out, frame.indent_level);
+                this->stack.pop_back();
+                if (!this->stack.empty()) this->out << "\n";
+                return;
+            }
+
+            Element& child = *frame.elem->children[frame.next_child++];
+            const size_t depth = this->stack.size();
+            if (this->enter(child, frame.indent_level + 1)) {
+                // Expanded children get their newline after their end tag
+                if (this->stack.size() == depth) this->out << "\n";
+                return;
+            }
+        }
+    }
+
     inline SVG merge(SVG& left, SVG& right, const Margins& margins) {
         /** Merge two SVG documents together horizontally with a uniform margin */
+        SVG_TRACE_SCOPE("merge");
+        metrics::Timer timer(metrics::MERGE);
         SVG ret;
 
         // Move items
@@ -828,6 +6652,7 @@ namespace SVG {
         /* Convert shapes into sets of points, aggregate them, and then calculate
          * convex hull for aggregate set
          */
+        SVG_TRACE_SCOPE("bounding_polygon");
         std::vector<Point> points;
         for (auto& shp : shapes) {
             auto temp_points = shp->points();
@@ -841,6 +6666,8 @@ namespace SVG {
         /** Given a vector of SVGs, merge them together
          *  max_frame_width: Maximum width of any individual frame
          */
+        SVG_TRACE_SCOPE("merge");
+        metrics::Timer timer(metrics::MERGE);
         SVG root;
         double x = 0, y = 0, total_width = 0, total_height = 0;
         for (auto& frame : frames) {
@@ -884,6 +6711,8 @@ namespace SVG {
          *  @param[in]  A vector of frames (SVGs)
          *  @param[out] fps Numbers of frames per second
          */
+        SVG_TRACE_SCOPE("frame_animate");
+        metrics::Timer timer(metrics::FRAME_ANIMATE);
         SVG root;
         const double duration = (double)frames.size() / fps; // [seconds]
         const double frame_step = 1.0 / fps; // duration of each frame [seconds]
@@ -931,4 +6760,376 @@ namespace SVG {
 
         return root;
     }
-}
\ No newline at end of file
+
+    /** @class AnimationWriter
+     *  @brief Streams a frame-by-frame animation to an output stream
+     *
+     *  Unlike frame_animate(), which needs every frame in memory at once, each
+     *  frame is serialized as soon as it is pushed and can be freed right after.
+     *  Because the stylesheet precedes the frames, the number of frames and the
+     *  size of the viewBox have to be known up front, and exactly that many
+     *  frames must be pushed.
+     */
+    class AnimationWriter {
+    public:
+        AnimationWriter(std::ostream& _out, const size_t _n_frames, const double fps,
+            const double _width, const double _height);
+        ~AnimationWriter() {
+            try { this->finish(); }
+            catch (const std::runtime_error&) {} // Missing frames can't be reported here
+        }
+
+        AnimationWriter& push(SVG&& frame);
+        AnimationWriter& operator<<(SVG&& frame) { return this->push(std::move(frame)); }
+        void finish();
+
+        size_t frames_written() const { return this->current_frame; }
+
+    private:
+        std::ostream& out;
+        size_t n_frames;
+        size_t current_frame = 0;
+        double width;
+        double height;
+        bool finished = false;
+    };
+
+    inline AnimationWriter::AnimationWriter(std::ostream& _out, const size_t _n_frames, const double fps,
+        const double _width, const double _height) :
+        out(_out), n_frames(_n_frames), width(_width), height(_height) {
+        /** Write the root <svg> tag and the complete animation stylesheet
+         *
+         *  @param[in] _out      Stream to write the animation to
+         *  @param[in] _n_frames Number of frames that will be pushed
+         *  @param[in] fps       Numbers of frames per second
+         *  @param[in] _width    Width of the viewBox frames are centered in
+         *  @param[in] _height   Height of the viewBox frames are centered in
+         */
+        const double duration = (double)n_frames / fps; // [seconds]
+        SVG root;
+        root.set_attr("viewBox", "0 0 " + std::to_string(width) + " " + std::to_string(height));
+        root.svg_open_tag(out, 0, false);
+        out << "\n\t<style type=\"text/css\">\n\t\t<![CDATA[\n";
+
+        SelectorProperties css;
+        css["svg.animated"].set_attr("animation-iteration-count", "infinite")
+            .set_attr("animation-timing-function", "step-end")
+            .set_attr("animation-duration", std::to_string(duration) + "s")
+            .set_attr("opacity", 0);
+        css_to_stream(out, css, 1);
+
+        // One rule and one set of keyframes per frame, written without keeping them around
+        for (size_t i = 0; i < n_frames; i++) {
+            css.clear();
+            css["#frame_" + std::to_string(i)].set_attr("animation-name", "anim_" + std::to_string(i));
+            css_to_stream(out, css, 1);
+        }
+
+        for (size_t i = 0; i < n_frames; i++) {
+            double begin_pct = (double)i / n_frames,
+                end_pct = (double)(i + 1) / n_frames;
+            SelectorProperties anim;
+            anim["0%"].set_attr("opacity", 0);
+            anim[std::to_string(begin_pct * 100) + "%"].set_attr("opacity", 1);
+            anim[std::to_string(end_pct * 100) + "%"].set_attr("opacity", 0);
+
+            out << "\t\t\t@keyframes anim_" << i << " {\n";
+            css_to_stream(out, anim, 2);
+            out << "\t\t\t}\n";
+        }
+
+        out << "\t\t]]>\n\t</style>\n";
+    }
+
+    inline AnimationWriter& AnimationWriter::push(SVG&& frame) {
+        /** Scale, center, and write out the next frame */
+        SVG_TRACE_SCOPE("AnimationWriter::push");
+        if (this->finished || this->current_frame >= this->n_frames)
+            throw std::runtime_error("AnimationWriter: more frames pushed than were declared");
+
+        frame.autoscale();
+        frame.set_attr("id", "frame_" + std::to_string(this->current_frame))
+            .set_attr("class", "animated")
+            .set_attr("x", (this->width - frame.width()) / 2)
+            .set_attr("y", (this->height - frame.height()) / 2);
+
+        frame.svg_to_stream(this->out, 1, SerializeOptions());
+        this->out << "\n";
+        this->current_frame++;
+        return *this;
+    }
+
+    inline void AnimationWriter::finish() {
+        /** Close the root <svg> tag. Called automatically on destruction.
+         *
+         *  @throws std::runtime_error if fewer frames were pushed than declared, as the
+         *          stylesheet then animates frames which don't exist
+         */
+        SVG_TRACE_SCOPE("AnimationWriter::finish");
+        if (this->finished) return;
+        this->out << "</svg>";
+        this->out.flush();
+        this->finished = true;
+
+        if (this->current_frame != this->n_frames)
+            throw std::runtime_error("AnimationWriter: " + std::to_string(this->current_frame) +
+                " of " + std::to_string(this->n_frames) + " frames were pushed");
+    }
+
+    inline void frame_animate(std::ostream& out, const size_t n_frames, const double fps,
+        const double width, const double height, const std::function<SVG(const size_t)>& generator) {
+        /** Streaming version of frame_animate() which pulls frames from a generator
+         *
+         *  @param[in] generator Called with the index of each frame, in order
+         */
+        metrics::Timer timer(metrics::FRAME_ANIMATE);
+        AnimationWriter writer(out, n_frames, fps, width, height);
+        for (size_t i = 0; i < n_frames; i++)
+            writer.push(generator(i));
+        writer.finish();
+    }
+
+    /** @class StreamingBuilder
+     *  @brief Writes a document to a stream as it is built
+     *
+     *  Instead of growing a tree and serializing it at the end, scopes such as
+     *  groups are opened and closed around a stream of elements, and every
+     *  pushed element is written out right away and can be freed. Only the open
+     *  scopes are kept, so memory use grows with the depth of the document
+     *  rather than its size. Apart from where the root's size attributes go,
+     *  the output is identical to building the same tree and converting it to
+     *  a string.
+     *
+     *  Because the root <svg> tag comes first, anything that has to precede the
+     *  drawing (such as CSS rules in root.style()) must be set up before the
+     *  root is handed over. When autoscaling, the bounding box is tracked as
+     *  elements are pushed and finish() goes back to fill in the width, height,
+     *  and viewBox of the root, which requires a seekable stream like a file.
+     *
+     *  @code
+     *  SVG::SVG root;
+     *  root.style("circle").set_attr("fill", "red");
+     *  std::ofstream outfile("drawing.svg");
+     *  SVG::StreamingBuilder builder(outfile, std::move(root));
+     *  builder.open(SVG::Group());
+     *  for (auto& pt : points) builder << SVG::Circle(pt.first, pt.second, 1);
+     *  builder.close();
+     *  builder.finish();
+     *  @endcode
+     */
+    class StreamingBuilder {
+    public:
+        StreamingBuilder(std::ostream& _out, SVG&& root=SVG(), const bool _autoscale=true,
+            const Margins& _margins=DEFAULT_MARGINS);
+        ~StreamingBuilder() { this->finish(); }
+
+        template<typename T> StreamingBuilder& open(T&& scope);
+        template<typename T> StreamingBuilder& push(T&& elem);
+        template<typename T> StreamingBuilder& operator<<(T&& elem) { return this->push(std::forward<T>(elem)); }
+        StreamingBuilder& close();
+        bool finish();
+
+        size_t depth() const { return this->scopes.size() - 1; } /**< Number of scopes open below the root */
+        size_t elements_written() const { return this->n_elements; }
+        Element::BoundingBox bbox() const { return this->scopes.front().bbox; } /**< Bounding box of everything so far */
+
+    private:
+        /** Room reserved after the root's ">" for its width, height, and viewBox attributes */
+        enum { PLACEHOLDER_SIZE = 128 };
+
+        struct Scope {
+            std::unique_ptr<Element> elem;
+            Element::BoundingBox bbox;
+            bool opened; /**< Whether the open tag has been written (deferred so empty scopes self-close) */
+        };
+
+        void begin(Scope& scope);
+        void end(Scope& scope);
+
+        std::ostream& out;
+        std::vector<Scope> scopes; /**< The root, followed by every open scope */
+        SerializeOptions options;
+        Margins margins;
+        bool autoscale;
+        std::streampos placeholder = -1;
+        size_t n_elements = 0;
+        bool finished = false;
+    };
+
+    inline StreamingBuilder::StreamingBuilder(std::ostream& _out, SVG&& root, const bool _autoscale,
+        const Margins& _margins) : out(_out), margins(_margins), autoscale(_autoscale) {
+        /** Write the root <svg> tag, followed by its stylesheet and any other
+         *  children it already has
+         *
+         *  @param[in] _out       Stream to write the document to
+         *  @param[in] root       Root element, whose CSS rules are written up front
+         *  @param[in] _autoscale Fill in the root's width, height, and viewBox once
+         *                        finished, replacing any set beforehand
+         *  @param[in] _margins   Margins to autoscale with
+         */
+        SVGAttrib attrs = root.attr;
+        if (this->autoscale) {
+            attrs.erase("width");
+            attrs.erase("height");
+            attrs.erase("viewBox");
+        }
+
+        std::unique_ptr<Element> elem(new SVG(std::move(root)));
+        this->scopes.push_back({ std::move(elem), Element::BoundingBox(), true });
+        Scope& scope = this->scopes.back();
+        scope.bbox = scope.elem->subtree_bbox();
+
+        // Leave room after the closing ">" for attributes only known at the end,
+        // which are written over it (followed by a new ">") once finished
+        std::stringstream open_tag;
+        scope.elem->svg_open_tag(open_tag, 0, false, attrs);
+        std::string tag = open_tag.str();
+        tag.pop_back();
+        this->out << tag;
+        if (this->autoscale) this->placeholder = this->out.tellp();
+        this->out << ">";
+        if (this->placeholder != std::streampos(-1))
+            this->out << std::string(PLACEHOLDER_SIZE, ' ');
+        this->out << "\n";
+
+        for (auto& child : scope.elem->children) {
+            if (child->empty_output()) continue;
+            child->svg_to_stream(this->out, 1, this->options);
+            this->out << "\n";
+        }
+        scope.elem->children.clear();
+    }
+
+    template<typename T>
+    inline StreamingBuilder& StreamingBuilder::open(T&& scope) {
+        /** Open a new scope, such as a Group or nested SVG, which pushed
+         *  elements are written into until the matching close()
+         */
+        using Type = typename std::decay<T>::type;
+        static_assert(std::is_base_of<Element, Type>::value, "Scope must be an SVG element.");
+        if (this->finished) throw std::runtime_error("StreamingBuilder: document already finished");
+
+        this->begin(this->scopes.back());
+        std::unique_ptr<Element> elem(new Type(std::forward<T>(scope)));
+        this->scopes.push_back({ std::move(elem), Element::BoundingBox(), false });
+
+        Scope& top = this->scopes.back();
+        top.bbox = top.elem->subtree_bbox();
+        if (!top.elem->children.empty()) this->begin(top);
+        return *this;
+    }
+
+    template<typename T>
+    inline StreamingBuilder& StreamingBuilder::push(T&& elem) {
+        /** Write an element (and its children) into the innermost open scope */
+        static_assert(std::is_base_of<Element, typename std::decay<T>::type>::value,
+            "Child must be an SVG element.");
+        if (this->finished) throw std::runtime_error("StreamingBuilder: document already finished");
+        if (elem.empty_output()) return *this;
+
+        Scope& top = this->scopes.back();
+        this->begin(top);
+        top.bbox = top.bbox + elem.subtree_bbox();
+        elem.svg_to_stream(this->out, this->scopes.size(), this->options);
+        this->out << "\n";
+        this->n_elements++;
+        return *this;
+    }
+
+    inline StreamingBuilder& StreamingBuilder::close() {
+        /** Close the innermost open scope */
+        if (this->scopes.size() < 2)
+            throw std::runtime_error("StreamingBuilder: no open scope to close");
+
+        Element::BoundingBox bbox = this->scopes.back().bbox;
+        this->end(this->scopes.back());
+        this->scopes.pop_back();
+        this->scopes.back().bbox = this->scopes.back().bbox + bbox;
+        return *this;
+    }
+
+    inline void StreamingBuilder::begin(Scope& scope) {
+        /** Write the open tag of a scope if it hasn't been already */
+        if (scope.opened) return;
+        const size_t indent_level = &scope - this->scopes.data();
+        scope.elem->svg_open_tag(this->out, indent_level, false);
+        this->out << "\n";
+
+        for (auto& child : scope.elem->children) {
+            if (child->empty_output()) continue;
+            child->svg_to_stream(this->out, indent_level + 1, this->options);
+            this->out << "\n";
+        }
+        scope.elem->children.clear();
+        scope.opened = true;
+    }
+
+    inline void StreamingBuilder::end(Scope& scope) {
+        /** Write the close tag of a scope, or all of it if nothing was put inside */
+        const size_t indent_level = &scope - this->scopes.data();
+        if (scope.opened) scope.elem->svg_close_tag(this->out, indent_level);
+        else scope.elem->svg_to_stream(this->out, indent_level, this->options);
+        this->out << "\n";
+    }
+
+    inline bool StreamingBuilder::finish() {
+        /** Close every open scope and the root, and fill in the root's size
+         *  if autoscaling. Called automatically on destruction.
+         *
+         *  @return False if the size could not be written, because the stream
+         *          isn't seekable or the attributes didn't fit
+         */
+        if (this->finished) return true;
+        SVG_TRACE_SCOPE("StreamingBuilder::finish");
+        while (this->scopes.size() > 1) this->close();
+        this->scopes.front().elem->svg_close_tag(this->out, 0);
+        this->finished = true;
+
+        bool success = true;
+        if (this->autoscale) {
+            metrics::Timer timer(metrics::AUTOSCALE);
+            std::stringstream attrs;
+            for (auto& pair : Element::autoscale_attributes(this->bbox(), this->margins))
+                attrs << " " << pair.first << "=\"" << pair.second << "\"";
+
+            attrs << ">";
+            const std::string text = attrs.str();
+            const std::streampos end = this->out.tellp();
+            success = this->placeholder != std::streampos(-1) && end != std::streampos(-1)
+                && text.size() <= PLACEHOLDER_SIZE + 1;
+            if (success) {
+                this->out.seekp(this->placeholder);
+                this->out << text;
+                this->out.seekp(end);
+            }
+        }
+
+        this->out.flush();
+        return success && this->out.good();
+    }
+}
+
+#ifdef SVG_DEFINE_ALLOCATION_HOOKS
+/* Replacements for the global allocation functions which keep count for
+ * SVG::allocation_counts(). These must only be defined in one source file.
+ */
+void* operator new(size_t size) {
+    SVG::util::allocation_counters()[0].fetch_add(1, std::memory_order_relaxed);
+    SVG::util::allocation_counters()[2].fetch_add(size, std::memory_order_relaxed);
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) { return ::operator new(size); }
+
+void operator delete(void* ptr) noexcept {
+    if (!ptr) return;
+    SVG::util::allocation_counters()[1].fetch_add(1, std::memory_order_relaxed);
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept { ::operator delete(ptr); }
+void operator delete(void* ptr, size_t) noexcept { ::operator delete(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { ::operator delete(ptr); }
+#endif
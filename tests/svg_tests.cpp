@@ -1,8 +1,15 @@
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS // Old Catch signal handling does not build against newer glibc
 #include "catch.hpp"
+#define SVG_DEFINE_ALLOCATION_HOOKS
+#define SVG_ENABLE_TRACING
 #include "svg.hpp"
+#include <cstdlib>
+#include <set>
 
 SVG::SVG two_circles(int x = 0, int y = 0, int r = 0);
+std::string read_file(const std::string& filename);
+std::string temp_path(const std::string& filename);
 
 SVG::SVG two_circles(int x, int y, int r) {
     // Return an SVG with two circles in a <g>
@@ -123,6 +130,73 @@ TEST_CASE("autoscale() Test - Nested", "[test_autoscale_nested]") {
     REQUIRE(root.attr["viewBox"] == "-200.0 -200.0 400.0 400.0");
 }
 
+SVG::SVG polygon_drawing() {
+    /** Extends over x = [-10, 20] and y = [-5, 30] */
+    SVG::SVG root;
+    root << SVG::Polygon(std::vector<SVG::Point>{ { -10, -5 }, { 20, 0 }, { 5, 30 } });
+    return root;
+}
+
+SVG::SVG path_drawing() {
+    /** Extends over x = [10, 40] and y = [-20, 50] */
+    SVG::SVG root;
+    auto path = root.add_child<SVG::Path>();
+    path->start(40.0, -20.0);
+    path->line_to(10.0, 50.0);
+    return root;
+}
+
+SVG::SVG reversed_line_drawing() {
+    /** A line drawn right to left and bottom to top, over x = [-15, 30] and y = [4, 8] */
+    SVG::SVG root;
+    root << SVG::Line(30, -15, 8, 4);
+    return root;
+}
+
+TEST_CASE("autoscale() Test - Polygons, Paths and Lines", "[test_autoscale_shapes]") {
+    auto polygon = polygon_drawing(), path = path_drawing(), line = reversed_line_drawing();
+    polygon.autoscale(SVG::NO_MARGINS);
+    path.autoscale(SVG::NO_MARGINS);
+    line.autoscale(SVG::NO_MARGINS);
+
+    REQUIRE(polygon.attr["width"] == "30.0");
+    REQUIRE(polygon.attr["height"] == "35.0");
+    REQUIRE(polygon.attr["viewBox"] == "-10.0 -5.0 30.0 35.0");
+    REQUIRE(path.attr["width"] == "50.0");
+    REQUIRE(path.attr["height"] == "70.0");
+    REQUIRE(path.attr["viewBox"] == "10.0 -20.0 50.0 70.0");
+    REQUIRE(line.attr["width"] == "45.0");
+    REQUIRE(line.attr["height"] == "12.0");
+    REQUIRE(line.attr["viewBox"] == "-15.0 4.0 45.0 12.0");
+
+    // With the default margins of 10
+    polygon.autoscale();
+    REQUIRE(polygon.attr["width"] == "50.0");
+    REQUIRE(polygon.attr["height"] == "55.0");
+    REQUIRE(polygon.attr["viewBox"] == "-20.0 -15.0 50.0 55.0");
+}
+
+TEST_CASE("merge() and frame_animate() Test - Polygons, Paths and Lines", "[test_autoscale_shapes]") {
+    auto polygon = polygon_drawing(), path = path_drawing();
+    auto merged = SVG::merge(polygon, path);
+    auto parts = merged.get_immediate_children<SVG::SVG>();
+    REQUIRE(merged.attr["width"] == "120.0");
+    REQUIRE(merged.attr["height"] == "90.0");
+    REQUIRE(parts[0]->attr["viewBox"] == "-20.0 -15.0 50.0 55.0");
+    REQUIRE(parts[1]->attr["viewBox"] == "0.0 -30.0 70.0 90.0");
+    REQUIRE(parts[1]->attr["x"] == "50.0");
+
+    std::vector<SVG::SVG> frames;
+    frames.push_back(polygon_drawing());
+    frames.push_back(reversed_line_drawing());
+    auto anim = SVG::frame_animate(frames, 2);
+    auto anim_frames = anim.get_immediate_children<SVG::SVG>();
+    REQUIRE(anim.attr["viewBox"] == "0 0 65.000000 55.000000");
+    REQUIRE(anim_frames[1]->attr["viewBox"] == "-25.0 -6.0 65.0 32.0");
+    REQUIRE(anim_frames[0]->attr["x"] == "7.5");
+    REQUIRE(anim_frames[1]->attr["y"] == "11.5");
+}
+
 TEST_CASE("merge() Test", "[merge_test]") {
     auto s1 = two_circles(200, 200, 200), s2 = two_circles(200, 200, 200);
     auto merged = SVG::merge(s1, s2);
@@ -162,4 +236,1425 @@ TEST_CASE("Points Along a Circle Test", "[polar_points]") {
 
     REQUIRE(APPROX_EQUALS(points[3].first, 0, 1));
     REQUIRE(APPROX_EQUALS(points[3].second, -100, 1));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Streaming Output", "[test_stream]") {
+    SVG::SVG root = two_circles();
+    std::stringstream ss;
+    ss << root;
+    REQUIRE(ss.str() == std::string(root));
+}
+
+size_t count_occurrences(const std::string& haystack, const std::string& needle) {
+    size_t count = 0;
+    for (size_t pos = haystack.find(needle); pos != std::string::npos;
+        pos = haystack.find(needle, pos + needle.size())) count++;
+    return count;
+}
+
+TEST_CASE("AnimationWriter Test", "[test_animation_writer]") {
+    std::stringstream ss;
+    {
+        SVG::AnimationWriter writer(ss, 3, 2, 500, 500);
+        for (int i = 0; i < 3; i++)
+            writer << two_circles(0, 0, 10 * (i + 1));
+        REQUIRE(writer.frames_written() == 3);
+        REQUIRE_THROWS(writer << two_circles());
+    }
+
+    std::string anim = ss.str();
+    REQUIRE(anim.find("<svg viewBox=\"0 0 500.000000 500.000000\"") == 0);
+    REQUIRE(anim.find("animation-duration: 1.500000s;") != std::string::npos);
+    REQUIRE(count_occurrences(anim, "class=\"animated\"") == 3);
+    REQUIRE(count_occurrences(anim, "@keyframes anim_") == 3);
+    REQUIRE(anim.find("id=\"frame_2\"") != std::string::npos);
+    REQUIRE(anim.substr(anim.size() - 6) == "</svg>");
+}
+
+TEST_CASE("AnimationWriter - Missing Frames", "[test_animation_writer]") {
+    std::stringstream ss;
+    SVG::AnimationWriter writer(ss, 3, 2, 500, 500);
+    writer << two_circles();
+    REQUIRE_THROWS(writer.finish());
+
+    // The document is still closed, and only reported once
+    REQUIRE(ss.str().substr(ss.str().size() - 6) == "</svg>");
+    REQUIRE_NOTHROW(writer.finish());
+}
+
+TEST_CASE("Streaming frame_animate() Test", "[test_frame_animate_stream]") {
+    std::stringstream ss;
+    SVG::frame_animate(ss, 10, 5, 100, 100, [](const size_t i) {
+        return two_circles(0, 0, (int)i + 1);
+    });
+
+    std::string anim = ss.str();
+    REQUIRE(count_occurrences(anim, "class=\"animated\"") == 10);
+    REQUIRE(count_occurrences(anim, "</svg>") == 11);
+}
+
+TEST_CASE("SpatialIndex Test - Region Queries", "[test_spatial_index]") {
+    SVG::SVG root;
+    auto grid = root.add_child<SVG::Group>();
+    for (int i = 0; i < 50; i++)
+        for (int j = 0; j < 50; j++)
+            grid->add_child<SVG::Circle>(i * 10, j * 10, 2);
+
+    SVG::SpatialIndex index(root, 8);
+    REQUIRE(index.size() == 2500);
+
+    // Compare against a brute force search
+    SVG::Element::BoundingBox region(95, 155, 40, 61);
+    auto found = index.query(region);
+    size_t expected = 0;
+    for (auto& circ : root.get_children<SVG::Circle>())
+        if (circ->get_bbox().intersects(region)) expected++;
+
+    REQUIRE(found.size() == expected);
+    REQUIRE(found.size() == 6 * 3);
+
+    auto hits = index.query(SVG::Point(100.5, 99));
+    REQUIRE(hits.size() == 1);
+    REQUIRE(((SVG::Circle*)hits[0])->x() == 100);
+    REQUIRE(((SVG::Circle*)hits[0])->y() == 100);
+}
+
+TEST_CASE("SpatialIndex Test - Nearest and Updates", "[test_spatial_index_update]") {
+    SVG::SVG root;
+    for (int i = 0; i < 100; i++)
+        root.add_child<SVG::Rect>(i * 10, 0, 5, 5);
+
+    SVG::SpatialIndex index(root);
+    auto closest = (SVG::Rect*)index.nearest(SVG::Point(333, 50));
+    REQUIRE(closest->x() == 330);
+
+    // Move an element far away
+    closest->set_attr("x", 5000.0);
+    index.update(closest);
+    REQUIRE(index.query(SVG::Point(332, 2)).empty());
+    REQUIRE(index.nearest(SVG::Point(4990, 0)) == closest);
+
+    // Remove and re-add elements
+    REQUIRE(index.remove(closest));
+    REQUIRE_FALSE(index.remove(closest));
+    REQUIRE(index.size() == 99);
+    REQUIRE(index.query(SVG::Point(5001, 2)).empty());
+
+    auto added = root.add_child<SVG::Rect>(-20, -20, 5, 5);
+    index.insert(added);
+    REQUIRE(index.query(SVG::Element::BoundingBox(-30, -10, -30, -10)).size() == 1);
+    REQUIRE(index.nearest(SVG::Point(-100, -100)) == added);
+}
+
+TEST_CASE("subtree_bbox() Cache Invalidation", "[test_bbox_cache]") {
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+    auto rect = group->add_child<SVG::Rect>(0, 0, 10, 10);
+    REQUIRE(root.subtree_bbox().x2 == 10);
+
+    rect->set_attr("width", 50.0);
+    REQUIRE(root.subtree_bbox().x2 == 50);
+
+    group->add_child<SVG::Circle>(-100, 0, 10);
+    REQUIRE(root.subtree_bbox().x1 == -110);
+
+    // Elements moved into another container belong to it
+    SVG::SVG other;
+    other << std::move(root);
+    REQUIRE(other.subtree_bbox().x1 == -110);
+    REQUIRE(rect->get_parent() == group);
+    REQUIRE(group->get_parent()->get_parent() == &other);
+}
+
+TEST_CASE("Viewport Culling", "[test_cull]") {
+    SVG::SVG root;
+    auto points = root.add_child<SVG::Group>();
+    for (int i = 0; i < 100; i++)
+        points->add_child<SVG::Circle>(i * 10, 0, 1);
+
+    auto culled = root.serialize(SVG::SerializeOptions(SVG::Element::BoundingBox(-5, 45, -5, 5)));
+    REQUIRE(count_occurrences(culled, "<circle") == 5);
+    REQUIRE(count_occurrences(std::string(root), "<circle") == 100);
+
+    // Subtrees which are completely hidden are skipped
+    auto empty = root.serialize(SVG::SerializeOptions(SVG::Element::BoundingBox(-50, -40, -5, 5)));
+    REQUIRE(empty.find("<g") == std::string::npos);
+}
+
+TEST_CASE("Viewport Culling - Clipping", "[test_cull_clip]") {
+    SVG::SVG root;
+    root.add_child<SVG::Polygon>(std::vector<SVG::Point>{ { 0, 0 }, { 20, 0 }, { 20, 20 }, { 0, 20 } });
+    auto path = root.add_child<SVG::Path>();
+    path->start(-10, 5);
+    path->line_to(30, 5);
+
+    auto clipped = root.serialize(SVG::SerializeOptions(SVG::Element::BoundingBox(0, 10, 0, 10)));
+    REQUIRE(clipped.find("points=\"0.0,10.0 0.0,0.0 10.0,0.0 10.0,10.0 \"") != std::string::npos);
+    REQUIRE(clipped.find("d=\"M 0.000000 5.000000 L 10.000000 5.000000\"") != std::string::npos);
+
+    auto clip_polygon = root.get_children<SVG::Polygon>()[0];
+    REQUIRE(clip_polygon->get_bbox().x2 == 20);
+    REQUIRE(path->get_bbox().x1 == -10);
+}
+
+TEST_CASE("Liang-Barsky Line Clipping", "[test_clip_segment]") {
+    SVG::QuadCoord box = { 0, 10, 0, 10 };
+    SVG::Point a(-5, -5), b(15, 15);
+    REQUIRE(SVG::util::clip_segment(a, b, box));
+    REQUIRE(a == SVG::Point(0, 0));
+    REQUIRE(b == SVG::Point(10, 10));
+
+    SVG::Point c(-5, 20), d(20, 20);
+    REQUIRE_FALSE(SVG::util::clip_segment(c, d, box));
+
+    auto pieces = SVG::util::clip_polyline({ { 5, 5 }, { 20, 5 }, { 20, 8 }, { 5, 8 } }, box);
+    REQUIRE(pieces.size() == 2);
+}
+
+TEST_CASE("Tile Pyramid", "[test_tiles]") {
+    SVG::SVG root;
+    root.style("rect").set_attr("fill", "red");
+    auto grid = root.add_child<SVG::Group>();
+    grid->set_attr("class", "grid");
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 16; j++)
+            grid->add_child<SVG::Rect>(i * 10, j * 10, 5, 5);
+
+    SVG::TilePyramid pyramid(root, 256);
+    auto top = pyramid.tile(0, 0, 0);
+    REQUIRE(count_occurrences(top, "<rect") == 256);
+    REQUIRE(top.find("fill: red;") != std::string::npos);
+    REQUIRE(top.find("\t<g class=\"grid\">\n\t\t<rect") != std::string::npos);
+
+    // Each quadrant gets its own elements
+    auto quadrant = pyramid.tile(1, 1, 0);
+    REQUIRE(count_occurrences(quadrant, "<rect") == 64);
+    REQUIRE(quadrant.find("x=\"80.0\"") != std::string::npos);
+    REQUIRE(quadrant.find("x=\"70.0\"") == std::string::npos);
+
+    // Elements smaller than a pixel are thinned out
+    SVG::TilePyramid thumbnails(root, 4);
+    REQUIRE(count_occurrences(thumbnails.tile(0, 0, 0), "<rect") == 16);
+
+    // Text has no bounding box, so it goes in every tile, in document order
+    auto label = grid->add_child<SVG::Text>(0, 0, "Grid");
+    root << SVG::Text(100, 100, "Legend");
+    SVG::TilePyramid labelled(root, 256);
+    for (auto& tile : { labelled.tile(0, 0, 0), labelled.tile(1, 1, 0), labelled.tile(2, 3, 3) }) {
+        REQUIRE(count_occurrences(tile, "<text") == 2);
+        REQUIRE(tile.find(">Grid</text>") < tile.find(">Legend</text>"));
+        REQUIRE(count_occurrences(tile, "fill: red;") == 1);
+    }
+    REQUIRE(labelled.tile(1, 1, 0).find("\t<g class=\"grid\">\n\t\t<rect") != std::string::npos);
+    label->detach();
+    root.get_immediate_children<SVG::Text>()[0]->detach();
+
+    const std::string directory = temp_path("tile_test");
+    REQUIRE(pyramid.write(directory, 2, 4) == 21);
+    REQUIRE(count_occurrences(read_file(directory + "/2/3/3.svg"), "<rect") == 16);
+
+    for (int z = 2; z >= 0; z--) {
+        for (int x = 0; x < (1 << z); x++) {
+            for (int y = 0; y < (1 << z); y++)
+                std::remove((directory + "/" + std::to_string(z) + "/" + std::to_string(x) + "/" +
+                    std::to_string(y) + ".svg").c_str());
+            std::remove((directory + "/" + std::to_string(z) + "/" + std::to_string(x)).c_str());
+        }
+        std::remove((directory + "/" + std::to_string(z)).c_str());
+    }
+    std::remove(directory.c_str());
+    REQUIRE_THROWS(pyramid.write(temp_path("no_such_directory/tile_test"), 0));
+}
+
+TEST_CASE("Tile Pyramid - Coordinate Systems", "[test_tiles]") {
+    SVG::SVG root;
+    auto grid = root.add_child<SVG::Group>();
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 16; j++)
+            grid->add_child<SVG::Rect>(i * 10, j * 10, 5, 5);
+    SVG::TilePyramid plain(root, 256);
+
+    // Drawn in the top left corner, but placed far outside of it by their bounding boxes
+    auto moved = root.add_child<SVG::Group>();
+    moved->set_attr("transform", "translate(1000, 1000)");
+    moved->add_child<SVG::Rect>(-1000, -1000, 0.5, 0.5)->set_attr("id", "moved");
+    auto nested = root.add_child<SVG::SVG>(SVG::SVGAttrib{ { "x", "-500" } });
+    nested->add_child<SVG::Circle>(502, 2, 1);
+    grid->add_child<SVG::Rect>(-2000, 0, 1, 1)->set_attr("transform", "translate(2000, 0)");
+
+    // They're written to every tile, unculled and unthinned, and don't change the area covered
+    SVG::TilePyramid pyramid(root, 256);
+    REQUIRE(pyramid.tile_bbox(0, 0, 0).x2 == plain.tile_bbox(0, 0, 0).x2);
+    REQUIRE(pyramid.tile_bbox(0, 0, 0).y1 == plain.tile_bbox(0, 0, 0).y1);
+    for (auto& tile : { pyramid.tile(0, 0, 0), pyramid.tile(2, 0, 0), pyramid.tile(2, 3, 3) }) {
+        REQUIRE(tile.find("id=\"moved\"") != std::string::npos);
+        REQUIRE(tile.find("<circle") != std::string::npos);
+        REQUIRE(tile.find("translate(2000, 0)") != std::string::npos);
+    }
+    SVG::TilePyramid thumbnails(root, 1);
+    REQUIRE(thumbnails.tile(0, 0, 0).find("id=\"moved\"") != std::string::npos);
+}
+
+TEST_CASE("Rasterizer - Fills and Styles", "[test_raster]") {
+    SVG::SVG root;
+    root.set_attr("width", 10).set_attr("height", 10);
+    root.style("rect.left").set_attr("fill", "red");
+    root.style("#right").set_attr("fill", "#00f");
+    root.add_child<SVG::Rect>(0, 0, 5, 10)->set_attr("class", "left");
+    root.add_child<SVG::Rect>(5, 0, 5, 5)->set_attr("id", "right");
+
+    auto canvas = SVG::rasterize(root, 10, 10);
+    REQUIRE(canvas.get_pixel(2, 5) == SVG::Color({ 255, 0, 0, 255 }));
+    REQUIRE(canvas.get_pixel(7, 2) == SVG::Color({ 0, 0, 255, 255 }));
+    REQUIRE(canvas.get_pixel(7, 7) == SVG::WHITE);
+
+    // Inline styles win over stylesheets, and opacity blends
+    root.get_element_by_id("right")->set_attr("style", "fill: black; opacity: 0.5");
+    canvas = SVG::rasterize(root, 10, 10);
+    auto gray = canvas.get_pixel(7, 2);
+    REQUIRE(gray.r == gray.b);
+    REQUIRE(gray.r > 120);
+    REQUIRE(gray.r < 135);
+}
+
+TEST_CASE("Rasterizer - Transforms and Containers", "[test_raster]") {
+    SVG::SVG root;
+    root.set_attr("width", 20).set_attr("height", 20).set_attr("fill", "red");
+    root.add_child<SVG::Rect>(0, 0, 5, 5)->set_attr("transform", "translate(10, 10)");
+    auto rotated = root.add_child<SVG::Group>();
+    rotated->set_attr("transform", "rotate(90 10 10)").set_attr("fill", "blue");
+    rotated->add_child<SVG::Rect>(0, 0, 5, 5);
+
+    // Nothing inside <defs> or <marker> is drawn
+    auto defs = root.add_child<SVG::GenericElement>("defs");
+    defs->add_child<SVG::Rect>(0, 10, 5, 5);
+    root.add_child<SVG::GenericElement>("marker")->add_child<SVG::Circle>(3, 17, 2);
+
+    auto canvas = SVG::rasterize(root, 20, 20);
+    REQUIRE(canvas.get_pixel(12, 12) == SVG::Color({ 255, 0, 0, 255 }));
+    REQUIRE(canvas.get_pixel(2, 2) == SVG::WHITE);
+    REQUIRE(canvas.get_pixel(2, 12) == SVG::WHITE);
+    REQUIRE(canvas.get_pixel(3, 17) == SVG::WHITE);
+
+    // rotate(90 10 10) takes the top-left square to the top-right
+    REQUIRE(canvas.get_pixel(17, 2) == SVG::Color({ 0, 0, 255, 255 }));
+}
+
+TEST_CASE("Rasterizer - Anti-aliasing", "[test_raster]") {
+    SVG::SVG root;
+    root.set_attr("viewBox", "0 0 100 100");
+    root.add_child<SVG::Circle>(50, 50, 20);
+    root.add_child<SVG::Line>(0.0, 100.0, 90.0, 90.0)->set_attr("stroke", "lime").set_attr("stroke-width", 2);
+
+    // The viewBox is scaled to fit
+    auto canvas = SVG::rasterize(root, 200, 200);
+    REQUIRE(canvas.get_pixel(100, 100) == SVG::BLACK);
+    REQUIRE(canvas.get_pixel(10, 10) == SVG::WHITE);
+    REQUIRE(canvas.get_pixel(100, 20) == SVG::WHITE);
+    REQUIRE(canvas.get_pixel(90, 180).g == 255);
+
+    // Edge pixels are partially covered
+    size_t partial = 0;
+    for (unsigned int x = 0; x < 200; x++) {
+        auto px = canvas.get_pixel(x, 100);
+        if (px.r > 0 && px.r < 255) partial++;
+    }
+    REQUIRE(partial == 2);
+
+    // SIMD and scalar blending agree along a span
+    SVG::Canvas strip(11, 1);
+    strip.fill({ { { 0, 0 }, { 11, 0 }, { 11, 0.5 }, { 0, 0.5 } } }, { 0, 0, 0, 255 });
+    for (unsigned int x = 0; x < 11; x++)
+        REQUIRE(strip.get_pixel(x, 0) == strip.get_pixel(0, 0));
+    REQUIRE(strip.get_pixel(0, 0).r == 127);
+}
+
+TEST_CASE("Rasterizer - Image Output", "[test_raster]") {
+    SVG::Canvas canvas(3, 2, { 10, 20, 30, 255 });
+    std::stringstream ppm;
+    canvas.write_ppm(ppm);
+    std::string pixel = "\x0a\x14\x1e";
+    REQUIRE(ppm.str() == "P6\n3 2\n255\n" + pixel + pixel + pixel + pixel + pixel + pixel);
+
+    std::stringstream png;
+    canvas.write_png(png);
+    auto data = png.str();
+    REQUIRE(data.substr(0, 8) == "\x89PNG\r\n\x1a\n");
+    REQUIRE(data.substr(data.size() - 8) == "IEND\xae\x42\x60\x82");
+
+    // Known checksums
+    REQUIRE(SVG::util::crc32((const uint8_t*)"IEND", 4) == 0xAE426082);
+    REQUIRE(SVG::util::crc32((const uint8_t*)"123456789", 9) == 0xCBF43926);
+}
+
+TEST_CASE("Rasterizer - Tiled Rendering", "[test_raster]") {
+    SVG::SVG root;
+    root.set_attr("viewBox", "0 0 300 200");
+    root.style("rect").set_attr("fill", "blue").set_attr("stroke", "black");
+    for (int i = 0; i < 50; i++) {
+        root.add_child<SVG::Circle>(i * 6.1, (i * 37) % 200, 3 + i % 20)->set_attr("fill-opacity", 0.5);
+        root.add_child<SVG::Rect>((i * 53) % 300, i * 3.7, 15.5, 9.25);
+    }
+
+    // Tiles line up with pixel boundaries, so the result shouldn't depend on them
+    SVG::Rasterizer rasterizer(root, 300, 200);
+    auto serial = rasterizer.render(SVG::WHITE, 1, 1024),
+        parallel = rasterizer.render(SVG::WHITE, 8, 16);
+
+    size_t differences = 0;
+    for (unsigned int y = 0; y < 200; y++) {
+        for (unsigned int x = 0; x < 300; x++) {
+            auto a = serial.get_pixel(x, y), b = parallel.get_pixel(x, y);
+            if (std::abs(a.r - b.r) > 1 || std::abs(a.g - b.g) > 1 || std::abs(a.b - b.b) > 1)
+                differences++;
+        }
+    }
+    REQUIRE(differences == 0);
+}
+
+TEST_CASE("Parser - Round Trip", "[test_parser]") {
+    SVG::SVG root;
+    root.style("circle.big").set_attr("fill", "red").set_attr("stroke", "#000000");
+    root.keyframes("spin")["from"].set_attr("transform", "rotate(0deg)");
+    auto shapes = root.add_child<SVG::Group>();
+    shapes->set_attr("class", "shapes");
+    *shapes << SVG::Circle(-10, -10, 20) << SVG::Rect(0, 0, 5, 5) << SVG::Line(0.0, 1.0, 2.0, 3.0);
+    shapes->add_child<SVG::Circle>(1, 2, 3)->set_attr("id", "target").set_attr("class", "big");
+    shapes->add_child<SVG::Polygon>(std::vector<SVG::Point>{ { 0, 0 }, { 5, 0 }, { 5, 5 } });
+    shapes->add_child<SVG::Path>()->line_to(1.0, 2.0);
+    root << SVG::Text(1, 1, "Hello");
+    root.autoscale();
+
+    const std::string original = root;
+    auto parsed = SVG::parse(original);
+    REQUIRE(std::string(*parsed) == original);
+    REQUIRE(parsed->get_children<SVG::Circle>().size() == 2);
+    REQUIRE(parsed->get_children<SVG::Text>().size() == 1);
+
+    // Loaded documents can be modified like any other
+    parsed->get_element_by_id("target")->set_attr("r", 30);
+    auto modified = std::string(*parsed);
+    REQUIRE(modified.find("r=\"30\"") != std::string::npos);
+    REQUIRE(modified.find("fill: red;") != std::string::npos);
+    REQUIRE(modified.find("@keyframes spin") != std::string::npos);
+    REQUIRE(parsed->get_element_by_id("target")->get_bbox().x2 == 31);
+}
+
+TEST_CASE("Parser - Foreign Documents", "[test_parser]") {
+    const std::string document =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n"
+        "<svg xmlns='http://www.w3.org/2000/svg' width = \"100\" height=\"100\">\n"
+        "  <!-- A <comment> -->\n"
+        "  <title>Shapes &amp; more</title>\n"
+        "  <defs><linearGradient id=\"grad\"><stop offset=\"0\"/></linearGradient></defs>\n"
+        "  <rect x=\"1\" y=\"2\" width=\"3\" height=\"4\" fill=\"url(#grad)\"/>\n"
+        "  <text x=\"5\" y=\"5\">Hi <tspan font-weight=\"bold\">there</tspan></text>\n"
+        "</svg>\n";
+
+    auto parsed = SVG::parse(document);
+    auto output = std::string(*parsed);
+    REQUIRE(output.find("<title>Shapes &amp; more</title>") != std::string::npos);
+    REQUIRE(output.find("<stop offset=\"0\" />") != std::string::npos);
+    REQUIRE(output.find("<text x=\"5\" y=\"5\">Hi <tspan font-weight=\"bold\">there</tspan></text>") != std::string::npos);
+    REQUIRE(output.find("comment") == std::string::npos);
+    REQUIRE(parsed->get_children()["linearGradient"].size() == 1);
+    REQUIRE(parsed->get_children<SVG::Rect>()[0]->get_bbox().y2 == 6);
+
+    REQUIRE_THROWS(SVG::parse("<svg><g></svg>"));
+    REQUIRE_THROWS(SVG::parse("<svg><rect x=1 /></svg>"));
+    REQUIRE_THROWS(SVG::parse("<svg><text>Unclosed</textPath></svg>"));
+    REQUIRE_THROWS(SVG::parse("<svg></svg><svg></svg>"));
+    REQUIRE_THROWS(SVG::parse("<svg>"));
+}
+
+TEST_CASE("Parser - Quoting and End Tags", "[test_parser]") {
+    // End tags are only matched by their whole name
+    const std::string document =
+        "<svg xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "\t<text x=\"0\" y=\"0\"><textPath href=\"#p\">Along</textPath> and <tspan>on</tspan></text >\n"
+        "\t<style>rect { fill: red; }</styles></style>\n"
+        "</svg>";
+    auto parsed = SVG::parse(document);
+    REQUIRE(parsed->get_children<SVG::Text>().size() == 1);
+    auto output = std::string(*parsed);
+    REQUIRE(output.find("<textPath href=\"#p\">Along</textPath> and <tspan>on</tspan></text>") != std::string::npos);
+    REQUIRE(output.find("fill: red;") != std::string::npos);
+    REQUIRE(std::string(*SVG::parse(output)) == output);
+
+    // Single-quoted values are written back double-quoted, so their double quotes are escaped
+    auto quoted = SVG::parse("<svg><text font-family='\"Times New Roman\", serif' x=\"0\" y=\"0\">A</text></svg>");
+    const std::string expected = "font-family=\"&quot;Times New Roman&quot;, serif\"";
+    output = std::string(*quoted);
+    REQUIRE(output.find(expected) != std::string::npos);
+    REQUIRE(std::string(*SVG::parse(output)) == output);
+}
+
+TEST_CASE("MappedDocument - Verbatim Round Trip", "[test_mapped]") {
+    SVG::SVG root;
+    root.style("rect").set_attr("fill", "red");
+    auto shapes = root.add_child<SVG::Group>();
+    for (int i = 0; i < 10; i++)
+        shapes->add_child<SVG::Rect>(i, i, 5, 5)->set_attr("id", "rect" + std::to_string(i));
+    root << SVG::Text(1, 1, "a > b");
+    root.autoscale();
+
+    const std::string original = root, filename = temp_path("mapped_test.svg");
+    std::ofstream(filename, std::ios::binary) << original;
+
+    {
+        SVG::MappedDocument doc(filename);
+        REQUIRE(std::string(doc) == original);
+        REQUIRE(doc.size() == 14);
+        REQUIRE(doc.root().tag() == SVG::util::StringView("svg"));
+        REQUIRE(doc.root().children().size() == 3);
+        REQUIRE(doc.get_elements_by_tag("rect").size() == 10);
+
+        // Values are read in place
+        auto rect = doc.get_element_by_id("rect3");
+        REQUIRE(rect.parent().tag() == SVG::util::StringView("g"));
+        REQUIRE(std::string(rect.get_attr("x")) == "3.0");
+        REQUIRE(!doc.get_element_by_id("nope"));
+
+        // Only the modified start tag changes
+        rect.set_attr("x", 30.0).set_attr("stroke", "blue");
+        REQUIRE(std::string(rect.get_attr("x")) == "30.0");
+        std::string expected = original, before = "<rect height=\"5.0\" id=\"rect3\" width=\"5.0\" x=\"3.0\" y=\"3.0\" />";
+        expected.replace(expected.find(before), before.size(),
+            "<rect height=\"5.0\" id=\"rect3\" width=\"5.0\" x=\"30.0\" y=\"3.0\" stroke=\"blue\" />");
+        REQUIRE(std::string(doc) == expected);
+    }
+
+    std::remove(filename.c_str());
+    REQUIRE_THROWS(SVG::MappedDocument(filename));
+
+    const std::string malformed = "<svg><g></svg>";
+    REQUIRE_THROWS(SVG::MappedDocument(malformed.data(), malformed.size()));
+
+    // Empty files are mapped to nothing at all
+    std::ofstream(filename, std::ios::binary).close();
+    REQUIRE_THROWS_WITH(SVG::MappedDocument(filename), Catch::Contains("no root element"));
+    REQUIRE_THROWS(SVG::MappedDocument(nullptr, 0));
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("MappedDocument - Escaping Modified Values", "[test_mapped]") {
+    const std::string original = "<svg><text font-family='\"A&amp;B\", serif' x=\"0\">Hi</text></svg>";
+    SVG::MappedDocument doc(original.data(), original.size());
+    auto text = doc.get_elements_by_tag("text")[0];
+    text.set_attr("title", "a < b & \"c\"");
+    REQUIRE(std::string(text.get_attr("title")) == "a &lt; b &amp; &quot;c&quot;");
+
+    // Values copied from the original are already escaped, apart from double quotes
+    const std::string output = doc;
+    REQUIRE(output == "<svg><text font-family=\"&quot;A&amp;B&quot;, serif\" x=\"0\" "
+        "title=\"a &lt; b &amp; &quot;c&quot;\">Hi</text></svg>");
+    auto parsed = SVG::parse(output);
+    REQUIRE(std::string(*parsed).find("title=\"a &lt; b &amp; &quot;c&quot;\"") != std::string::npos);
+}
+
+TEST_CASE("Incremental Serialization", "[test_output_cache]") {
+    SVG::SVG root;
+    auto shapes = root.add_child<SVG::Group>();
+    for (int i = 0; i < 5; i++)
+        shapes->add_child<SVG::Circle>(i, i, 1)->set_attr("id", "circle" + std::to_string(i));
+    auto path = root.add_child<SVG::Path>();
+    path->start(0.0, 0.0);
+
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    auto before = root.serialize(cached);
+    REQUIRE(root.serialize(cached) == before);
+    REQUIRE(std::string(root) == before);
+
+    // Changes anywhere in the tree show up in the next output
+    root.get_element_by_id("circle3")->set_attr("r", 5);
+    path->line_to(1.0, 1.0);
+    root.style("circle").set_attr("fill", "red");
+    *shapes << SVG::Rect(0, 0, 1, 1);
+
+    auto after = root.serialize(cached);
+    REQUIRE(after.find("cx=\"3.0\" cy=\"3.0\" id=\"circle3\" r=\"5\"") != std::string::npos);
+    REQUIRE(after.find("L 1.000000 1.000000") != std::string::npos);
+    REQUIRE(after.find("fill: red;") != std::string::npos);
+    REQUIRE(after.find("<rect") != std::string::npos);
+
+    // Subtrees written on their own are indented differently than within the document
+    REQUIRE(std::string(*shapes).substr(0, 4) == "<g>\n");
+    std::stringstream ss;
+    ss << root;
+    REQUIRE(ss.str() == after);
+    REQUIRE(std::string(root) == after);
+}
+
+TEST_CASE("Incremental Serialization - Direct Edits", "[test_output_cache]") {
+    SVG::SVG root;
+    auto rect = root.add_child<SVG::Rect>(0, 0, 1, 1);
+    REQUIRE(std::string(root).find("id=") == std::string::npos);
+
+    // Output isn't cached by default, so edits which bypass set_attr() are seen
+    rect->attr["id"] = "x";
+    REQUIRE(std::string(root).find("id=\"x\"") != std::string::npos);
+    REQUIRE(root.memory_stats().cache.bytes == 0);
+
+    // Cached output has to be invalidated by hand
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialize(cached);
+    rect->attr["id"] = "y";
+    REQUIRE(root.serialize(cached).find("id=\"x\"") != std::string::npos);
+    REQUIRE(std::string(root).find("id=\"y\"") != std::string::npos);
+    rect->invalidate();
+    REQUIRE(root.serialize(cached).find("id=\"y\"") != std::string::npos);
+}
+
+std::string read_file(const std::string& filename) {
+    std::ifstream infile(filename, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+}
+
+std::string temp_path(const std::string& filename) {
+    /** Where to put files which are removed again, outside the working directory */
+#ifdef _WIN32
+    const char* dir = std::getenv("TEMP");
+#else
+    const char* dir = std::getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+#endif
+    return dir && *dir ? std::string(dir) + "/" + filename : filename;
+}
+
+void write_file(const std::string& filename, const std::string& contents) {
+    std::ofstream outfile(filename, std::ios::binary);
+    outfile << contents;
+}
+
+SVG::SVG patch_test_document() {
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+    auto shapes = root.add_child<SVG::Group>();
+    shapes->set_attr("id", "shapes");
+    for (int i = 0; i < 6; i++)
+        shapes->add_child<SVG::Circle>(i * 10, 0, 5)->set_attr("id", "c" + std::to_string(i));
+    root << SVG::Text(0, 20, "Version 1");
+    root << SVG::Rect(0, 0, 100, 100);
+    return root;
+}
+
+TEST_CASE("Diff and Patch - File Round Trip", "[test_patch]") {
+    auto before = patch_test_document(), after = patch_test_document();
+    REQUIRE(before.subtree_hash() == after.subtree_hash());
+    REQUIRE(SVG::diff(before, after) == "[]");
+
+    // Attribute changes, removals, inserts, reordering, text and stylesheet changes
+    after.get_element_by_id("c1")->set_attr("r", 8).set_attr("class", "big");
+    after.get_element_by_id("c4")->set_attr("cy", 50);
+    after.style("rect").set_attr("stroke", "blue");
+    after << SVG::Line(0.0, 10.0, 0.0, 10.0);
+
+    auto modified = SVG::parse(std::string(after));
+    auto reordered = SVG::parse(
+        "<svg xmlns=\"http://www.w3.org/2000/svg\"><g id=\"shapes\">"
+        "<circle id=\"c5\" /><circle id=\"c0\" /><circle id=\"c3\" /><polygon points=\"0,0 1,1 1,0\" />"
+        "</g><text>Version 2</text></svg>");
+    REQUIRE(before.subtree_hash() != modified->subtree_hash());
+
+    const std::string before_file = temp_path("patch_before.svg"), patch_file = temp_path("patch.json");
+    for (auto target : { modified.get(), reordered.get() }) {
+        write_file(before_file, std::string(before));
+        write_file(patch_file, SVG::diff(before, *target));
+
+        auto client = SVG::load(before_file);
+        SVG::apply_patch(*client, read_file(patch_file));
+        REQUIRE(std::string(*client) == std::string(*target));
+        REQUIRE(client->subtree_hash() == target->subtree_hash());
+    }
+
+    auto patch = SVG::diff(before, *reordered);
+    REQUIRE(patch.find("\"op\":\"move\"") != std::string::npos);
+    REQUIRE(patch.find("\"op\":\"remove\"") != std::string::npos);
+    REQUIRE(patch.find("<polygon") != std::string::npos);
+    REQUIRE(patch.find("c5") == std::string::npos); // Matched circles are moved, not re-sent
+
+    std::remove(before_file.c_str());
+    std::remove(patch_file.c_str());
+    REQUIRE_THROWS(SVG::apply_patch(before, "[{\"op\": \"remove\", \"path\": [9]}]"));
+
+    // Malformed patches are rejected rather than guessed at
+    for (auto& malformed : { "[x]", "[1 2]", "[1,]", "[-]", "[{\"op\": \"remove\" \"path\": [0]}]",
+        "[{\"op\": \"remove\", \"path\": [0],}]", "[{\"op\": \"remove\", \"path\": [0]}", "[nan]",
+        "[] x", "[]]", "[] []", "{}" })
+        REQUIRE_THROWS(SVG::apply_patch(before, malformed));
+    REQUIRE_NOTHROW(SVG::apply_patch(before, " [ ] "));
+
+    // As are operations that don't address what they act on exactly
+    const std::string unchanged = before;
+    for (auto& invalid : { "[{\"op\": \"remove\", \"path\": []}]", "[{\"op\": \"remove\"}]",
+        "[{\"op\": \"insert\", \"path\": [], \"svg\": \"<rect />\"}]",
+        "[{\"op\": \"remove\", \"path\": [-1]}]", "[{\"op\": \"remove\", \"path\": [0.5]}]",
+        "[{\"op\": \"remove\", \"path\": [\"1\"]}]", "[{\"op\": \"remove\", \"path\": [1, 1e300]}]",
+        "[{\"op\": \"attr\", \"path\": [-0.5], \"set\": {\"id\": \"x\"}}]",
+        "[{\"op\": \"move\", \"path\": [1], \"from\": -1, \"to\": 0}]",
+        "[{\"op\": \"move\", \"path\": [1], \"from\": 0, \"to\": 1.5}]",
+        "[{\"op\": \"move\", \"path\": [1], \"from\": 0}]" })
+        REQUIRE_THROWS(SVG::apply_patch(before, invalid));
+    REQUIRE(std::string(before) == unchanged);
+}
+
+TEST_CASE("Binary Format - Round Trip", "[test_binary]") {
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+    root.keyframes("pulse")["50%"].set_attr("opacity", 0.5);
+    auto shapes = root.add_child<SVG::Group>();
+    for (int i = 0; i < 100; i++)
+        shapes->add_child<SVG::Circle>(i * 1.5, -i * 2.25, 3)->set_attr("id", "c" + std::to_string(i));
+    shapes->add_child<SVG::Rect>(0, 0, 10, 10)->set_attr("width", "10px").set_attr("height", 7);
+    root << SVG::Text(1, 2, "Hello <b>world</b>");
+    auto foreign = SVG::parse("<svg><defs><title>Title</title></defs><rect x=\"01.5\" y=\"-0.0\" /></svg>");
+    root.add_child<SVG::Group>()->add_child<SVG::Group>()->set_attr("class", "nested");
+    root.autoscale();
+
+    auto binary = SVG::to_binary(root);
+    REQUIRE(binary.substr(0, 4) == "SVGB");
+    REQUIRE(std::string(*SVG::from_binary(binary)) == std::string(root));
+
+    auto foreign_binary = SVG::to_binary(*foreign);
+    REQUIRE(std::string(*SVG::from_binary(foreign_binary)) == std::string(*foreign));
+
+    // Navigate lazily without decoding everything
+    const std::string filename = temp_path("binary_test.svgb");
+    std::ofstream(filename, std::ios::binary) << binary;
+    {
+        SVG::BinaryDocument doc(filename);
+        auto top = doc.root();
+        REQUIRE(top.tag() == SVG::util::StringView("svg"));
+        auto children = top.children();
+        REQUIRE(children.size() == 4);
+        REQUIRE(children[1].children().size() == 101);
+        REQUIRE(children[1].children()[2].attributes()["cx"] == "3.0");
+        REQUIRE(children[1].children()[2].attributes()["cy"] == "-4.5");
+        REQUIRE(std::string(children[2].content()) == "Hello <b>world</b>");
+
+        auto rect = children[1].children()[100].load();
+        REQUIRE(std::string(*rect) == "<rect height=\"7\" width=\"10px\" x=\"0.0\" y=\"0.0\" />");
+    }
+    std::remove(filename.c_str());
+
+    REQUIRE_THROWS(SVG::from_binary("SVGB"));
+    REQUIRE_THROWS(SVG::from_binary(binary.substr(0, binary.size() / 2)));
+    binary[4] = 2;
+    REQUIRE_THROWS(SVG::from_binary(binary));
+}
+
+TEST_CASE("Binary Format - Corrupt Input", "[test_binary]") {
+    SVG::Group group;
+    group.set_attr("id", "abc");
+    const std::string binary = SVG::to_binary(group);
+    REQUIRE(std::string(*SVG::from_binary(binary)) == "<g id=\"abc\" />");
+
+    // Cut off anywhere
+    for (size_t length = 0; length < binary.size(); length++)
+        REQUIRE_THROWS(SVG::from_binary(binary.substr(0, length)));
+
+    // A value of an unknown kind, which follows the 20 byte header, the node
+    // header and content (24 bytes) and the attribute's name
+    std::string corrupt = binary;
+    REQUIRE(corrupt[48] == 0); // STRING
+    corrupt[48] = 7;
+    REQUIRE_THROWS_WITH(SVG::from_binary(corrupt), "Corrupt binary SVG");
+    SVG::BinaryDocument doc(corrupt.data(), corrupt.size());
+    REQUIRE_THROWS(doc.root().attributes());
+}
+
+std::unique_ptr<SVG::Element> build_row(const size_t row) {
+    auto group = std::make_unique<SVG::Group>();
+    group->set_attr("id", "row" + std::to_string(row));
+    for (size_t i = 0; i < 20; i++)
+        group->add_child<SVG::Circle>(i * 10.0, row * 10.0, 4);
+    return group;
+}
+
+TEST_CASE("Concurrent Construction", "[test_concurrent]") {
+    SVG::SVG serial, parallel;
+    for (size_t i = 0; i < 50; i++)
+        serial.adopt(build_row(i));
+    SVG::build_parallel(parallel, 50, build_row, 8);
+
+    // Order doesn't depend on which thread finished first
+    REQUIRE(std::string(parallel) == std::string(serial));
+    REQUIRE(parallel.get_children<SVG::Circle>().size() == 1000);
+    REQUIRE(parallel.subtree_bbox().y2 == 494);
+
+    // Adopted subtrees aren't moved, and can be moved elsewhere again
+    auto row = build_row(50);
+    SVG::Element* original = row.get();
+    REQUIRE(parallel.adopt(std::move(row)) == original);
+    REQUIRE(original->get_parent() == &parallel);
+    REQUIRE(parallel.subtree_bbox().y2 == 504);
+
+    SVG::SVG other;
+    other.adopt(original->detach());
+    REQUIRE(original->get_parent() == &other);
+    REQUIRE(parallel.subtree_bbox().y2 == 494);
+    REQUIRE(other.get_element_by_id("row50") == original);
+    REQUIRE(other.detach() == nullptr);
+
+    REQUIRE_THROWS(SVG::build_parallel(parallel, 10, [](const size_t i) -> std::unique_ptr<SVG::Element> {
+        if (i == 7) throw std::runtime_error("Oops");
+        return std::make_unique<SVG::Group>();
+    }, 4));
+}
+
+class Marker : public SVG::Rect {
+public:
+    using SVG::Rect::Rect;
+protected:
+    SVG::ElementKind element_kind() override { return SVG::ElementKind::Other; }
+};
+
+class Badge : public SVG::Rect {
+public:
+    using SVG::Rect::Rect;
+};
+
+class Ellipse : public SVG::Circle {
+public:
+    using SVG::Circle::Circle;
+protected:
+    std::string tag() override { return "ellipse"; }
+};
+
+struct ShapeCounter {
+    size_t circles = 0, rects = 0, others = 0;
+    void operator()(SVG::Circle&) { circles++; }
+    void operator()(SVG::Rect&) { rects++; }
+    void operator()(SVG::Element&) { others++; }
+};
+
+TEST_CASE("Element Kinds", "[test_kind]") {
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+    *group << SVG::Circle(0, 0, 1) << SVG::Rect(0, 0, 1, 1) << Marker(0, 0, 2, 2);
+    group->add_child<SVG::Group>()->add_child<SVG::Circle>(5, 5, 1);
+    auto badge = root.add_child<Badge>(0, 0, 3, 3);
+
+    REQUIRE(root.kind() == SVG::ElementKind::SVG);
+    REQUIRE(group->kind() == SVG::ElementKind::Group);
+    REQUIRE(root.get_children<SVG::Circle>().size() == 2);
+    REQUIRE(root.get_children<SVG::Group>().size() == 2);
+    REQUIRE(group->get_immediate_children<SVG::Group>().size() == 1);
+
+    // Classes derived from built-ins are still told apart by exact type
+    REQUIRE(root.get_children<SVG::Rect>().size() == 1);
+    REQUIRE(root.get_children<Marker>().size() == 1);
+    REQUIRE(root.get_children<Badge>().size() == 1);
+    REQUIRE(root.get_immediate_children<SVG::Rect>().empty());
+    REQUIRE(root.get_children()["rect"].size() == 3);
+    badge->detach();
+
+    ShapeCounter counter;
+    root.visit(counter);
+    REQUIRE(counter.circles == 2);
+    REQUIRE(counter.rects == 1);
+    REQUIRE(counter.others == 5); // svg, its stylesheet, two groups, the marker
+
+    // Elements parsed or patched in get their kind too
+    auto parsed = SVG::parse(std::string(root));
+    REQUIRE(parsed->get_children<SVG::Circle>().size() == 2);
+    REQUIRE(parsed->get_children<SVG::Rect>().size() == 2);
+}
+
+TEST_CASE("Element Kinds - Renamed Subclasses", "[test_kind]") {
+    SVG::SVG root;
+    root << Ellipse(0, 0, 1);
+    REQUIRE(root.get_children()["ellipse"][0]->kind() == SVG::ElementKind::Other);
+
+    // Written and grouped under their own tag, not their base class's
+    std::string output = root;
+    REQUIRE(output.find("<ellipse") != std::string::npos);
+    REQUIRE(output.find("<circle") == std::string::npos);
+    REQUIRE(root.get_children()["ellipse"].size() == 1);
+    REQUIRE(root.get_children()["circle"].empty());
+    REQUIRE(root.get_children<SVG::Circle>().empty());
+}
+
+TEST_CASE("Tag Names", "[test_kind]") {
+    static_assert(SVG::kind_tag(SVG::KindOf<SVG::Circle>::value).size() == 6, "Tags are compile-time constants");
+    REQUIRE(SVG::kind_tag(SVG::KindOf<SVG::Group>::value) == SVG::util::StringView("g"));
+    REQUIRE(SVG::kind_tag(SVG::ElementKind::Generic).empty());
+
+    // Built-in, foreign and user-defined elements all serialize and group by tag
+    auto root = SVG::parse("<svg><defs><marker /></defs><g><circle r=\"1\" /><circle r=\"2\" /></g></svg>");
+    root->get_children<SVG::Group>()[0]->add_child<Marker>(0, 0, 1, 1);
+    auto child_map = root->get_children();
+    REQUIRE(child_map["defs"].size() == 1);
+    REQUIRE(child_map["marker"].size() == 1);
+    REQUIRE(child_map["circle"].size() == 2);
+    REQUIRE(child_map["rect"].size() == 1);
+    REQUIRE(count_occurrences(std::string(*root), "</defs>") == 1);
+    REQUIRE(count_occurrences(std::string(*root), "<rect") == 1);
+}
+
+TEST_CASE("Memory Statistics", "[test_memory]") {
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+
+    // Everything a subtree allocates while being built is still owned by it
+    auto before = SVG::allocation_counts();
+    auto group = std::make_unique<SVG::Group>();
+    for (size_t i = 0; i < 100; i++)
+        group->add_child<SVG::Circle>(i, i, 5);
+    group->set_attr("class", std::string(100, 'x'));
+    auto live = SVG::allocation_counts().live() - before.live();
+
+    auto stats = group->memory_stats();
+    REQUIRE(stats.elements == 101);
+    REQUIRE(stats.by_tag["circle"].allocations == 100 * 4); // Each circle and its three attributes
+    REQUIRE(stats.total().allocations == live);
+    REQUIRE(stats.cache.bytes == 0);
+    REQUIRE(stats.attributes.bytes > 100);
+
+    root.adopt(std::move(group));
+    std::string output = root;
+    REQUIRE(root.memory_stats().cache.bytes == 0);
+
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialize(cached);
+    stats = root.memory_stats();
+    REQUIRE(stats.elements == 103);
+    REQUIRE(stats.by_tag["style"].bytes > 0);
+    REQUIRE(stats.cache.bytes >= output.size());
+    REQUIRE(stats.total().bytes > stats.nodes.bytes + stats.attributes.bytes);
+}
+
+TEST_CASE("Tracing", "[test_trace]") {
+    SVG::trace::clear();
+    SVG::SVG root;
+    SVG::build_parallel(root, 8, build_row, 4);
+    root.autoscale();
+    std::string output = root;
+
+    std::stringstream trace;
+    SVG::trace::write_chrome_trace(trace);
+    auto json = SVG::util::parse_json(trace.str());
+    auto& events = json["traceEvents"].array;
+
+    std::set<std::string> names;
+    for (auto& event : events) {
+        names.insert(event["name"].string);
+        REQUIRE(event["ph"].string == "X");
+        REQUIRE(event["dur"].number >= 0);
+    }
+    REQUIRE(count_occurrences(trace.str(), "\"build_parallel part\"") == 8);
+    REQUIRE(names.count("build_parallel"));
+    REQUIRE(names.count("autoscale"));
+    REQUIRE(names.count("svg_to_string"));
+
+    // Buffers of exited threads are reused rather than piling up
+    auto& registry = SVG::trace::registry();
+    auto n_rings = [&registry]() {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        return registry.rings.size();
+    };
+    const size_t rings = n_rings();
+    for (int i = 0; i < 10; i++) {
+        std::thread([]() { SVG_TRACE_SCOPE("short-lived"); }).join();
+        REQUIRE(n_rings() <= rings + 1);
+    }
+    trace.str("");
+    SVG::trace::write_chrome_trace(trace);
+    REQUIRE(count_occurrences(trace.str(), "\"short-lived\"") == 10); // Along with their events
+
+    // Old events are overwritten once a thread's buffer is full
+    SVG::trace::clear();
+    for (size_t i = 0; i < SVG::trace::Ring::CAPACITY + 10; i++) {
+        SVG_TRACE_SCOPE("overflow");
+    }
+    trace.str("");
+    SVG::trace::write_chrome_trace(trace);
+    REQUIRE(count_occurrences(trace.str(), "\"overflow\"") == SVG::trace::Ring::CAPACITY);
+
+    // Traces can be written while another thread keeps wrapping around its buffer
+    std::atomic<bool> stop(false);
+    std::thread recorder([&stop]() {
+        while (!stop) {
+            SVG_TRACE_SCOPE("busy");
+        }
+    });
+    for (int i = 0; i < 20; i++) {
+        trace.str("");
+        SVG::trace::write_chrome_trace(trace);
+        REQUIRE(count_occurrences(trace.str(), "\"busy\"") <= SVG::trace::Ring::CAPACITY);
+        REQUIRE(trace.str().find("\"name\": \"\"") == std::string::npos);
+    }
+    stop = true;
+    recorder.join();
+}
+
+TEST_CASE("Metrics", "[test_metrics]") {
+    using namespace SVG::metrics;
+    auto before = snapshot();
+    const size_t circle = ELEMENTS_ADDED + (size_t)SVG::ElementKind::Circle;
+
+    SVG::SVG root;
+    SVG::build_parallel(root, 10, build_row, 4); // Counted on each worker thread
+    root.autoscale();
+    root.autoscale();
+    std::string output = root;
+
+    auto after = snapshot();
+    REQUIRE(after[circle] - before[circle] == 200);
+    REQUIRE(after[ELEMENTS_ADDED + (size_t)SVG::ElementKind::Group] -
+        before[ELEMENTS_ADDED + (size_t)SVG::ElementKind::Group] == 10);
+    REQUIRE(after[ATTRIBUTES_FORMATTED] - before[ATTRIBUTES_FORMATTED] >= 600);
+    REQUIRE(after[SERIALIZED_BYTES] - before[SERIALIZED_BYTES] == output.size());
+    REQUIRE(after[BBOX_CACHE_HITS] > before[BBOX_CACHE_HITS]);
+    REQUIRE(after[OPERATION_CALLS + AUTOSCALE] - before[OPERATION_CALLS + AUTOSCALE] == 2);
+    REQUIRE(after[OPERATION_CALLS + SVG_TO_STRING] - before[OPERATION_CALLS + SVG_TO_STRING] == 1);
+
+    // Every byte is attributed to exactly one element
+    uint64_t element_bytes = 0;
+    for (size_t kind = 0; kind < N_KINDS; kind++)
+        element_bytes += after[ELEMENT_BYTES + kind] - before[ELEMENT_BYTES + kind];
+    REQUIRE(element_bytes == output.size());
+
+    // Whether streamed or cached
+    std::stringstream streamed;
+    streamed << root;
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialize(cached);
+    auto written_after = snapshot();
+    element_bytes = 0;
+    for (size_t kind = 0; kind < N_KINDS; kind++)
+        element_bytes += written_after[ELEMENT_BYTES + kind] - after[ELEMENT_BYTES + kind];
+    REQUIRE(streamed.str() == output);
+    REQUIRE(element_bytes == 2 * output.size());
+    REQUIRE(written_after[SERIALIZED_BYTES] - after[SERIALIZED_BYTES] == 2 * output.size());
+
+    auto text = prometheus();
+    REQUIRE(text.find("# TYPE svg_elements_added_total counter") != std::string::npos);
+    REQUIRE(text.find("svg_elements_added_total{type=\"circle\"} ") != std::string::npos);
+    REQUIRE(text.find("svg_operation_seconds_total{operation=\"autoscale\"} ") != std::string::npos);
+
+    // Margins given as a fraction are one more call, not two
+    root.autoscale(0.1);
+    REQUIRE(snapshot()[OPERATION_CALLS + AUTOSCALE] - after[OPERATION_CALLS + AUTOSCALE] == 1);
+
+    REQUIRE(save("metrics.prom"));
+    REQUIRE(read_file("metrics.prom").find("svg_bbox_cache_hits_total ") != std::string::npos);
+    std::remove("metrics.prom");
+}
+
+TEST_CASE("Asynchronous File Output", "[test_async]") {
+    SVG::SVG root;
+    SVG::build_parallel(root, 100, build_row, 4);
+
+    // Small buffers so that writing has to wait for the disk
+    const std::string filename = temp_path("async_output.svg");
+    {
+        SVG::AsyncFileWriter out(filename, 4096, 2);
+        out << root;
+        REQUIRE(out.close());
+    }
+    REQUIRE(root.memory_stats().cache.bytes == 0); // Nothing was kept
+
+    const std::string expected = root;
+    REQUIRE(read_file(filename) == expected);
+
+    // Cached output is written in one piece
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    {
+        SVG::AsyncFileWriter out(filename);
+        root.serialize(out, cached);
+        out << std::flush;
+        REQUIRE(read_file(filename) == expected);
+    }
+    REQUIRE(read_file(filename) == expected);
+
+    std::remove(filename.c_str());
+
+    SVG::AsyncFileWriter bad("no_such_directory/async_output.svg");
+    REQUIRE(!bad);
+    REQUIRE(!bad.close());
+}
+
+TEST_CASE("Scatter-Gather Output", "[test_gather]") {
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+    SVG::build_parallel(root, 20, build_row, 4);
+    root.add_child<SVG::Group>(); // Empty, so self-closing
+    auto circle = root.get_children<SVG::Circle>()[42];
+
+    // Nothing cached yet
+    const std::string filename = temp_path("gather_output.svg");
+    {
+        SVG::GatherWriter out(filename);
+        out.write(root);
+        REQUIRE(out.close());
+        REQUIRE(out.bytes_written() == std::string(root).size());
+    }
+    REQUIRE(read_file(filename) == std::string(root));
+
+    // After a change, unchanged rows are written straight from their caches
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    root.serialize(cached);
+    circle->set_attr("r", 10);
+    {
+        SVG::GatherWriter out(filename);
+        out.write(root);
+        REQUIRE(out.close());
+        REQUIRE(out.fragments_written() > 20);
+    }
+    REQUIRE(read_file(filename) == std::string(root));
+
+    std::remove(filename.c_str());
+
+    SVG::GatherWriter bad("no_such_directory/gather_output.svg");
+    REQUIRE(!bad.is_open());
+    REQUIRE(!bad.close());
+}
+
+std::string read_chunked(SVG::Element& root, const size_t chunk_size) {
+    SVG::ChunkedSerializer serializer(root, chunk_size);
+    std::string ret, chunk;
+    while (serializer.next(chunk)) {
+        REQUIRE(chunk.size() <= chunk_size);
+        ret += chunk;
+    }
+    REQUIRE(serializer.done());
+    return ret;
+}
+
+TEST_CASE("Chunked Serialization", "[test_chunked]") {
+    auto root = SVG::parse("<svg><defs><marker id=\"m\"><path d=\"M 0 0 L 1 1\" /></marker></defs>"
+        "<title>Rows</title><style>circle { fill: red; }</style></svg>");
+    for (size_t i = 0; i < 5; i++) root->adopt(build_row(i));
+    root->add_child<SVG::Group>();
+
+    const std::string expected = *root;
+
+    // Nothing is cached along the way
+    for (size_t chunk_size : { 1, 7, 100, 1 << 16 })
+        REQUIRE(read_chunked(*root, chunk_size) == expected);
+    REQUIRE(root->memory_stats().cache.bytes == 0);
+
+    // Partly and fully cached documents
+    SVG::SerializeOptions cached;
+    cached.cache = true;
+    REQUIRE(root->serialize(cached) == expected);
+    root->get_children<SVG::Circle>()[10]->set_attr("r", 1);
+    const std::string changed = *root;
+    REQUIRE(read_chunked(*root, 13) == changed);
+    REQUIRE(root->serialize(cached) == changed);
+    REQUIRE(read_chunked(*root, 13) == changed);
+}
+
+TEST_CASE("Streaming Builder", "[test_streaming]") {
+    // Same document, built as a tree
+    SVG::SVG tree;
+    tree.style("circle").set_attr("fill", "red");
+    auto rows = tree.add_child<SVG::Group>();
+    rows->set_attr("id", "rows");
+    for (size_t i = 0; i < 3; i++) rows->adopt(build_row(i));
+    tree.add_child<SVG::Group>();
+    *tree.add_child<SVG::Group>() << SVG::Circle(-50, -20, 5);
+    tree << SVG::Line(0, 100, 0, 100);
+
+    auto build = [](SVG::StreamingBuilder& builder) {
+        SVG::Group rows;
+        rows.set_attr("id", "rows");
+        builder.open(std::move(rows));
+        for (size_t i = 0; i < 3; i++) {
+            builder.open(SVG::Group());
+            builder.push(std::move(*build_row(i)));
+            REQUIRE(builder.depth() == 2);
+            builder.close();
+        }
+        builder.close().open(SVG::Group()).close();
+        builder.open(SVG::Group()) << SVG::Circle(-50, -20, 5);
+        builder.close() << SVG::Line(0, 100, 0, 100);
+    };
+
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+
+    SECTION("Output matches the tree") {
+        // Wrap each row to match the extra scopes opened above
+        SVG::SVG wrapped;
+        wrapped.style("circle").set_attr("fill", "red");
+        auto wrapped_rows = wrapped.add_child<SVG::Group>();
+        wrapped_rows->set_attr("id", "rows");
+        for (size_t i = 0; i < 3; i++) wrapped_rows->add_child<SVG::Group>()->adopt(build_row(i));
+        wrapped.add_child<SVG::Group>();
+        *wrapped.add_child<SVG::Group>() << SVG::Circle(-50, -20, 5);
+        wrapped << SVG::Line(0, 100, 0, 100);
+
+        std::stringstream out;
+        SVG::StreamingBuilder builder(out, std::move(root), false);
+        build(builder);
+        REQUIRE(builder.finish());
+        REQUIRE(out.str() == std::string(wrapped));
+        REQUIRE(builder.elements_written() == 5);
+    }
+
+    SECTION("Trailing autoscale") {
+        tree.autoscale();
+        std::stringstream out;
+        SVG::StreamingBuilder builder(out, std::move(root));
+        build(builder);
+        REQUIRE(builder.finish());
+
+        auto parsed = SVG::parse(out.str());
+        for (auto attr : { "width", "height", "viewBox" })
+            REQUIRE(parsed->attr[attr] == tree.attr[attr]);
+        REQUIRE(parsed->get_children<SVG::Circle>().size() == 61);
+
+        // The start tag ends right after the attributes, padded on the same line
+        const std::string first_line = out.str().substr(0, out.str().find('\n'));
+        REQUIRE(first_line.find("\">") == first_line.find_last_not_of(' ') - 1);
+        REQUIRE(first_line.find('>') == first_line.find_last_not_of(' '));
+    }
+
+    SECTION("Unseekable streams") {
+        // A stream which can only be appended to
+        struct AppendOnly : std::stringbuf {
+            pos_type seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override { return pos_type(-1); }
+        } buffer;
+        std::ostream out(&buffer);
+
+        SVG::StreamingBuilder builder(out, std::move(root));
+        build(builder);
+        REQUIRE_FALSE(builder.finish());
+        REQUIRE(SVG::parse(buffer.str())->attr.count("width") == 0);
+    }
+}
+
+TEST_CASE("Serialized Size", "[test_size]") {
+    // A class derived from a built-in one which writes itself differently
+    class Badge : public SVG::Circle {
+    public:
+        using SVG::Circle::Circle;
+    protected:
+        void svg_to_stream(std::ostream& out, const size_t indent_level, const SVG::SerializeOptions&) override {
+            out << std::string(indent_level, '\t') << "<!-- badge -->\n" << std::string(indent_level, '\t') << "<circle />";
+        }
+    };
+
+    auto root = SVG::parse("<svg><defs><marker id=\"m\"><path d=\"M 0 0 L 1 1\" /></marker></defs>"
+        "<title>Rows</title><desc>Nested <b>markup</b></desc><svg x=\"5000\"><rect width=\"1\" height=\"1\" /></svg></svg>");
+    auto& svg = static_cast<SVG::SVG&>(*root);
+    svg.style("circle").set_attr("fill", "red").set_attr("stroke", "#000000");
+    svg.keyframes("spin")["from"].set_attr("transform", "rotate(0deg)");
+    svg.keyframes("spin")["to"].set_attr("transform", "rotate(360deg)");
+    for (size_t i = 0; i < 5; i++) root->adopt(build_row(i));
+    auto shapes = root->add_child<SVG::Group>();
+    shapes->add_child<SVG::Polygon>(std::vector<SVG::Point>{ { -50, 0 }, { 5, 0 }, { 5, 5 }, { 5.01, 5 } });
+    auto path = shapes->add_child<SVG::Path>();
+    path->start(-40.0, 1.0);
+    path->line_to(60.0, 30.0);
+    path->line_to(60.01, 30.0);
+    *shapes << SVG::Text(1, 1, "Hello") << Badge(0, 0, 1) << Ellipse(0, 0, 1);
+    shapes->add_child<SVG::Group>();
+
+    SVG::SerializeOptions culled(SVG::Element::BoundingBox(0, 45, 0, 45)), simplified;
+    simplified.simplify = 0.5;
+    for (auto& options : { SVG::SerializeOptions(), culled, simplified })
+        REQUIRE(root->serialized_size(options) == root->serialize(options).size());
+    REQUIRE(root->serialized_size(culled) < root->serialized_size());
+    REQUIRE(root->serialized_size(simplified) != root->serialized_size());
+    REQUIRE(shapes->serialized_size() == std::string(*shapes).size());
+
+    // Cached sizes are updated after changes
+    REQUIRE(root->serialized_size() == std::string(*root).size());
+    root->get_children<SVG::Circle>()[3]->set_attr("r", 1000);
+    svg.style("rect").set_attr("fill", "blue");
+    REQUIRE(root->serialized_size() == std::string(*root).size());
+}
+
+TEST_CASE("Memory-Mapped Output", "[test_mapped_output]") {
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+    auto rows = root.add_child<SVG::Group>();
+    SVG::build_parallel(*rows, 400, build_row, 4); // Large enough to be split up
+    root.add_child<SVG::Group>(); // Empty, so self-closing
+    root << SVG::Text(0, 0, "Rows");
+    REQUIRE(root.serialized_size() > 1 << 17);
+
+    SVG::SerializeOptions culled(SVG::Element::BoundingBox(0, 50, 0, 50)), cached;
+    cached.cache = true;
+    const std::string filename = temp_path("mapped_output.svg");
+    std::string expected;
+    {
+        SVG::MappedWriter out(filename, 4);
+        REQUIRE(out.write(root));
+        REQUIRE(out.write(root, cached));
+        expected += std::string(root) + std::string(root);
+
+        root.get_children<SVG::Circle>()[42]->set_attr("r", 10);
+        REQUIRE(out.write(root, cached)); // Partly cached
+        REQUIRE(out.write(root, culled));
+        REQUIRE(out.close());
+        expected += std::string(root) + root.serialize(culled);
+        REQUIRE(out.bytes_written() == expected.size());
+    }
+
+    const std::string written = read_file(filename);
+    REQUIRE(written.size() == expected.size()); // Separate, since failures would print the whole file
+    REQUIRE(written == expected);
+    std::remove(filename.c_str());
+
+    SVG::MappedWriter bad("no_such_directory/mapped_output.svg");
+    REQUIRE(!bad.is_open());
+    REQUIRE(!bad.write(root));
+}
+
+TEST_CASE("Viewport Culling - Coordinate Systems", "[test_cull]") {
+    // Everything here but the last circle is drawn inside of the viewport
+    SVG::SVG root;
+    auto nested = root.add_child<SVG::SVG>(SVG::SVGAttrib{ { "x", "100" } });
+    nested->add_child<SVG::Circle>(-95, 5, 1);
+    auto moved = root.add_child<SVG::Group>();
+    moved->set_attr("transform", "translate(200, 0)");
+    for (int i = 0; i < 1000; i++)
+        moved->add_child<SVG::Circle>(-195, 5 + i % 10, 1);
+    auto outer = root.add_child<SVG::Group>(); // Untransformed, but holding something that is
+    outer->add_child<SVG::Rect>(500, 500, 1, 1);
+    auto inner = outer->add_child<SVG::Group>();
+    inner->set_attr("transform", "translate(300, 0)");
+    inner->add_child<SVG::Polygon>(std::vector<SVG::Point>{ { -295, 0 }, { -200, 0 }, { -200, 5 } });
+    root.add_child<SVG::Circle>(500, 500, 1);
+
+    SVG::SerializeOptions culled(SVG::Element::BoundingBox(0, 50, 0, 50));
+    const std::string output = root.serialize(culled);
+    REQUIRE(count_occurrences(output, "<circle") == 1001);
+    REQUIRE(count_occurrences(output, "<g") == 3);
+    REQUIRE(output.find("<rect") == std::string::npos);
+    REQUIRE(output.find("points=\"-295.0,0.0 -200.0,0.0 -200.0,5.0 \"") != std::string::npos); // Not clipped
+    REQUIRE(root.serialized_size(culled) == output.size());
+
+    const std::string filename = temp_path("culled_output.svg");
+    {
+        SVG::MappedWriter out(filename, 4);
+        REQUIRE(out.write(root, culled));
+    }
+    REQUIRE(read_file(filename) == output);
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("Memory-Mapped Output - Wrong Sizes", "[test_mapped_output]") {
+    // Writes more every time, so it's always longer than when it was measured
+    class Wordy : public SVG::Rect {
+    protected:
+        void svg_to_stream(std::ostream& out, const size_t indent_level, const SVG::SerializeOptions& options) override {
+            SVG::Rect::svg_to_stream(out, indent_level, options);
+            out << "<!-- " << std::string(++this->n_calls, '!') << " -->";
+        }
+
+    private:
+        size_t n_calls = 0;
+    };
+
+    SVG::SVG good, bad;
+    good << SVG::Rect(0, 0, 1, 1);
+    bad << Wordy();
+    const std::string filename = temp_path("mapped_output.svg");
+    {
+        SVG::MappedWriter out(filename, 2);
+        REQUIRE(out.write(good));
+        REQUIRE(out.write(bad));
+        REQUIRE(out.write(good));
+        REQUIRE(out.close());
+    }
+
+    // The mispredicted document was written the ordinary way instead
+    const std::string written = read_file(filename), good_output = good;
+    REQUIRE(written.size() > 2 * good_output.size());
+    const std::string bad_output = written.substr(good_output.size(), written.size() - 2 * good_output.size());
+    REQUIRE(written == good_output + bad_output + good_output);
+    REQUIRE(bad_output.find("<svg xmlns=\"http://www.w3.org/2000/svg\">\n\t<rect /><!-- !") == 0);
+    REQUIRE(bad_output.substr(bad_output.size() - 11) == " -->\n</svg>");
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("Content Hashes", "[test_hash]") {
+    // Reference values for XXH64
+    REQUIRE(SVG::util::Hasher().update("").digest() == 0xef46db3751d8e999ULL);
+    REQUIRE(SVG::util::Hasher().update("abc").digest() == 0x44bc2cf5ad770999ULL);
+    REQUIRE(SVG::util::Hasher::hash("Nobody inspects the spammish repetition") == 0xfbcea83c8a378bf1ULL);
+
+    SVG::SVG root;
+    root.style("circle").set_attr("fill", "red");
+    SVG::build_parallel(root, 20, build_row, 4);
+    const std::string output = root;
+
+    // Hashing as it's written, in pieces of any size
+    SVG::util::Hasher pieces;
+    for (size_t i = 0; i < output.size(); i += 7)
+        pieces.update(output.data() + i, std::min((size_t)7, output.size() - i));
+    REQUIRE(pieces.digest() == SVG::util::Hasher::hash(output));
+    REQUIRE(root.output_hash(SVG::SerializeOptions()) == SVG::util::Hasher::hash(output));
+
+    // Moving a character between an attribute's name and value changes the hash
+    SVG::Rect left, right;
+    left.set_attr("ab", "c");
+    right.set_attr("a", "bc");
+    REQUIRE(left.subtree_hash() != right.subtree_hash());
+}
+
+TEST_CASE("Skipping Unchanged Files", "[test_hash]") {
+    const std::string manifest = temp_path("incremental.manifest");
+    std::remove(manifest.c_str());
+    std::vector<std::unique_ptr<SVG::SVG>> docs;
+    for (size_t i = 0; i < 3; i++) {
+        docs.push_back(std::make_unique<SVG::SVG>());
+        docs.back()->adopt(build_row(i));
+    }
+    auto filename = [](const size_t i) { return temp_path("incremental_" + std::to_string(i) + ".svg"); };
+
+    {
+        SVG::IncrementalWriter writer(manifest);
+        for (size_t i = 0; i < 3; i++) REQUIRE(writer.write(*docs[i], filename(i)));
+        REQUIRE(writer.save());
+    }
+
+    // A later run only writes what changed, or went missing
+    docs[1]->get_children<SVG::Circle>()[3]->set_attr("r", 10);
+    std::remove(filename(2).c_str());
+    for (bool hash_output : { true, false }) {
+        SVG::IncrementalWriter writer(manifest, hash_output);
+        REQUIRE(writer.unchanged(*docs[0], filename(0)) == hash_output); // Recorded hashes are of output
+        for (size_t i = 0; i < 3; i++) writer.write(*docs[i], filename(i));
+        REQUIRE(writer.files_written() == (hash_output ? 2 : 3));
+        REQUIRE(writer.files_skipped() == (hash_output ? 1 : 0));
+    }
+
+    // Which leaves the manifest with hashes of the trees
+    {
+        SVG::IncrementalWriter writer(manifest, false);
+        for (size_t i = 0; i < 3; i++) {
+            REQUIRE(read_file(filename(i)) == std::string(*docs[i]));
+            REQUIRE(!writer.write(*docs[i], filename(i)));
+        }
+        REQUIRE_THROWS(writer.write(*docs[0], "no_such_directory/incremental.svg"));
+    }
+
+    // Editing attr directly bypasses the cached tree hashes, but not the output's
+    {
+        SVG::IncrementalWriter writer(manifest);
+        for (size_t i = 0; i < 3; i++) writer.write(*docs[i], filename(i));
+        REQUIRE(writer.files_written() == 3);
+
+        docs[0]->get_children<SVG::Circle>()[0]->attr["r"] = "7";
+        REQUIRE(writer.write(*docs[0], filename(0)));
+        REQUIRE(read_file(filename(0)) == std::string(*docs[0]));
+        REQUIRE(read_file(filename(0)).find("r=\"7\"") != std::string::npos);
+        REQUIRE(!writer.write(*docs[0], filename(0)));
+    }
+
+    std::remove(manifest.c_str());
+    for (size_t i = 0; i < 3; i++) std::remove(filename(i).c_str());
+}